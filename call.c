@@ -1,33 +1,15 @@
 #include "elevator.h"
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <source> <destination>\n", argv[0]);
-        return 1;
-    }
-
-    const char *source = argv[1];
-    const char *destination = argv[2];
-
-    // Validate floors
-    floor_info source_info = parse_floor(source);
-    floor_info dest_info = parse_floor(destination);
+#define CALL_MAX_ATTEMPTS 3
 
-    if (!source_info.ok || !dest_info.ok) {
-        printf("Invalid floor(s) specified.\n");
-        return 1;
-    }
-
-    if (strcmp(source, destination) == 0) {
-        printf("You are already on that floor!\n");
-        return 1;
-    }
+building_topology topology;          // Empty unless started with --topology
 
-    // Connect to controller
+// Send one request and return the controller's reply, or NULL if it can't be reached.
+// With keep_fd the connection stays open for further replies and is stored there.
+char *send_request(const char *message, int *keep_fd) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
-        printf("Unable to connect to elevator system.\n");
-        return 1;
+        return NULL;
     }
 
     struct sockaddr_in addr;
@@ -35,50 +17,242 @@ int main(int argc, char *argv[]) {
     addr.sin_family = AF_INET;
     addr.sin_port = htons(CONTROLLER_PORT);
     if (inet_pton(AF_INET, CONTROLLER_IP, &addr.sin_addr) <= 0) {
-        printf("Unable to connect to elevator system.\n");
         close(fd);
-        return 1;
+        return NULL;
     }
 
     if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        printf("Unable to connect to elevator system.\n");
         close(fd);
-        return 1;
+        return NULL;
     }
 
-    // Send CALL message
-    char call_msg[32];
-    snprintf(call_msg, sizeof(call_msg), "CALL %s %s", source, destination);
-
-    if (write_message(fd, call_msg) < 0) {
-        printf("Unable to connect to elevator system.\n");
+    if (write_message(fd, message) < 0) {
         close(fd);
-        return 1;
+        return NULL;
     }
 
     // Read response
     char *response = read_message(fd);
+    if (keep_fd && response) {
+        *keep_fd = fd;
+    } else {
+        close(fd);
+    }
+    return response;
+}
+
+// priority is "" for an ordinary call, or " PRIORITY" / " RESERVE"; extras
+// is the optional " ID", " ETA" and " WATCH" flags
+char *send_call(const char *source, const char *destination, const char *priority, const char *extras,
+                int *keep_fd) {
+    char call_msg[64];
+    snprintf(call_msg, sizeof(call_msg), "CALL %s %s%s%s", source, destination, priority, extras);
+    return send_request(call_msg, keep_fd);
+}
+
+// Print a "CAR <name> [<id>] [ETA <ms>]" reply. Returns 0 if it isn't one.
+int report_car(const char *response, const char *verb) {
+    char car_name[32];
+    int n = 0;
+    if (sscanf(response, "CAR %31s%n", car_name, &n) != 1) {
+        return 0;
+    }
+
+    const char *rest = response + n;
+    unsigned id = 0;
+    int eta_ms = -1, m = 0;
+    if (sscanf(rest, " %u%n", &id, &m) == 1) {
+        rest += m;
+    }
+    sscanf(rest, " ETA %d", &eta_ms);
+
+    printf("Car %s %s", car_name, verb);
+    if (eta_ms >= 0) printf(" in %.1f s", eta_ms / 1000.0);
+    if (id != 0) printf(" (call %u)", id);
+    printf(".\n");
+    return 1;
+}
+
+// Print the controller's updates for a watched call until it ends
+int follow_call(int fd) {
+    char *update;
+    int result = 1;
+    while ((update = read_message(fd)) != NULL) {
+        int eta_ms;
+        int done = 1;
+        if (sscanf(update, "ETA %d", &eta_ms) == 1) {
+            printf("Now arriving in %.1f s.\n", eta_ms / 1000.0);
+            done = 0;
+        } else if (report_car(update, "is now arriving")) {
+            done = 0;
+        } else if (strcmp(update, "ARRIVED") == 0) {
+            printf("Your car has arrived.\n");
+            result = 0;
+        } else if (strncmp(update, "CANCELLED ", 10) == 0) {
+            printf("Call cancelled.\n");
+        } else {
+            printf("Sorry, no car is available to take this request.\n");
+        }
+        fflush(stdout);
+        free(update);
+        if (done) break;
+    }
+    close(fd);
+    return result;
+}
+
+// Withdraw a call made with --id
+int cancel_call(const char *id) {
+    char cancel_msg[32];
+    snprintf(cancel_msg, sizeof(cancel_msg), "CANCEL %s", id);
+    char *response = send_request(cancel_msg, NULL);
     if (!response) {
         printf("Unable to connect to elevator system.\n");
-        close(fd);
         return 1;
     }
 
-    // Process response
-    if (strncmp(response, "CAR ", 4) == 0) {
-        char car_name[32];
-        if (sscanf(response, "CAR %31s", car_name) == 1) {
-            printf("Car %s is arriving.\n", car_name);
+    int cancelled = strncmp(response, "CANCELLED ", 10) == 0;
+    printf(cancelled ? "Call %s cancelled.\n" : "Call %s can't be cancelled.\n", id);
+    free(response);
+    return cancelled ? 0 : 1;
+}
+
+// Print the controller's pickup wait percentiles
+int show_stats(void) {
+    char *response = send_request("STATS", NULL);
+    if (!response) {
+        printf("Unable to connect to elevator system.\n");
+        return 1;
+    }
+
+    unsigned calls, overdue, estimated, bunched;
+    long p50, p99, p999, max, eta_err, eta_bias;
+    char traffic[16];
+    int fields = sscanf(response, "STATS %u %ld %ld %ld %ld %u %u %ld %ld %15s %u", &calls, &p50, &p99, &p999,
+                        &max, &overdue, &estimated, &eta_err, &eta_bias, traffic, &bunched);
+    if (fields != 6 && fields < 9) {
+        printf("Unexpected reply: %s\n", response);
+        free(response);
+        return 1;
+    }
+    printf("Pickups: %u\nWait p50: %ld ms\nWait p99: %ld ms\nWait p99.9: %ld ms\nWait max: %ld ms\nOver max wait: %u\n",
+           calls, p50, p99, p999, max, overdue);
+    if (fields >= 9) {
+        printf("Estimated pickups: %u\nETA error: %ld ms\nETA bias: %+ld ms\n", estimated, eta_err, eta_bias);
+    }
+    if (fields >= 10) {
+        printf("Traffic: %s\n", traffic);
+    }
+    if (fields >= 11) {
+        printf("Bunched: %u%%\n", bunched);
+    }
+    free(response);
+    return 0;
+}
+
+// A floor given by number, or with a topology, by its label. The building
+// has to have it.
+floor_info call_floor(const char *arg, char *floor) {
+    floor_info info = parse_floor(arg);
+    if (!info.ok && topology_find_label(&topology, arg, &info.numeric) == 0) {
+        info.ok = 1;
+        info.is_basement = info.numeric < 0;
+    }
+    if (info.ok && !topology_stops_at(&topology, -1, info.numeric)) info.ok = 0;
+    if (info.ok) floor_to_string(info.numeric, info.is_basement, floor);
+    return info;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 2 && strcmp(argv[1], "--stats") == 0) {
+        return show_stats();
+    }
+    if (argc == 3 && strcmp(argv[1], "--cancel") == 0) {
+        return cancel_call(argv[2]);
+    }
+
+    const char *priority = "";
+    int want_id = 0, want_eta = 0, watch = 0;
+    int bad_args = (argc < 3);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--priority") == 0) {
+            priority = " PRIORITY";
+        } else if (strcmp(argv[i], "--reserve") == 0) {
+            priority = " RESERVE";
+        } else if (strcmp(argv[i], "--id") == 0) {
+            want_id = 1;
+        } else if (strcmp(argv[i], "--eta") == 0) {
+            want_eta = 1;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            watch = 1;
+        } else if (strcmp(argv[i], "--topology") == 0 && i + 1 < argc) {
+            if (load_topology(argv[++i], &topology) != 0) return 1;
         } else {
-            printf("Sorry, no car is available to take this request.\n");
+            bad_args = 1;
         }
-    } else if (strcmp(response, "UNAVAILABLE") == 0) {
-        printf("Sorry, no car is available to take this request.\n");
-    } else {
-        printf("Sorry, no car is available to take this request.\n");
+    }
+    if (bad_args) {
+        fprintf(stderr, "Usage: %s <source> <destination> [--priority|--reserve] [--id] [--eta] [--watch] [--topology <file>] | %s --cancel <id> | %s --stats\n",
+                argv[0], argv[0], argv[0]);
+        return 1;
     }
 
+    char source[MAX_FLOOR_LEN], destination[MAX_FLOOR_LEN];
+    floor_info source_info = call_floor(argv[1], source);
+    floor_info dest_info = call_floor(argv[2], destination);
+
+    // Validate floors
+    if (!source_info.ok || !dest_info.ok) {
+        printf("Invalid floor(s) specified.\n");
+        return 1;
+    }
+
+    if (strcmp(source, destination) == 0) {
+        printf("You are already on that floor!\n");
+        return 1;
+    }
+
+    char extras[24];
+    snprintf(extras, sizeof(extras), "%s%s%s", want_id ? " ID" : "", want_eta && !watch ? " ETA" : "",
+             watch ? " WATCH" : "");
+
+    // Ask the controller, honouring its retry-after hint if it is overloaded
+    char *response = NULL;
+    int watch_fd = -1;
+    for (int attempt = 0; attempt < CALL_MAX_ATTEMPTS; attempt++) {
+        response = send_call(source, destination, priority, extras, watch ? &watch_fd : NULL);
+        if (!response) {
+            printf("Unable to connect to elevator system.\n");
+            return 1;
+        }
+
+        int retry_ms;
+        if (sscanf(response, "UNAVAILABLE RETRY %d", &retry_ms) != 1 || attempt + 1 == CALL_MAX_ATTEMPTS) {
+            break;
+        }
+        free(response);
+        response = NULL;
+        if (watch_fd >= 0) {
+            close(watch_fd);
+            watch_fd = -1;
+        }
+        delay_ms(retry_ms);
+    }
+
+    // Process response
+    int assigned = report_car(response, "is arriving");
+    if (!assigned) {
+        printf("Sorry, no car is available to take this request.\n");
+    }
     free(response);
-    close(fd);
+
+    if (watch_fd >= 0) {
+        fflush(stdout);
+        if (!assigned) {
+            close(watch_fd);
+            return 0;
+        }
+        return follow_call(watch_fd);
+    }
     return 0;
 }
\ No newline at end of file
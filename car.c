@@ -6,6 +6,9 @@
 #define SELECT_TIMEOUT_USEC 10000U
 #define IDLE_DELAY_MS 50U
 #define MAX_SLEEP_MS 10U
+#define CONNECT_TIMEOUT_MS 1000U
+#define RECONNECT_MAX_MS 2000U
+#define NO_POSITION INT_MIN
 
 static void safe_copy_status(char *dest, const char *src, size_t dest_size) {
     strncpy(dest, src, dest_size - 1);
@@ -28,9 +31,36 @@ typedef struct {
     volatile int running;
     volatile int connected;
     char last_sent_status[CAR_MESSAGE_MAX_LEN];
+    int connect_fd;                  // Non-blocking connect in progress, or -1
+    struct timespec connect_started; // When connect_fd was opened
+    struct timespec next_attempt;    // Earliest time for the next connect attempt
+    int backoff_ms;                  // Current reconnect backoff, 0 after a success
+    unsigned int jitter_seed;
+    int heartbeat;                   // Advertise HEARTBEAT and answer PINGs
+    int route_enabled;               // Advertise ROUTE and work through the stop list locally
+    int vacant_enabled;              // Advertise VACANT and report stops where nobody used the doors
+    int dwell_enabled;               // Advertise DWELL and take the controller's dwell hints
+    int dwell_ms;                    // How long the doors stay open at this stop, guarded by shm->mutex
+    int overlap_ms;                  // Door travel overlapped with the steps into and out of a stop
+    int departing;                   // Next step is the first one away from a stop, main thread only
+    int express_floors;              // Floors between position reports on a run, 0 to report every floor
+    int lowest_numeric;              // Floor range, parsed once for express runs
+    int highest_numeric;
+    _Atomic int position;            // Floor an express run has reached, or NO_POSITION between runs
+    _Atomic int retarget;            // Set when the destination may have changed during an express run
+    int motion_enabled;              // Time runs with the motion profile instead of delay_ms per floor
+    motion_profile motion;
+    int run_origin;                  // Floor the current run set off from, main thread only
+    int topology_car;                // This car's entry in the topology, or -1 if it stops everywhere
+    int doorway_used;                // Doorway or door buttons touched this door cycle, guarded by shm->mutex
+    char vacant_floor[MAX_FLOOR_LEN]; // Stop to report as VACANT, guarded by shm->mutex
+    char route[MAX_FLOOR_COUNT][MAX_FLOOR_LEN]; // Stops still to serve, guarded by shm->mutex
+    int route_len;
+    char pending_floor[MAX_FLOOR_LEN]; // FLOOR that arrived after we'd passed it, guarded by shm->mutex
 } car_state;
 
 car_state car;
+building_topology topology;          // Empty unless started with --topology
 
 volatile sig_atomic_t shutdown_requested = 0;
 
@@ -39,10 +69,32 @@ void cleanup_and_exit() {
     if (car.connected && car.controller_fd >= 0) {
         close(car.controller_fd);
     }
-    cleanup_shared_memory(car.name);
+    release_shared_memory(car.name);
     exit(0);
 }
 
+// The segment mutex can't be recovered (its holder died and the state was
+// never made consistent), so nothing this car does can be trusted any more
+void abandon_shared_memory(int rc) {
+    fprintf(stderr, "Car %s: shared memory unusable (%s)\n", car.name, strerror(rc));
+    car.running = 0;
+    if (car.connected && car.controller_fd >= 0) {
+        close(car.controller_fd);
+    }
+    release_shared_memory(car.name);
+    exit(1);
+}
+
+void lock_car(void) {
+    int rc = lock_shared_memory(car.shm);
+    if (rc != 0) abandon_shared_memory(rc);
+}
+
+void wait_car(const struct timespec *deadline) {
+    int rc = wait_shared_memory(car.shm, deadline);
+    if (rc != 0) abandon_shared_memory(rc);
+}
+
 void sigint_handler(int sig) {
     int saved_errno = errno;
     (void)sig;
@@ -50,10 +102,25 @@ void sigint_handler(int sig) {
     errno = saved_errno;
 }
 
-int connect_to_controller() {
+static long ms_since(const struct timespec *then) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000L + (now.tv_nsec - then->tv_nsec) / 1000000L;
+}
+
+// Start a non-blocking connect. Returns the fd (with *pending set if the
+// handshake is still in flight) or -1 if it failed outright.
+int start_connect(int *pending) {
+    *pending = 0;
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) return -1;
 
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -61,18 +128,232 @@ int connect_to_controller() {
     inet_pton(AF_INET, CONTROLLER_IP, &addr.sin_addr);
 
     if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        close(fd);
-        return -1;
+        if (errno != EINPROGRESS) {
+            close(fd);
+            return -1;
+        }
+        *pending = 1;
     }
 
     return fd;
 }
 
+// Check a pending connect. Returns 1 if established, 0 if still in flight, -1 if it failed.
+int finish_connect(int fd) {
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int ready = poll(&pfd, 1, 0);
+    if (ready == 0) return 0;
+    if (ready < 0) return (errno == EINTR) ? 0 : -1;
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        return -1;
+    }
+    return 1;
+}
+
+// Back off exponentially (with jitter) after a failed attempt so a fleet of
+// cars doesn't hammer a controller that is down
+void schedule_reconnect(void) {
+    if (car.backoff_ms == 0) {
+        car.backoff_ms = car.delay_ms > 0 ? car.delay_ms : 1;
+    } else if (car.backoff_ms < (int)RECONNECT_MAX_MS) {
+        car.backoff_ms *= 2;
+    }
+    if (car.backoff_ms > (int)RECONNECT_MAX_MS) {
+        car.backoff_ms = RECONNECT_MAX_MS;
+    }
+
+    // Wait somewhere between half and all of the backoff
+    int half = car.backoff_ms / 2;
+    int wait_ms = half + (half > 0 ? rand_r(&car.jitter_seed) % (half + 1) : 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &car.next_attempt);
+    car.next_attempt.tv_sec += wait_ms / 1000;
+    car.next_attempt.tv_nsec += (wait_ms % 1000) * 1000000L;
+    if (car.next_attempt.tv_nsec >= 1000000000L) {
+        car.next_attempt.tv_sec++;
+        car.next_attempt.tv_nsec -= 1000000000L;
+    }
+}
+
+// Drop a live connection. Unexpected losses retry straight away, since the
+// controller is usually back (or handed off) by the time we notice.
+void drop_connection(void) {
+    if (car.controller_fd >= 0) {
+        close(car.controller_fd);
+    }
+    car.controller_fd = -1;
+    car.connected = 0;
+    car.backoff_ms = 0;
+    car.next_attempt.tv_sec = 0;
+    car.next_attempt.tv_nsec = 0;
+}
+
+void abandon_connect(void) {
+    if (car.connect_fd >= 0) {
+        close(car.connect_fd);
+        car.connect_fd = -1;
+    }
+}
+
+// Register with the controller over a freshly established socket
+void on_connected(int fd) {
+    // The protocol helpers expect blocking I/O
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) {
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    car.controller_fd = fd;
+    car.connected = 1;
+    car.backoff_ms = 0;
+
+    // Forces the current position out straight after registration, so the
+    // controller can resume dispatching without waiting for movement
+    car.last_sent_status[0] = '\0';
+
+    char car_msg[CAR_MESSAGE_MAX_LEN];
+    snprintf(car_msg, sizeof(car_msg), "CAR %s %s %s%s%s%s%s", car.name, car.lowest, car.highest,
+             car.heartbeat ? " HEARTBEAT" : "", car.route_enabled ? " ROUTE" : "",
+             car.vacant_enabled ? " VACANT" : "", car.dwell_enabled ? " DWELL" : "");
+    int failed = write_message(car.controller_fd, car_msg) < 0;
+
+    // Let the controller time our runs the way we make them
+    if (!failed && car.motion_enabled) {
+        snprintf(car_msg, sizeof(car_msg), "MOTION %g %g %g %g", car.motion.speed, car.motion.accel,
+                 car.motion.jerk, car.motion.floor_height);
+        failed = write_message(car.controller_fd, car_msg) < 0;
+    }
+    if (failed) {
+        close(car.controller_fd);
+        car.connected = 0;
+        car.controller_fd = -1;
+        schedule_reconnect();
+    }
+}
+
+// DWELL hint from the controller for the stop the doors are open at: NONE
+// when nobody is expected on or off, SHORT when people only get off,
+// NORMAL, or LONG for a crowd. A hint that arrives after the doors have
+// started closing is dropped rather than carried to the next stop.
+// Called with shm->mutex held.
+void apply_dwell(message_slice hint) {
+    if (strncmp(car.shm->status, "Opening", MAX_STATUS_LEN) != 0 &&
+        strncmp(car.shm->status, "Open", MAX_STATUS_LEN) != 0) {
+        return;
+    }
+    if (slice_equals(hint, "NONE")) {
+        car.dwell_ms = 0;
+    } else if (slice_equals(hint, "SHORT")) {
+        car.dwell_ms = car.delay_ms / 2;
+    } else if (slice_equals(hint, "NORMAL")) {
+        car.dwell_ms = car.delay_ms;
+    } else if (slice_equals(hint, "LONG")) {
+        car.dwell_ms = 2 * car.delay_ms;
+    }
+}
+
+// A floor in the car's range that it may open at
+static int serves_floor(const char *floor) {
+    return is_valid_floor_range(floor, car.lowest, car.highest) &&
+           topology_stops_at(&topology, car.topology_car, parse_floor(floor).numeric);
+}
+
+// The route helpers below are called with shm->mutex held
+
+static int route_valid_stop(const char *floor) {
+    if (!serves_floor(floor)) return 0;
+    for (int i = 0; i < car.route_len; i++) {
+        if (strncmp(car.route[i], floor, MAX_FLOOR_LEN) == 0) return 0;
+    }
+    return 1;
+}
+
+// "ROUTE [stops...]" replaces the whole stop list
+void route_replace(const char *stops) {
+    car.route_len = 0;
+    const char *p = stops;
+    while (*p && car.route_len < (int)MAX_FLOOR_COUNT) {
+        while (*p == ' ') p++;
+        size_t len = strcspn(p, " ");
+        if (len > 0 && len < MAX_FLOOR_LEN) {
+            char floor[MAX_FLOOR_LEN];
+            memcpy(floor, p, len);
+            floor[len] = '\0';
+            if (route_valid_stop(floor)) {
+                memcpy(car.route[car.route_len++], floor, MAX_FLOOR_LEN);
+            }
+        }
+        p += len;
+    }
+}
+
+// "ROUTE ADD <floor> <following>" inserts a stop with <following> stops
+// after it. Counting from the tail keeps the edit valid even if we served
+// the head before the controller heard about it.
+void route_insert(const char *floor, int following) {
+    if (car.route_len >= (int)MAX_FLOOR_COUNT || !route_valid_stop(floor)) return;
+
+    int pos = car.route_len - following;
+    if (pos < 0) pos = 0;
+    if (pos > car.route_len) pos = car.route_len;
+    memmove(car.route[pos + 1], car.route[pos], (size_t)(car.route_len - pos) * MAX_FLOOR_LEN);
+    memcpy(car.route[pos], floor, MAX_FLOOR_LEN);
+    car.route_len++;
+}
+
+// Go to (or open at) a floor the controller asked for while stopped
+void apply_floor(const char *floor) {
+    if (strncmp(floor, car.shm->current_floor, MAX_FLOOR_LEN) == 0) {
+        if (strncmp(car.shm->status, "Closed", MAX_STATUS_LEN) == 0 ||
+            strncmp(car.shm->status, "Closing", MAX_STATUS_LEN) == 0) {
+            safe_copy_status(car.shm->status, "Opening", sizeof(car.shm->status));
+            pthread_cond_broadcast(&car.shm->cond);
+        }
+    } else if (parse_floor(floor).ok && serves_floor(floor)) {
+        // A floor we can't stop at is dropped here rather than on departure,
+        // so it never shows up as our destination
+        safe_copy_floor(car.shm->destination_floor, floor, sizeof(car.shm->destination_floor));
+        pthread_cond_broadcast(&car.shm->cond);
+    }
+}
+
+// Between floors we are committed to the floor we're heading into, so a new
+// target is reachable if it is that floor or further in the same direction.
+// On an express run the shared floor lags, so the run's own count is used.
+int reachable_while_moving(const char *floor) {
+    floor_info current = parse_floor(car.shm->current_floor);
+    floor_info dest = parse_floor(car.shm->destination_floor);
+    floor_info target = parse_floor(floor);
+    if (!current.ok || !dest.ok || !target.ok || current.numeric == dest.numeric) return 0;
+    if (!serves_floor(floor)) return 0;
+
+    int position = atomic_load(&car.position);
+    if (position != NO_POSITION) current.numeric = position;
+
+    int direction = (dest.numeric > current.numeric) ? 1 : -1;
+    return (target.numeric - current.numeric) * direction > 0;
+}
+
+// 1 if the controller hasn't yet been sent the car's latest state. Called
+// with shm->mutex held.
+int report_pending(void) {
+    if (!car.connected) return 0;
+    if (car.vacant_floor[0] != '\0') return 1;
+
+    char status_msg[CAR_MESSAGE_MAX_LEN];
+    snprintf(status_msg, sizeof(status_msg), "STATUS %s %s %s",
+            car.shm->status, car.shm->current_floor, car.shm->destination_floor);
+    return strcmp(status_msg, car.last_sent_status) != 0;
+}
+
 void *network_thread_func(void *arg) {
     (void)arg;
 
     while (car.running && !shutdown_requested) {
-        pthread_mutex_lock(&car.shm->mutex);
+        lock_car();
         int should_connect = (car.shm->safety_system > 0U &&
                              car.shm->safety_system < 3U &&
                              car.shm->individual_service_mode == 0U &&
@@ -81,37 +362,54 @@ void *network_thread_func(void *arg) {
         pthread_mutex_unlock(&car.shm->mutex);
 
         if (should_connect && !car.connected) {
-            car.controller_fd = connect_to_controller();
-            if (car.controller_fd >= 0) {
-                car.connected = 1;
-
-                car.last_sent_status[0] = '\0';
-
-                char car_msg[CAR_MESSAGE_MAX_LEN];
-                snprintf(car_msg, sizeof(car_msg), "CAR %s %s %s", car.name, car.lowest, car.highest);
-                if (write_message(car.controller_fd, car_msg) < 0) {
-                    close(car.controller_fd);
-                    car.connected = 0;
-                    car.controller_fd = -1;
+            if (car.connect_fd >= 0) {
+                int result = finish_connect(car.connect_fd);
+                if (result == 0 && ms_since(&car.connect_started) >= (long)CONNECT_TIMEOUT_MS) {
+                    result = -1;
+                }
+                if (result == 1) {
+                    int fd = car.connect_fd;
+                    car.connect_fd = -1;
+                    on_connected(fd);
+                } else if (result < 0) {
+                    abandon_connect();
+                    schedule_reconnect();
+                }
+            } else if (ms_since(&car.next_attempt) >= 0) {
+                int pending;
+                int fd = start_connect(&pending);
+                if (fd < 0) {
+                    schedule_reconnect();
+                } else if (pending) {
+                    car.connect_fd = fd;
+                    clock_gettime(CLOCK_MONOTONIC, &car.connect_started);
+                } else {
+                    on_connected(fd);
                 }
             }
-        } else if (!should_connect && car.connected) {
-            if (service_mode) {
-                write_message(car.controller_fd, "INDIVIDUAL SERVICE");
-            }
+        } else if (!should_connect) {
+            abandon_connect();
+
+            if (car.connected) {
+                if (service_mode) {
+                    write_message(car.controller_fd, "INDIVIDUAL SERVICE");
+                }
 
-            if (car.controller_fd >= 0) {
-                close(car.controller_fd);
-                car.controller_fd = -1;
+                // Deliberate disconnect - reconnect as soon as we're allowed to
+                drop_connection();
             }
-            car.connected = 0;
         }
 
         if (car.connected) {
-            pthread_mutex_lock(&car.shm->mutex);
+            lock_car();
             char status_msg[CAR_MESSAGE_MAX_LEN];
             snprintf(status_msg, sizeof(status_msg), "STATUS %s %s %s",
                     car.shm->status, car.shm->current_floor, car.shm->destination_floor);
+            char vacant_msg[CAR_MESSAGE_MAX_LEN] = "";
+            if (car.vacant_floor[0] != '\0') {
+                snprintf(vacant_msg, sizeof(vacant_msg), "VACANT %s", car.vacant_floor);
+                car.vacant_floor[0] = '\0';
+            }
             pthread_mutex_unlock(&car.shm->mutex);
 
             int send_status = 0;
@@ -124,9 +422,13 @@ void *network_thread_func(void *arg) {
             int write_failed = 0;
             if (send_status) {
                 if (write_message(car.controller_fd, status_msg) < 0) {
-                    close(car.controller_fd);
-                    car.connected = 0;
-                    car.controller_fd = -1;
+                    drop_connection();
+                    write_failed = 1;
+                }
+            }
+            if (!write_failed && vacant_msg[0] != '\0') {
+                if (write_message(car.controller_fd, vacant_msg) < 0) {
+                    drop_connection();
                     write_failed = 1;
                 }
             }
@@ -140,37 +442,62 @@ void *network_thread_func(void *arg) {
                 if (select(car.controller_fd + 1, &readfds, NULL, NULL, &tv) > 0) {
                     char *msg = read_message(car.controller_fd);
                     if (msg) {
-                        if (strncmp(msg, "FLOOR ", 6) == 0) {
-                            char *floor = msg + 6;
-
-                            pthread_mutex_lock(&car.shm->mutex);
+                        message_tokens tokens;
+                        message_opcode opcode = tokenize_message(msg, &tokens);
+                        if (opcode == MSG_PING) {
+                            if (write_message(car.controller_fd, "PONG") < 0) {
+                                drop_connection();
+                                write_failed = 1;
+                            }
+                        } else if (opcode == MSG_FLOOR && tokens.field_count == 1 &&
+                                   tokens.fields[0].len < MAX_FLOOR_LEN) {
+                            char floor[MAX_FLOOR_LEN];
+                            slice_copy(tokens.fields[0], floor, sizeof(floor));
+
+                            lock_car();
+                            // Anything the controller sends supersedes a stop we were
+                            // still holding, including one from before a reconnect
                             if (strncmp(car.shm->status, "Between", MAX_STATUS_LEN) != 0) {
-                                if (strncmp(floor, car.shm->current_floor, MAX_FLOOR_LEN) == 0) {
-                                    if (strncmp(car.shm->status, "Closed", MAX_STATUS_LEN) == 0) {
-                                        safe_copy_status(car.shm->status, "Opening", sizeof(car.shm->status));
-                                        pthread_cond_broadcast(&car.shm->cond);
-                                    }
-                                } else {
-                                    floor_info floor_check = parse_floor(floor);
-                                    if (floor_check.ok) {
-                                        safe_copy_floor(car.shm->destination_floor, floor, sizeof(car.shm->destination_floor));
-                                        pthread_cond_broadcast(&car.shm->cond);
-                                    }
+                                apply_floor(floor);
+                                car.pending_floor[0] = '\0';
+                            } else if (reachable_while_moving(floor)) {
+                                safe_copy_floor(car.shm->destination_floor, floor, sizeof(car.shm->destination_floor));
+                                car.pending_floor[0] = '\0';
+                                atomic_store(&car.retarget, 1);
+                                pthread_cond_broadcast(&car.shm->cond);
+                            } else {
+                                // Already passed - take it once we've stopped
+                                safe_copy_floor(car.pending_floor, floor, sizeof(car.pending_floor));
+                            }
+                            pthread_mutex_unlock(&car.shm->mutex);
+                        } else if (opcode == MSG_ROUTE && car.route_enabled) {
+                            lock_car();
+                            if (tokens.field_count == 3 && slice_equals(tokens.fields[0], "ADD")) {
+                                char floor[MAX_FLOOR_LEN];
+                                if (slice_copy(tokens.fields[1], floor, sizeof(floor)) == 0) {
+                                    route_insert(floor, atoi(tokens.fields[2].ptr));
                                 }
+                            } else {
+                                route_replace(tokens.field_count > 0 ? tokens.fields[0].ptr : "");
+                                car.pending_floor[0] = '\0';
                             }
+                            atomic_store(&car.retarget, 1);
+                            pthread_cond_broadcast(&car.shm->cond);
+                            pthread_mutex_unlock(&car.shm->mutex);
+                        } else if (opcode == MSG_DWELL && car.dwell_enabled && tokens.field_count == 1) {
+                            lock_car();
+                            apply_dwell(tokens.fields[0]);
                             pthread_mutex_unlock(&car.shm->mutex);
                         }
                         free(msg);
                     } else {
-                        close(car.controller_fd);
-                        car.connected = 0;
-                        car.controller_fd = -1;
+                        drop_connection();
                         write_failed = 1;
                     }
                 }
 
                 if (!write_failed) {
-                    pthread_mutex_lock(&car.shm->mutex);
+                    lock_car();
                     int entered_emergency = 0;
                     if (car.shm->safety_system < 3U) {
                         car.shm->safety_system++;
@@ -194,7 +521,14 @@ void *network_thread_func(void *arg) {
             }
         }
 
-        pthread_mutex_lock(&car.shm->mutex);
+        // While a handshake is in flight, wait on the socket instead
+        if (car.connect_fd >= 0) {
+            struct pollfd pfd = {car.connect_fd, POLLOUT, 0};
+            (void)poll(&pfd, 1, car.delay_ms);
+            continue;
+        }
+
+        lock_car();
         struct timespec ts;
         clock_gettime(CLOCK_REALTIME, &ts);
         ts.tv_sec += car.delay_ms / 1000;
@@ -203,7 +537,14 @@ void *network_thread_func(void *arg) {
             ts.tv_sec++;
             ts.tv_nsec -= 1000000000L;
         }
-        pthread_cond_timedwait(&car.shm->cond, &car.shm->mutex, &ts);
+        // A change broadcast while we were in select() would otherwise go
+        // unreported until the next one, so only wait if nothing is new.
+        // Until the safety system has answered our last heartbeat, wait
+        // anyway - its answer wakes us, and going round again first would
+        // count as a missed heartbeat.
+        if (!report_pending() || car.shm->safety_system > 1U) {
+            wait_car(&ts);
+        }
         pthread_mutex_unlock(&car.shm->mutex);
     }
 
@@ -237,9 +578,222 @@ void handle_service_mode() {
     (void)car;
 }
 
+// Anything at the doors while the car is stopped means someone may have got
+// on or off. Called before the buttons are handled, so presses are seen.
+void watch_doorway() {
+    if (strncmp(car.shm->status, "Between", MAX_STATUS_LEN) == 0) return;
+    if (car.shm->door_obstruction || car.shm->open_button || car.shm->close_button) {
+        car.doorway_used = 1;
+    }
+}
+
+// The doors have shut. A door cycle that nobody used is reported as VACANT
+// so the controller can drop calls whose passenger didn't show. The next
+// stop starts from the usual dwell until the controller says otherwise.
+void door_cycle_done() {
+    car.dwell_ms = car.delay_ms;
+    if (car.vacant_enabled && !car.doorway_used &&
+        !car.shm->individual_service_mode && !car.shm->emergency_mode) {
+        safe_copy_floor(car.vacant_floor, car.shm->current_floor, sizeof(car.vacant_floor));
+    }
+    car.doorway_used = 0;
+}
+
+// Set off for the destination if there is one we can go to. Called with the
+// doors shut; returns 1 if the car is now moving.
+int depart() {
+    int need_move = (strncmp(car.shm->current_floor, car.shm->destination_floor, MAX_FLOOR_LEN) != 0);
+    if (!need_move) return 0;
+
+    if (!serves_floor(car.shm->destination_floor)) {
+        safe_copy_floor(car.shm->destination_floor, car.shm->current_floor, sizeof(car.shm->destination_floor));
+        pthread_cond_broadcast(&car.shm->cond);
+        return 0;
+    }
+    if (car.shm->emergency_mode) return 0;
+
+    safe_copy_status(car.shm->status, "Between", sizeof(car.shm->status));
+    car.departing = 1;
+    car.run_origin = parse_floor(car.shm->current_floor).numeric;
+    pthread_cond_broadcast(&car.shm->cond);
+    return 1;
+}
+
+// How long the step from one floor to the next on the way to dest takes:
+// delay_ms, or with a motion profile, the time the run from its origin takes
+// to cover that storey. With an overlap the doors start opening while the car
+// levels at a stop, and the car starts moving while the doors lock behind it,
+// so the steps into and out of a stop are shorter. A car in service mode
+// never opens its doors, so it gets no overlap.
+int step_time(int service_mode, int from, int dest) {
+    int departing = car.departing;
+    car.departing = 0;
+
+    int next = topology_move(&topology, from, dest > from ? 1 : -1);
+    if (next == 0) next = dest;
+
+    int step = car.delay_ms;
+    if (car.motion_enabled) {
+        if (car.run_origin == NO_POSITION) car.run_origin = from;
+        double height = car.motion.floor_height;
+        double run = topology_distance(&topology, car.run_origin, dest, height);
+        double done = topology_distance(&topology, car.run_origin, from, height);
+        double reached = topology_distance(&topology, car.run_origin, next, height);
+        step = (int)lround(1000.0 * (motion_time_at(&car.motion, run, reached) -
+                                     motion_time_at(&car.motion, run, done)));
+    }
+    if (service_mode) return step;
+
+    // A motion step can be much shorter than delay_ms, so each overlap may
+    // take at most half of the step it shortens
+    int overlap = car.overlap_ms < step / 2 ? car.overlap_ms : step / 2;
+    if (departing) step -= overlap;
+    if (next == dest) step -= overlap;
+    return step;
+}
+
+// A FLOOR we had already passed is served once the car has stopped
+void handle_pending_floor() {
+    if (car.pending_floor[0] == '\0') return;
+    if (car.shm->emergency_mode || car.shm->individual_service_mode) {
+        car.pending_floor[0] = '\0';
+        return;
+    }
+    if (strncmp(car.shm->status, "Closed", MAX_STATUS_LEN) != 0) return;
+
+    apply_floor(car.pending_floor);
+    car.pending_floor[0] = '\0';
+}
+
+// Head for the next stop on the route once the doors are shut, or straight
+// away if it was inserted ahead of us mid-run. The controller drops the stops
+// of a car that leaves the pool, so we do too.
+void handle_route() {
+    if (car.shm->emergency_mode || car.shm->individual_service_mode) {
+        car.route_len = 0;
+        return;
+    }
+    if (car.route_len == 0) return;
+
+    if (strncmp(car.shm->status, "Between", MAX_STATUS_LEN) == 0) {
+        if (strncmp(car.route[0], car.shm->destination_floor, MAX_FLOOR_LEN) != 0 &&
+            reachable_while_moving(car.route[0])) {
+            safe_copy_floor(car.shm->destination_floor, car.route[0], sizeof(car.shm->destination_floor));
+            pthread_cond_broadcast(&car.shm->cond);
+        }
+        return;
+    }
+    if (strncmp(car.shm->status, "Closed", MAX_STATUS_LEN) != 0) return;
+
+    if (strncmp(car.route[0], car.shm->current_floor, MAX_FLOOR_LEN) == 0) {
+        safe_copy_status(car.shm->status, "Opening", sizeof(car.shm->status));
+        pthread_cond_broadcast(&car.shm->cond);
+    } else if (strncmp(car.route[0], car.shm->destination_floor, MAX_FLOOR_LEN) != 0) {
+        safe_copy_floor(car.shm->destination_floor, car.route[0], sizeof(car.shm->destination_floor));
+        pthread_cond_broadcast(&car.shm->cond);
+    }
+}
+
+// Opening at a floor on the route serves it - the controller drops it from
+// its copy of the queue on the same STATUS. It is normally the head, unless
+// a stop was inserted ahead of us after we had passed it.
+void route_arrived() {
+    for (int i = 0; i < car.route_len; i++) {
+        if (strncmp(car.route[i], car.shm->current_floor, MAX_FLOOR_LEN) == 0) {
+            car.route_len--;
+            memmove(car.route[i], car.route[i + 1], (size_t)(car.route_len - i) * MAX_FLOOR_LEN);
+            return;
+        }
+    }
+}
+
+// The doors have reached the destination: open them, or just stop in
+// service mode
+void arrive(int service_mode) {
+    if (service_mode) {
+        safe_copy_status(car.shm->status, "Closed", sizeof(car.shm->status));
+    } else {
+        safe_copy_status(car.shm->status, "Opening", sizeof(car.shm->status));
+    }
+}
+
+// An express run works out where it is going once, then counts floors off on
+// car.position without the lock. The shared floor, and with it the STATUS the
+// controller sees, is only brought up to date every express_floors floors,
+// at the end of the run, or when the destination may have changed. Called
+// with the lock held; returns with it released.
+void express_run() {
+    int service_mode = car.shm->individual_service_mode;
+    floor_info current = parse_floor(car.shm->current_floor);
+    floor_info dest = parse_floor(car.shm->destination_floor);
+    int at = current.numeric;
+    int direction = dest.numeric > at ? 1 : -1;
+    atomic_store(&car.retarget, 0);
+    atomic_store(&car.position, at);
+    pthread_mutex_unlock(&car.shm->mutex);
+
+    for (int passed = 0; passed < car.express_floors && car.running && !shutdown_requested;) {
+        int next = topology_move(&topology, at, direction);
+        int valid = next != 0 && next >= car.lowest_numeric && next <= car.highest_numeric;
+        delay_ms(step_time(service_mode, at, dest.numeric));
+        if (!valid) break;
+
+        at = next;
+        passed++;
+        atomic_store(&car.position, at);
+        if (at == dest.numeric || atomic_load(&car.retarget)) break;
+    }
+
+    lock_car();
+    if (strncmp(car.shm->status, "Between", MAX_STATUS_LEN) == 0) {
+        char floor[MAX_FLOOR_LEN];
+        floor_to_string(at, at < 0, floor);
+        safe_copy_floor(car.shm->current_floor, floor, sizeof(car.shm->current_floor));
+        atomic_store(&car.position, NO_POSITION);
+
+        // Pick up a stop inserted ahead of us while we were moving
+        handle_route();
+        if (strncmp(car.shm->current_floor, car.shm->destination_floor, MAX_FLOOR_LEN) == 0) {
+            arrive(service_mode);
+        }
+        pthread_cond_broadcast(&car.shm->cond);
+    } else {
+        atomic_store(&car.position, NO_POSITION);
+    }
+    pthread_mutex_unlock(&car.shm->mutex);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <name> <lowest> <highest> <delay_ms>\n", argv[0]);
+    int reattach = 0;
+    int bad_args = (argc < 5);
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "--reattach") == 0) {
+            reattach = 1;
+        } else if (strcmp(argv[i], "--heartbeat") == 0) {
+            car.heartbeat = 1;
+        } else if (strcmp(argv[i], "--route") == 0) {
+            car.route_enabled = 1;
+        } else if (strcmp(argv[i], "--vacant") == 0) {
+            car.vacant_enabled = 1;
+        } else if (strcmp(argv[i], "--dwell") == 0) {
+            car.dwell_enabled = 1;
+        } else if (strcmp(argv[i], "--express") == 0 && i + 1 < argc) {
+            car.express_floors = atoi(argv[++i]);
+            if (car.express_floors < 1) bad_args = 1;
+        } else if (strcmp(argv[i], "--motion") == 0 && i + 1 < argc) {
+            car.motion_enabled = 1;
+            if (parse_motion(argv[++i], &car.motion) != 0) bad_args = 1;
+        } else if (strcmp(argv[i], "--topology") == 0 && i + 1 < argc) {
+            if (load_topology(argv[++i], &topology) != 0) return 1;
+        } else if (strcmp(argv[i], "--overlap") == 0 && i + 1 < argc) {
+            car.overlap_ms = atoi(argv[++i]);
+            if (car.overlap_ms < 0) bad_args = 1;
+        } else {
+            bad_args = 1;
+        }
+    }
+    if (bad_args) {
+        fprintf(stderr, "Usage: %s <name> <lowest> <highest> <delay_ms> [--reattach] [--heartbeat] [--route] [--vacant] [--dwell] [--overlap <ms>] [--express <floors>] [--motion <speed>,<accel>,<jerk>,<floor-height>] [--topology <file>]\n", argv[0]);
         return 1;
     }
 
@@ -250,10 +804,15 @@ int main(int argc, char *argv[]) {
     strncpy(car.highest, argv[3], sizeof(car.highest) - 1);
     car.highest[sizeof(car.highest) - 1] = '\0';
     car.delay_ms = atoi(argv[4]);
+    car.dwell_ms = car.delay_ms;
+    if (car.overlap_ms > car.delay_ms / 2) car.overlap_ms = car.delay_ms / 2;
     car.running = 1;
     car.connected = 0;
     car.controller_fd = -1;
     car.last_sent_status[0] = '\0';
+    car.connect_fd = -1;
+    car.backoff_ms = 0;
+    car.jitter_seed = (unsigned int)getpid() ^ (unsigned int)time(NULL);
 
     floor_info lowest_info = parse_floor(car.lowest);
     floor_info highest_info = parse_floor(car.highest);
@@ -261,6 +820,16 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Invalid floor range\n");
         return 1;
     }
+    car.lowest_numeric = lowest_info.numeric;
+    car.highest_numeric = highest_info.numeric;
+    car.topology_car = topology_car_index(&topology, car.name);
+    if (!serves_floor(car.lowest) || !serves_floor(car.highest)) {
+        fprintf(stderr, "Car doesn't stop at both ends of its range\n");
+        return 1;
+    }
+    atomic_init(&car.position, NO_POSITION);
+    atomic_init(&car.retarget, 0);
+    car.run_origin = NO_POSITION;
 
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
@@ -278,7 +847,22 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    car.shm = create_shared_memory(car.name, car.lowest);
+    // Resume from a segment left behind by a crashed instance of this car
+    if (reattach) {
+        errno = 0;
+        car.shm = reattach_shared_memory(car.name, car.lowest, car.highest);
+        if (!car.shm && errno == EBUSY) {
+            fprintf(stderr, "Car %s is already running\n", car.name);
+            return 1;
+        }
+        if (!car.shm) {
+            cleanup_shared_memory(car.name);
+        }
+    }
+
+    if (!car.shm) {
+        car.shm = create_shared_memory(car.name, car.lowest, car.highest);
+    }
     if (!car.shm) {
         fprintf(stderr, "Failed to create shared memory\n");
         return 1;
@@ -293,17 +877,21 @@ int main(int argc, char *argv[]) {
     struct timespec open_start = {0, 0};
 
     while (car.running && !shutdown_requested) {
-        pthread_mutex_lock(&car.shm->mutex);
+        lock_car();
 
+        watch_doorway();
         handle_open_button();
         handle_close_button();
         handle_service_mode();
+        handle_pending_floor();
+        handle_route();
 
         if (strncmp(car.shm->status, "Opening", MAX_STATUS_LEN) == 0) {
+            route_arrived();
             pthread_mutex_unlock(&car.shm->mutex);
             delay_ms(car.delay_ms);
 
-            pthread_mutex_lock(&car.shm->mutex);
+            lock_car();
             if (strncmp(car.shm->status, "Opening", MAX_STATUS_LEN) == 0) {
                 safe_copy_status(car.shm->status, "Open", sizeof(car.shm->status));
                 clock_gettime(CLOCK_MONOTONIC, &open_start);
@@ -316,7 +904,11 @@ int main(int argc, char *argv[]) {
             if (car.shm->open_button) {
                 car.shm->open_button = 0;
                 extend = 1;
+
+                // Someone wants the doors, whatever the controller expected
+                if (car.dwell_ms < car.delay_ms) car.dwell_ms = car.delay_ms;
             }
+            int dwell_ms = car.dwell_ms;
             pthread_mutex_unlock(&car.shm->mutex);
 
             if (extend) {
@@ -328,15 +920,15 @@ int main(int argc, char *argv[]) {
             long elapsed_ms = (now.tv_sec - open_start.tv_sec) * 1000L +
                              (now.tv_nsec - open_start.tv_nsec) / 1000000L;
 
-            if (elapsed_ms >= car.delay_ms) {
-                pthread_mutex_lock(&car.shm->mutex);
+            if (elapsed_ms >= dwell_ms) {
+                lock_car();
                 if (strncmp(car.shm->status, "Open", MAX_STATUS_LEN) == 0 && !car.shm->individual_service_mode) {
                     safe_copy_status(car.shm->status, "Closing", sizeof(car.shm->status));
                     pthread_cond_broadcast(&car.shm->cond);
                 }
                 pthread_mutex_unlock(&car.shm->mutex);
             } else {
-                long remaining_ms = car.delay_ms - elapsed_ms;
+                long remaining_ms = dwell_ms - elapsed_ms;
                 if (remaining_ms > MAX_SLEEP_MS) {
                     remaining_ms = MAX_SLEEP_MS;
                 }
@@ -349,29 +941,24 @@ int main(int argc, char *argv[]) {
             pthread_mutex_unlock(&car.shm->mutex);
             delay_ms(car.delay_ms);
 
-            pthread_mutex_lock(&car.shm->mutex);
+            lock_car();
             if (strncmp(car.shm->status, "Closing", MAX_STATUS_LEN) == 0) {
                 safe_copy_status(car.shm->status, "Closed", sizeof(car.shm->status));
+                door_cycle_done();
                 pthread_cond_broadcast(&car.shm->cond);
-            }
-            pthread_mutex_unlock(&car.shm->mutex);
 
-        } else if (strncmp(car.shm->status, "Closed", MAX_STATUS_LEN) == 0) {
-            int need_move = (strncmp(car.shm->current_floor, car.shm->destination_floor, MAX_FLOOR_LEN) != 0);
-            int emergency = car.shm->emergency_mode;
-
-            int valid_dest = 1;
-            if (need_move) {
-                valid_dest = is_valid_floor_range(car.shm->destination_floor, car.lowest, car.highest);
-                if (!valid_dest) {
-                    safe_copy_floor(car.shm->destination_floor, car.shm->current_floor, sizeof(car.shm->destination_floor));
-                    pthread_cond_broadcast(&car.shm->cond);
+                // Overlapped cars move off as the doors lock, without
+                // another pass through the loop
+                if (car.overlap_ms > 0) {
+                    handle_pending_floor();
+                    handle_route();
+                    if (strncmp(car.shm->status, "Closed", MAX_STATUS_LEN) == 0) depart();
                 }
             }
+            pthread_mutex_unlock(&car.shm->mutex);
 
-            if (need_move && !emergency && valid_dest) {
-                safe_copy_status(car.shm->status, "Between", sizeof(car.shm->status));
-                pthread_cond_broadcast(&car.shm->cond);
+        } else if (strncmp(car.shm->status, "Closed", MAX_STATUS_LEN) == 0) {
+            if (depart()) {
                 pthread_mutex_unlock(&car.shm->mutex);
             } else {
                 struct timespec ts;
@@ -382,30 +969,36 @@ int main(int argc, char *argv[]) {
                     ts.tv_sec++;
                     ts.tv_nsec -= 1000000000L;
                 }
-                pthread_cond_timedwait(&car.shm->cond, &car.shm->mutex, &ts);
+                wait_car(&ts);
                 pthread_mutex_unlock(&car.shm->mutex);
             }
 
+        } else if (strncmp(car.shm->status, "Between", MAX_STATUS_LEN) == 0 && car.express_floors > 0 &&
+                   compare_floors(car.shm->current_floor, car.shm->destination_floor) != 0) {
+            express_run();
+
         } else if (strncmp(car.shm->status, "Between", MAX_STATUS_LEN) == 0) {
             int service_mode = car.shm->individual_service_mode;
+            floor_info from = parse_floor(car.shm->current_floor);
+            floor_info to = parse_floor(car.shm->destination_floor);
+            int step = from.ok && to.ok ? step_time(service_mode, from.numeric, to.numeric) : car.delay_ms;
             pthread_mutex_unlock(&car.shm->mutex);
 
-            delay_ms(car.delay_ms);
+            delay_ms(step);
 
-            pthread_mutex_lock(&car.shm->mutex);
+            lock_car();
             if (strncmp(car.shm->status, "Between", MAX_STATUS_LEN) == 0) {
+                // Pick up a stop inserted ahead of us while we were moving
+                handle_route();
+
                 char next_floor[FLOOR_STRING_MAX_LEN];
                 if (next_floor_towards(car.shm->current_floor, car.shm->destination_floor,
-                                     car.lowest, car.highest, next_floor, sizeof(next_floor)) == 0) {
+                                     car.lowest, car.highest, &topology, next_floor, sizeof(next_floor)) == 0) {
                     safe_copy_floor(car.shm->current_floor, next_floor, sizeof(car.shm->current_floor));
                 }
 
                 if (strncmp(car.shm->current_floor, car.shm->destination_floor, MAX_FLOOR_LEN) == 0) {
-                    if (service_mode) {
-                        safe_copy_status(car.shm->status, "Closed", sizeof(car.shm->status));
-                    } else {
-                        safe_copy_status(car.shm->status, "Opening", sizeof(car.shm->status));
-                    }
+                    arrive(service_mode);
                 }
                 pthread_cond_broadcast(&car.shm->cond);
             }
@@ -422,7 +1015,7 @@ int main(int argc, char *argv[]) {
     if (car.connected && car.controller_fd >= 0) {
         close(car.controller_fd);
     }
-    cleanup_shared_memory(car.name);
+    release_shared_memory(car.name);
 
     return 0;
 }
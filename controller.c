@@ -1,5 +1,53 @@
+#define _GNU_SOURCE   // pthread_setaffinity_np for --dispatcher-cpu
 #include "elevator.h"
 
+// Lock-free multi-producer, single-consumer queue (Vyukov). Producers
+// publish with a single atomic exchange; only the consumer touches tail.
+typedef struct mpsc_node {
+    struct mpsc_node *_Atomic next;
+} mpsc_node;
+
+typedef struct {
+    mpsc_node *_Atomic head;         // Most recently pushed node
+    mpsc_node *tail;                 // Oldest node, owned by the consumer
+    mpsc_node stub;
+} mpsc_queue;
+
+// One per client socket. Only the dispatcher pushes onto outbound; the I/O
+// thread that owns the socket drains it and does the writing.
+typedef struct connection {
+    int fd;
+    int notify[2];                   // Readable once outbound has something
+    atomic_int notified;             // 1 while a notify byte is outstanding
+    mpsc_queue outbound;             // outbound_message frames for the peer
+    int car_index;                   // Dispatcher only: car slot registered on this connection, or -1
+
+    // Event-loop backends (--io epoll|uring) only; owned by the loop thread
+    int kind;                        // CONN_* once the first frame has arrived
+    char *rx;                        // Start of an incomplete frame
+    size_t rx_len, rx_cap;
+    char *tx;                        // Frames not yet handed to the kernel
+    size_t tx_len, tx_cap;
+    char *sending;                   // io_uring: buffer owned by the in-flight send
+    size_t sending_len, sending_off;
+    int send_inflight;               // io_uring: a send is outstanding
+    int read_done;                   // io_uring: the multishot recv has finished
+    int want_out;                    // epoll: registered for EPOLLOUT
+    int closing;                     // Close once queued output is written
+    int shut;                        // shutdown() already called
+    int closed;                      // Socket closed and EVENT_CLOSED posted
+    int dirty;                       // On the loop's flush list
+    struct connection *next_dirty;
+} connection;
+
+typedef struct {
+    mpsc_node link;
+    connection *conn;                // Event-loop backends: destination
+    int final;                       // Close the connection once this has been sent
+    int release;                     // Event-loop backends: dispatcher is done with conn
+    char text[];                     // Empty for a bare close
+} outbound_message;
+
 typedef struct floor_node {
     char floor[MAX_FLOOR_LEN];
     struct floor_node *next;
@@ -13,24 +61,328 @@ typedef struct {
     char destination_floor[MAX_FLOOR_LEN];
     char status[MAX_STATUS_LEN];
     int connected;
-    int fd;
+    connection *conn;                // Current connection, NULL while disconnected
+    int restored;    // 1 if the queue came from a checkpoint and the car hasn't re-registered yet
+    unsigned int features;      // CAR_FEATURE_* bits from registration
+    struct timespec last_seen;  // Monotonic time of the last message from the car
+    int unresponsive;           // 1 once a heartbeat car has missed its deadline
+    int untracked;              // 1 while the queue holds stops the call ledger doesn't know about
+    struct timespec stepped;    // Monotonic time of the last status or floor change
+    struct timespec progressed; // Monotonic time the car last reached a floor, set off or left idle
+    int step_ms;                // Smoothed time the car spends per status step, 0 until seen
+    int floor_ms;               // Smoothed time to pass a floor on the move, 0 until seen
+    int approach_ms;            // Smoothed time of the step into a stop, 0 until seen
+    int door_ms;                // Smoothed time from opening at a stop to setting off, 0 until seen
+    int depart_ms;              // Smoothed time of the step away from a stop, 0 until seen
+    int leaving;                // 1 while the car is on its first step away from a stop
+    int report_floors;          // Most floors the car has covered between two reports on the move
+    motion_profile motion;      // From the car's MOTION message; speed is 0 if it sent none
+    int topology_car;           // The car's entry in ctrl.topology, or -1 if it stops everywhere
+    struct timespec opened;     // Monotonic time the doors started opening at this stop
+    int reserved;               // 1 while the car is kept out of dispatch for a RESERVE call
+    uint8_t openings;           // Stops made, to tell who boarded at the latest one
+    int parking;                // 1 while the car's only stop is where it was sent to wait
+    unsigned int checkpoint_stale; // Bit n set while checkpoint slot n lacks the car's latest state
     floor_node *queue_head;
     floor_node *queue_tail;
 } car_info;
 
+// Checkpoint file layout. Two slots are kept so a crash halfway through a
+// write never destroys the last complete snapshot: the writer fills the
+// inactive slot, then bumps the generation to publish it. Only cars that
+// changed since that slot was last written are copied into it.
+#define CHECKPOINT_MAGIC 0x454C5643U   // "ELVC"
+#define CHECKPOINT_VERSION 3U
+#define CHECKPOINT_STALE 0x3U          // Neither slot has the car's latest state
+
 typedef struct {
-    car_info cars[MAX_CARS];
-    int car_count;
-    int server_fd;
+    char name[MAX_CAR_NAME_LEN];
+    char lowest[MAX_FLOOR_LEN];
+    char highest[MAX_FLOOR_LEN];
+    char current_floor[MAX_FLOOR_LEN];
+    char destination_floor[MAX_FLOOR_LEN];
+    char status[MAX_STATUS_LEN];
+    uint32_t features;
+    motion_profile motion;
+    uint32_t queue_len;
+    char queue[MAX_FLOOR_COUNT][MAX_FLOOR_LEN];
+} checkpoint_car;
+
+typedef struct {
+    uint64_t generation;             // Generation this slot was written for
+    uint32_t car_count;
+    checkpoint_car cars[MAX_CARS];
+} checkpoint_slot;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    _Atomic uint64_t generation;     // Latest complete slot is slots[generation % 2]
+    checkpoint_slot slots[2];
+} checkpoint_file;
+
+// Accepted connections waiting for a pool worker
+#define ACCEPT_QUEUE_LEN 64
+
+typedef struct {
+    int fds[ACCEPT_QUEUE_LEN];
+    int head;
+    int count;
     pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+} accept_queue;
+
+// Handoff wire format: a header carrying the listening socket and car fds
+// (SCM_RIGHTS), followed by the car table as a checkpoint_slot.
+#define HANDOFF_MAGIC 0x454C4844U      // "ELHD"
+// Car threads get this long to park before a handoff is abandoned; one stuck
+// in a read would otherwise keep io_mutex held and every car offline
+#define HANDOFF_PARK_TIMEOUT_MS 2000
+
+typedef struct {
+    uint32_t magic;
+    uint32_t fd_count;               // Listening socket plus one per connected car
+    int32_t car_index[MAX_CARS];     // car_index[i] is the car table slot for fds[i + 1]
+} handoff_header;
+
+// Filled in by the dispatcher for the handoff thread
+typedef struct {
+    checkpoint_slot *slot;
+    handoff_header header;
+    int fds[MAX_CARS + 1];
+    sem_t done;                      // Posted once the snapshot is complete
+} handoff_request;
+
+// I/O threads parse what they read into typed events; the dispatcher thread
+// applies them in order and is the only thread that touches car state
+typedef enum {
+    EVENT_CAR_REGISTER,              // CAR name lowest highest [features]
+    EVENT_CAR_STATUS,                // STATUS status current destination
+    EVENT_CAR_OFFLINE,               // EMERGENCY or INDIVIDUAL SERVICE
+    EVENT_CAR_SEEN,                  // Any other car traffic (PONG)
+    EVENT_CAR_VACANT,                // VACANT floor
+    EVENT_CAR_MOTION,                // MOTION speed accel jerk floor-height
+    EVENT_CALL,                      // CALL source destination [class] [ID]
+    EVENT_CANCEL,                    // CANCEL id
+    EVENT_CLOSED,                    // I/O thread has finished with its connection
+    EVENT_HEARTBEAT,                 // Heartbeat interval elapsed
+    EVENT_REALLOCATE,                // Reallocation interval elapsed
+    EVENT_STATS,                     // STATS from a client
+    EVENT_SNAPSHOT                   // Handoff needs the car table and fds
+} event_type;
+
+typedef struct {
+    mpsc_node link;
+    event_type type;
+    connection *conn;
+    union {
+        struct {
+            char name[MAX_CAR_NAME_LEN];
+            char lowest[MAX_FLOOR_LEN];
+            char highest[MAX_FLOOR_LEN];
+            unsigned int features;
+        } reg;
+        struct {
+            char status[MAX_STATUS_LEN];
+            char current[MAX_FLOOR_LEN];
+            char destination[MAX_FLOOR_LEN];
+        } status;
+        struct {
+            char source[MAX_FLOOR_LEN];
+            char destination[MAX_FLOOR_LEN];
+            int priority;            // CALL_NORMAL, CALL_PRIORITY or CALL_RESERVE
+            int reply;               // REPLY_* bits
+        } call;
+        char vacant[MAX_FLOOR_LEN];
+        motion_profile motion;
+        uint32_t call_id;
+        handoff_request *handoff;
+    };
+} controller_event;
+
+// What a CALL asks for beyond the car's name
+enum {
+    REPLY_ID = 0x01,                 // "ID": the call id, for CANCEL
+    REPLY_ETA = 0x02,                // "ETA": the pickup estimate in ms
+    REPLY_WATCH = 0x04               // "WATCH": stream estimates until pickup
+};
+
+// Pending hall calls: a bit per floor and travel direction, plus the cars
+// given the pickup, so a repeat press joins one without another search. More
+// than one car can hold a pickup when the first can't take everyone.
+#define HALL_CALL_WORDS ((MAX_FLOOR_COUNT + 63U) / 64U)
+
+enum { HALL_UP, HALL_DOWN };
+
+typedef struct {
+    uint64_t pending[2][HALL_CALL_WORDS];
+    uint32_t cars[2][MAX_FLOOR_COUNT]; // A bit per index into ctrl.cars; pending while nonzero
+} hall_call_registry;
+
+// Calls from CALL to drop-off, so a pickup can be handed to another car
+// along with everyone waiting for it. Floors are dense slots.
+#define MAX_CALLS 256
+
+enum { CALL_FREE, CALL_WAITING, CALL_RIDING };
+
+// Call classes. A PRIORITY call is placed for its own fastest trip and
+// nothing new goes ahead of it; a RESERVE call also gets a car to itself.
+enum { CALL_NORMAL, CALL_PRIORITY, CALL_RESERVE };
+
+typedef struct {
+    uint8_t state;                   // CALL_FREE, CALL_WAITING or CALL_RIDING
+    uint8_t priority;                // CALL_NORMAL, CALL_PRIORITY or CALL_RESERVE
+    uint8_t boarded;                 // The car's openings count when it picked them up
+    uint32_t id;                     // Given to the caller for CANCEL, never 0
+    int8_t car;                      // Index into ctrl.cars
+    int8_t watch_car;                // Car the watcher was last told about
+    int16_t source;
+    int16_t destination;
+    struct timespec placed;          // When the call was placed
+    struct timespec since;           // When the call was placed or last changed car
+    int eta_ms;                      // Pickup estimate when placed, or -1
+    connection *watcher;             // Client streaming estimates, or NULL
+    int reported_ms;                 // Last estimate sent to the watcher, or -1
+    struct timespec reported_at;
+} call_record;
+
+// Pickup waits, from CALL to the doors opening for it, in WAIT_BUCKET_MS
+// buckets. The last bucket takes everything longer.
+#define WAIT_BUCKET_MS 10
+#define WAIT_BUCKETS 12000
+
+typedef struct {
+    uint32_t count[WAIT_BUCKETS];
+    uint32_t total;
+    uint32_t overdue;                // Waits longer than max_wait_ms
+    long max_ms;
+    uint32_t eta_count;              // Pickups that had an estimate when placed
+    long eta_abs_ms;                 // Sum of |actual - estimate|
+    long eta_bias_ms;                // Sum of actual - estimate
+} wait_histogram;
+
+// Traffic mode, from the most recent calls: how many start at the lobby,
+// how many end there, and how many came in within the window. Dispatch and
+// parking follow the mode.
+#define TRAFFIC_HISTORY 64
+#define TRAFFIC_MIN_CALLS 12         // Fewer calls in the window is light traffic
+#define TRAFFIC_PEAK_ENTER 50        // % of calls from (or to) the lobby that starts a peak
+#define TRAFFIC_PEAK_LEAVE 35        // % below which the peak is over
+#define TRAFFIC_FROM_LOBBY 0x01U
+#define TRAFFIC_TO_LOBBY 0x02U
+
+enum { TRAFFIC_LIGHT, TRAFFIC_INTERFLOOR, TRAFFIC_UP_PEAK, TRAFFIC_DOWN_PEAK };
+
+// Reallocation ticks with at least two cars busy, and how many of those
+// found two of them bunched together
+typedef struct {
+    uint32_t samples;
+    uint32_t bunched;
+} headway_stats;
+
+typedef struct {
+    struct timespec placed[TRAFFIC_HISTORY];
+    uint8_t lobby[TRAFFIC_HISTORY];  // TRAFFIC_FROM_LOBBY / TRAFFIC_TO_LOBBY
+    int next;                        // Oldest entry, overwritten next
+    int mode;                        // TRAFFIC_*
+} traffic_window;
+
+typedef struct {
+    car_info cars[MAX_CARS];         // Dispatcher thread only
+    int car_count;                   // Dispatcher thread only
+    hall_call_registry hall_calls;   // Dispatcher thread only
+    call_record calls[MAX_CALLS];    // Dispatcher thread only
+    uint32_t next_call_id;           // Dispatcher thread only
+    wait_histogram waits;            // Dispatcher thread only
+    traffic_window traffic;          // Dispatcher thread only
+    headway_stats headway;           // Dispatcher thread only
+    int server_fd;
+    mpsc_queue events;               // controller_event queue into the dispatcher
+    sem_t events_ready;              // Counts events pushed but not yet popped
+    int dispatcher_cpu;              // CPU to pin the dispatcher to, or -1
+    int io_backend;                  // IO_THREADS, IO_EPOLL or IO_URING
+    mpsc_queue io_outbox;            // Event-loop backends: outbound_message queue into the loop
+    int io_wake[2];                  // Made readable when io_outbox gains something
+    atomic_int io_woken;             // 1 while an io_wake byte is outstanding
     volatile int running;
+    checkpoint_file *checkpoint;     // NULL unless started with --checkpoint
+    int heartbeat_ms;                // PING interval for cars with CAR_FEATURE_HEARTBEAT
+    int reallocate_ms;               // Interval between reallocation passes, 0 for none
+    int max_wait_ms;                 // Wait bound for a pickup, 0 for none
+    int traffic_window_ms;           // Calls this recent set the traffic mode, 0 to stay light
+    int lobby;                       // Numeric lobby floor
+    int headway_bias;                // Plan steps of dispatch bias between bunched cars, 0 for none
+    building_topology topology;      // Empty unless started with --topology
+    accept_queue pending;            // Call connections waiting for a worker
+    int wake_pipe[2];                // Made readable when a handoff starts, to wake blocked I/O
+    atomic_int handing_off;          // 1 while state is being passed to a new controller
+    atomic_int handed_off;           // 1 once the new controller has taken over
+    pthread_mutex_t io_mutex;        // Guards car_threads for handoff parking
+    int car_threads;                 // Car connections actively reading (not parked)
+    pthread_cond_t handoff_cond;     // Signalled when handoff state or car_threads changes
 } controller_state;
 
 controller_state ctrl;
 volatile sig_atomic_t shutdown_requested = 0;
 
+// Heartbeats: a car that hasn't been heard from in HEARTBEAT_MISSES
+// intervals is skipped by dispatch until it speaks again
+#define DEFAULT_HEARTBEAT_MS 1000
+#define HEARTBEAT_MISSES 3
+#define KEEPALIVE_IDLE_S 5
+#define KEEPALIVE_INTERVAL_S 2
+#define KEEPALIVE_COUNT 3
+
+// Unserved pickups are looked at again this often for a car that can now
+// get there sooner
+#define DEFAULT_REALLOCATE_MS 500
+
+// A pickup that has waited half the bound goes to the head of the line:
+// nothing new is put in front of it and it moves to any faster car
+#define DEFAULT_MAX_WAIT_MS 60000
+
+// Traffic is classified from the calls of the last minute. Outside light
+// traffic, a car left idle this long is sent to wait where the next call is
+// likely (at once in up-peak).
+#define DEFAULT_TRAFFIC_WINDOW_MS 60000
+#define DEFAULT_LOBBY "1"
+#define PARK_IDLE_MS 3000
+
+// Connection admission: call clients are served by a fixed pool fed from a
+// bounded queue; when it is full they are told to retry instead of queueing
+#define DEFAULT_WORKERS 4
+#define FIRST_MESSAGE_TIMEOUT_MS 2000
+#define OVERLOAD_PEEK_MS 5
+#define OVERLOAD_RETRY_MS 200
+
+enum { CONN_UNKNOWN, CONN_CAR, CONN_CALL };
+
+// Socket handling: a thread per car plus a call pool, or a single event
+// loop on epoll or io_uring that owns every socket
+enum { IO_THREADS, IO_EPOLL, IO_URING };
+
+// io_uring: provided receive buffers, and user_data tags in the low bits
+// of the connection pointer
+#define URING_ENTRIES 256U
+#define URING_BUFFERS 256U
+#define URING_BUFFER_SIZE 2048U
+#define URING_BUFFER_GROUP 0
+#define URING_TAG_MASK 7ULL
+enum { URING_ACCEPT = 1, URING_WAKE, URING_RECV, URING_SEND };
+
+typedef struct {
+    int fd;
+    char *message;                   // First message if already read, else NULL
+} pending_connection;
+
 // Forward declarations
+long ms_since(const struct timespec *then);
 int get_car_position_numeric(car_info *car);
+void serve_car(connection *conn);
+void set_keepalive(int fd);
+void set_receive_timeout(int fd);
+void *client_handler(void *arg);
+car_info *reserve_car(const char *source, const char *destination);
 
 void cleanup_and_exit() {
     ctrl.running = 0;
@@ -44,6 +396,11 @@ void sigint_handler(int sig) {
     int saved_errno = errno;  // Preserve errno
     (void)sig;
     shutdown_requested = 1;
+    // The event loops wait without a timeout, and io_uring_enter may be
+    // restarted after the signal, so wake them through their pipe
+    if (ctrl.io_wake[1] >= 0) {
+        (void)write(ctrl.io_wake[1], "s", 1);
+    }
     errno = saved_errno;  // Restore errno
 }
 
@@ -55,220 +412,287 @@ void free_queue(floor_node *head) {
     }
 }
 
-void add_to_queue(car_info *car, const char *floor) {
-    // Skip if we already have this floor in the queue
-    floor_node *current = car->queue_head;
-    while (current) {
-        if (strncmp(current->floor, floor, MAX_FLOOR_LEN) == 0) {
-            return; // Already in queue
-        }
-        current = current->next;
-    }
-
-    floor_info floor_info_val = parse_floor(floor);
-    if (!floor_info_val.ok) return;
-
-    // Create new node
+// Append without reordering - used when rebuilding a queue that was already sorted
+void append_to_queue(car_info *car, const char *floor) {
     floor_node *new_node = malloc(sizeof(floor_node));
+    if (!new_node) return;
     strncpy(new_node->floor, floor, sizeof(new_node->floor) - 1);
     new_node->floor[sizeof(new_node->floor) - 1] = '\0';
     new_node->next = NULL;
 
-    if (!car->queue_head) {
-        car->queue_head = car->queue_tail = new_node;
-        return;
+    if (car->queue_tail) {
+        car->queue_tail->next = new_node;
+    } else {
+        car->queue_head = new_node;
     }
+    car->queue_tail = new_node;
+    car->checkpoint_stale = CHECKPOINT_STALE;
+}
 
-    // Get car position - account for movement if it's between floors
-    int car_pos = get_car_position_numeric(car);
+// Insert before the index'th node (or at the tail if the queue is shorter)
+void insert_queue_at(car_info *car, int index, const char *floor) {
+    floor_node *new_node = malloc(sizeof(floor_node));
+    if (!new_node) return;
+    strncpy(new_node->floor, floor, sizeof(new_node->floor) - 1);
+    new_node->floor[sizeof(new_node->floor) - 1] = '\0';
 
-    // Determine current sweep direction using actual floor positions
-    floor_info current_info = parse_floor(car->current_floor);
-    floor_info dest_info = parse_floor(car->destination_floor);
-    int going_up = 0;
+    floor_node *prev = NULL;
+    floor_node *curr = car->queue_head;
+    for (int i = 0; i < index && curr; i++) {
+        prev = curr;
+        curr = curr->next;
+    }
 
-    if (current_info.ok && dest_info.ok && current_info.numeric != dest_info.numeric) {
-        // Car is moving, so figure out its direction
-        going_up = (dest_info.numeric > current_info.numeric);
+    new_node->next = curr;
+    if (prev) {
+        prev->next = new_node;
     } else {
-        // Car is idle - look at where it needs to go
-        if (car->queue_head) {
-            floor_info first_info = parse_floor(car->queue_head->floor);
-            if (first_info.ok && current_info.ok) {
-                going_up = (first_info.numeric > current_info.numeric);
-            }
-        } else {
-            // Queue is empty, use direction to new floor
-            if (current_info.ok) {
-                going_up = (floor_info_val.numeric > current_info.numeric);
-            }
-        }
+        car->queue_head = new_node;
+    }
+    if (!curr) {
+        car->queue_tail = new_node;
     }
+    car->checkpoint_stale = CHECKPOINT_STALE;
+}
 
-    // Insert into queue using SCAN - keeps direction consistent
+// Drop a floor from anywhere in the queue. Returns 1 if it was there.
+int remove_from_queue(car_info *car, const char *floor) {
     floor_node *prev = NULL;
-    floor_node *curr = car->queue_head;
-    int new_floor = floor_info_val.numeric;
-
-    if (going_up) {
-        // Going UP: use ascending order, but after first floor use descending for efficiency
-        if (new_floor > car_pos) {
-            // Check if this floor should be in UP sweep or DOWN sweep
-            // If it's lower than any floor currently in the UP sweep, it's part of DOWN sweep
-            int is_down_sweep = 0;
-            floor_node *check = car->queue_head;
-            while (check) {
-                floor_info check_info = parse_floor(check->floor);
-                if (check_info.ok && check_info.numeric > car_pos) {
-                    // This is a floor in the UP sweep
-                    if (new_floor < check_info.numeric) {
-                        // New floor is lower than an UP sweep floor, so it's in DOWN sweep
-                        is_down_sweep = 1;
-                        break;
-                    }
-                }
-                check = check->next;
-            }
+    for (floor_node *node = car->queue_head; node; prev = node, node = node->next) {
+        if (strncmp(node->floor, floor, MAX_FLOOR_LEN) != 0) continue;
 
-            if (is_down_sweep) {
-                // Append to end (DOWN sweep)
-                prev = car->queue_tail;
-                curr = NULL;
-            } else {
-                // Insert in UP sweep
-                // Skip the floor it's heading to now
-                int skipped_first = 0;
-                if (curr) {
-                    floor_info first_info = parse_floor(curr->floor);
-                    if (first_info.ok && first_info.numeric > car_pos) {
-                        // Use current destination as reference point
-                        if (new_floor < first_info.numeric) {
-                            // Insert before first floor
-                        } else {
-                            // Insert after first floor, skip it
-                            prev = curr;
-                            curr = curr->next;
-                            skipped_first = 1;
-                        }
-                    }
-                }
-
-                // Insert among remaining floors
-                while (curr) {
-                    floor_info curr_info = parse_floor(curr->floor);
-                    if (!curr_info.ok) break;
-
-                    if (curr_info.numeric < car_pos) {
-                        // This will be part of downward sweep
-                        break;
-                    }
-
-                    // If we skipped first floor, use descending order; otherwise ascending
-                    if (skipped_first) {
-                        if (new_floor > curr_info.numeric) {
-                            break;
-                        }
-                    } else {
-                        if (new_floor < curr_info.numeric) {
-                            break;
-                        }
-                    }
-
-                    prev = curr;
-                    curr = curr->next;
-                }
-            }
+        if (prev) {
+            prev->next = node->next;
         } else {
-            // This floor is part of the DOWN sweep, append to end
-            prev = car->queue_tail;
-            curr = NULL;
+            car->queue_head = node->next;
         }
-    } else {
-        // Going DOWN: use descending order, but after first floor use ascending for efficiency
-        if (new_floor < car_pos) {
-            // Skip the floor it's heading to now
-            int skipped_first = 0;
-            if (curr) {
-                floor_info first_info = parse_floor(curr->floor);
-                if (first_info.ok && first_info.numeric < car_pos) {
-                    // First floor is in DOWN sweep, use it as anchor
-                    if (new_floor > first_info.numeric) {
-                        // Insert before first floor
-                    } else {
-                        // Insert after first floor, skip it
-                        prev = curr;
-                        curr = curr->next;
-                        skipped_first = 1;
-                    }
-                }
-            }
+        if (car->queue_tail == node) {
+            car->queue_tail = prev;
+        }
+        free(node);
+        car->checkpoint_stale = CHECKPOINT_STALE;
+        return 1;
+    }
+    return 0;
+}
+
+char *get_queue_front(car_info *car) {
+    return car->queue_head ? car->queue_head->floor : NULL;
+}
 
-            // Insert among remaining floors
-            while (curr) {
-                floor_info curr_info = parse_floor(curr->floor);
-                if (!curr_info.ok) break;
+int queue_contains(car_info *car, const char *floor) {
+    for (floor_node *node = car->queue_head; node; node = node->next) {
+        if (strncmp(node->floor, floor, MAX_FLOOR_LEN) == 0) return 1;
+    }
+    return 0;
+}
 
-                if (curr_info.numeric > car_pos) {
-                    // Reached the UP sweep section, insert before it
-                    break;
-                }
+// Copy one car and its queue into a checkpoint entry
+void snapshot_car(checkpoint_car *out, car_info *car) {
+    memcpy(out->name, car->name, sizeof(out->name));
+    memcpy(out->lowest, car->lowest, sizeof(out->lowest));
+    memcpy(out->highest, car->highest, sizeof(out->highest));
+    memcpy(out->current_floor, car->current_floor, sizeof(out->current_floor));
+    memcpy(out->destination_floor, car->destination_floor, sizeof(out->destination_floor));
+    memcpy(out->status, car->status, sizeof(out->status));
+    out->features = car->features;
+    out->motion = car->motion;
 
-                // If we skipped first floor, use ascending order; otherwise descending
-                if (skipped_first) {
-                    if (new_floor < curr_info.numeric) {
-                        break;
-                    }
-                } else {
-                    if (new_floor > curr_info.numeric) {
-                        break;
-                    }
-                }
+    uint32_t len = 0;
+    for (floor_node *node = car->queue_head; node && len < MAX_FLOOR_COUNT; node = node->next) {
+        memcpy(out->queue[len++], node->floor, MAX_FLOOR_LEN);
+    }
+    out->queue_len = len;
+}
+
+// Copy the car table and queues into a slot. Dispatcher thread only.
+void snapshot_cars(checkpoint_slot *slot) {
+    slot->car_count = (uint32_t)ctrl.car_count;
+    for (int i = 0; i < ctrl.car_count; i++) {
+        snapshot_car(&slot->cars[i], &ctrl.cars[i]);
+    }
+}
+
+// Rebuild the car table from a slot. Cars come back disconnected.
+int restore_cars(checkpoint_slot *slot) {
+    if (slot->car_count > MAX_CARS) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < slot->car_count; i++) {
+        checkpoint_car *in = &slot->cars[i];
+        car_info *car = &ctrl.cars[ctrl.car_count++];
+
+        memcpy(car->name, in->name, sizeof(car->name));
+        car->name[sizeof(car->name) - 1] = '\0';
+        memcpy(car->lowest, in->lowest, sizeof(car->lowest));
+        car->lowest[sizeof(car->lowest) - 1] = '\0';
+        memcpy(car->highest, in->highest, sizeof(car->highest));
+        car->highest[sizeof(car->highest) - 1] = '\0';
+        memcpy(car->current_floor, in->current_floor, sizeof(car->current_floor));
+        car->current_floor[sizeof(car->current_floor) - 1] = '\0';
+        memcpy(car->destination_floor, in->destination_floor, sizeof(car->destination_floor));
+        car->destination_floor[sizeof(car->destination_floor) - 1] = '\0';
+        memcpy(car->status, in->status, sizeof(car->status));
+        car->status[sizeof(car->status) - 1] = '\0';
+        car->features = in->features;
+        car->motion = in->motion;
+        car->topology_car = topology_car_index(&ctrl.topology, car->name);
+        car->connected = 0;
+        car->conn = NULL;
+        car->restored = 1;
+        clock_gettime(CLOCK_MONOTONIC, &car->last_seen);
 
-                prev = curr;
-                curr = curr->next;
+        uint32_t len = in->queue_len < MAX_FLOOR_COUNT ? in->queue_len : MAX_FLOOR_COUNT;
+        for (uint32_t j = 0; j < len; j++) {
+            in->queue[j][MAX_FLOOR_LEN - 1] = '\0';
+            if (parse_floor(in->queue[j]).ok) {
+                append_to_queue(car, in->queue[j]);
             }
-        } else {
-            // This floor is part of the UP sweep, append to end
-            prev = car->queue_tail;
-            curr = NULL;
         }
+        car->untracked = (car->queue_head != NULL);
+        car->checkpoint_stale = CHECKPOINT_STALE;
     }
 
-    // Insert node at determined position
-    new_node->next = curr;
-    if (prev) {
-        prev->next = new_node;
-        if (!curr) car->queue_tail = new_node;
+    return (int)slot->car_count;
+}
+
+// Bring the checkpoint file up to date after a change to car (NULL if any
+// car may have changed). Dispatcher thread only (or before it starts).
+void checkpoint_save(car_info *car) {
+    checkpoint_file *cp = ctrl.checkpoint;
+    if (!cp) return;
+
+    if (car) {
+        car->checkpoint_stale = CHECKPOINT_STALE;
     } else {
-        car->queue_head = new_node;
-        if (!curr) car->queue_tail = new_node;
+        for (int i = 0; i < ctrl.car_count; i++) ctrl.cars[i].checkpoint_stale = CHECKPOINT_STALE;
+    }
+
+    uint64_t next_gen = atomic_load_explicit(&cp->generation, memory_order_relaxed) + 1;
+    checkpoint_slot *slot = &cp->slots[next_gen % 2];
+    unsigned int bit = 1U << (next_gen % 2);
+
+    for (int i = 0; i < ctrl.car_count; i++) {
+        if (ctrl.cars[i].checkpoint_stale & bit) {
+            snapshot_car(&slot->cars[i], &ctrl.cars[i]);
+            ctrl.cars[i].checkpoint_stale &= ~bit;
+        }
+    }
+    slot->car_count = (uint32_t)ctrl.car_count;
+    slot->generation = next_gen;
+
+    // Publish only once the slot is complete
+    atomic_store_explicit(&cp->generation, next_gen, memory_order_release);
+}
+
+// Rebuild the car table from the last complete checkpoint slot
+int checkpoint_restore(void) {
+    checkpoint_file *cp = ctrl.checkpoint;
+    uint64_t gen = atomic_load_explicit(&cp->generation, memory_order_acquire);
+    if (gen == 0) return 0;
+
+    checkpoint_slot *slot = &cp->slots[gen % 2];
+    if (slot->generation != gen) {
+        return -1;
     }
+    return restore_cars(slot);
 }
 
-void pop_queue(car_info *car) {
-    if (car->queue_head) {
-        floor_node *old_head = car->queue_head;
-        car->queue_head = car->queue_head->next;
-        if (!car->queue_head) {
-            car->queue_tail = NULL;
+// Map (creating if needed) the checkpoint file and optionally restore saved state
+int checkpoint_open(const char *path, int restore) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("open checkpoint");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat checkpoint");
+        close(fd);
+        return -1;
+    }
+
+    int fresh = (st.st_size != (off_t)sizeof(checkpoint_file));
+    if (fresh && ftruncate(fd, sizeof(checkpoint_file)) == -1) {
+        perror("ftruncate checkpoint");
+        close(fd);
+        return -1;
+    }
+
+    checkpoint_file *cp = mmap(NULL, sizeof(checkpoint_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cp == MAP_FAILED) {
+        perror("mmap checkpoint");
+        return -1;
+    }
+    ctrl.checkpoint = cp;
+
+    if (restore && !fresh && cp->magic == CHECKPOINT_MAGIC && cp->version == CHECKPOINT_VERSION) {
+        int restored = checkpoint_restore();
+        if (restored > 0) {
+            printf("Restored %d car(s) from checkpoint generation %llu\n",
+                   restored, (unsigned long long)atomic_load(&cp->generation));
+            return 0;
         }
-        free(old_head);
+        if (restored == 0) return 0;
+        fprintf(stderr, "Checkpoint is inconsistent, starting empty\n");
     }
+
+    // Unknown or stale layout - start from an empty table
+    memset(cp, 0, sizeof(*cp));
+    cp->magic = CHECKPOINT_MAGIC;
+    cp->version = CHECKPOINT_VERSION;
+    return 0;
 }
 
-char *get_queue_front(car_info *car) {
-    return car->queue_head ? car->queue_head->floor : NULL;
+// 1 while passengers can get on or off at the car's current floor
+int is_door_open(car_info *car) {
+    return strncmp(car->status, "Opening", MAX_STATUS_LEN) == 0 ||
+           strncmp(car->status, "Open", MAX_STATUS_LEN) == 0;
+}
+
+// 1 if the car is idle: doors shut at the floor it was last sent to
+int is_car_parked(car_info *car) {
+    return strncmp(car->status, "Closed", MAX_STATUS_LEN) == 0 &&
+           strncmp(car->current_floor, car->destination_floor, MAX_FLOOR_LEN) == 0;
+}
+
+// 1 if the car is closing up for a run or already between floors
+int is_car_moving(car_info *car) {
+    if (strncmp(car->status, "Closing", MAX_STATUS_LEN) != 0 && strncmp(car->status, "Between", MAX_STATUS_LEN) != 0) {
+        return 0;
+    }
+    return strncmp(car->current_floor, car->destination_floor, MAX_FLOOR_LEN) != 0;
 }
 
+// The car's commitment point. A moving car is treated as already at the next
+// floor: it will take a FLOOR for that floor mid-run, but it may have got
+// there by the time the message arrives, so only floors past it count as
+// ahead of the car.
 int get_car_position_numeric(car_info *car) {
     floor_info current_info = parse_floor(car->current_floor);
 
-    // If status is Closing or Between, treat position as next floor in direction
-    if (strncmp(car->status, "Closing", MAX_STATUS_LEN) == 0 || strncmp(car->status, "Between", MAX_STATUS_LEN) == 0) {
+    if (is_car_moving(car)) {
         floor_info dest_info = parse_floor(car->destination_floor);
-        if (current_info.ok && dest_info.ok && current_info.numeric != dest_info.numeric) {
+        if (current_info.ok && dest_info.ok) {
             int direction = (dest_info.numeric > current_info.numeric) ? 1 : -1;
-            return current_info.numeric + direction;
+
+            // A car on an express run reports every few floors, so count
+            // the floors it has passed since, short of the next report
+            int ahead = 1;
+            int per_floor = car->floor_ms > 0 ? car->floor_ms : car->step_ms;
+            if (car->report_floors > 1 && per_floor > 0 &&
+                strncmp(car->status, "Between", MAX_STATUS_LEN) == 0) {
+                long passed = ms_since(&car->stepped) / per_floor;
+                ahead += passed < car->report_floors - 1 ? (int)passed : car->report_floors - 1;
+            }
+            int span = topology_floors(&ctrl.topology, current_info.numeric, dest_info.numeric);
+            if (ahead > span) ahead = span;
+
+            int next = topology_move(&ctrl.topology, current_info.numeric, direction * ahead);
+            return next != 0 ? next : dest_info.numeric;
         }
     }
 
@@ -279,8 +703,11 @@ int calculate_eta(car_info *car, const char *target_floor) {
     floor_info target_info = parse_floor(target_floor);
     if (!target_info.ok) return INT_MAX;
 
+    // Light-traffic dispatch keeps its original distance unless the
+    // building has been described
     int car_pos = get_car_position_numeric(car);
-    int distance = abs(target_info.numeric - car_pos);
+    int distance = ctrl.topology.floor_count > 0 ? topology_floors(&ctrl.topology, car_pos, target_info.numeric)
+                                                  : abs(target_info.numeric - car_pos);
 
     // Add queue length penalty
     int queue_len = 0;
@@ -309,6 +736,32 @@ int is_direction_compatible(car_info *car, const char *source, const char *desti
     }
 }
 
+// Milliseconds since a monotonic timestamp
+long ms_since(const struct timespec *then) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000L +
+           (now.tv_nsec - then->tv_nsec) / 1000000L;
+}
+
+// Milliseconds since the car last said anything
+long car_silence_ms(car_info *car) {
+    return ms_since(&car->last_seen);
+}
+
+// A heartbeat car that has missed its deadline may be hung - don't give it work
+int is_car_alive(car_info *car) {
+    if (!car->connected) return 0;
+    if (!(car->features & CAR_FEATURE_HEARTBEAT) || ctrl.heartbeat_ms <= 0) return 1;
+    return car_silence_ms(car) <= (long)ctrl.heartbeat_ms * HEARTBEAT_MISSES;
+}
+
+// A floor in the car's range that it may open at
+int car_serves(car_info *car, const char *floor) {
+    return is_valid_floor_range(floor, car->lowest, car->highest) &&
+           topology_stops_at(&ctrl.topology, car->topology_car, parse_floor(floor).numeric);
+}
+
 car_info *find_best_car(const char *source, const char *destination) {
     floor_info source_info = parse_floor(source);
     floor_info dest_info = parse_floor(destination);
@@ -320,12 +773,11 @@ car_info *find_best_car(const char *source, const char *destination) {
     for (int i = 0; i < ctrl.car_count; i++) {
         car_info *car = &ctrl.cars[i];
 
-        // Skip disconnected cars
-        if (!car->connected) continue;
+        // Skip disconnected, unresponsive or reserved cars
+        if (!is_car_alive(car) || car->reserved) continue;
 
         // Check if car can serve both floors
-        if (!is_valid_floor_range(source, car->lowest, car->highest) ||
-            !is_valid_floor_range(destination, car->lowest, car->highest)) {
+        if (!car_serves(car, source) || !car_serves(car, destination)) {
             continue;
         }
 
@@ -346,228 +798,3456 @@ car_info *find_best_car(const char *source, const char *destination) {
     return best_car;
 }
 
-void handle_call_request(int client_fd, const char *message) {
-    char source[4], destination[4];
-    if (sscanf(message, "CALL %3s %3s", source, destination) != 2) {
-        write_message(client_fd, "UNAVAILABLE");
-        return;
+void mpsc_init(mpsc_queue *q) {
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+}
+
+void mpsc_push(mpsc_queue *q, mpsc_node *node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mpsc_node *prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// Consumer only. Returns NULL when empty, or when the newest push hasn't
+// been linked in yet - that producer is a couple of instructions from done.
+mpsc_node *mpsc_pop(mpsc_queue *q) {
+    mpsc_node *tail = q->tail;
+    mpsc_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        q->tail = next;
+        return tail;
     }
 
-    pthread_mutex_lock(&ctrl.mutex);
+    // tail is the last node - put the stub behind it so it can be handed out
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) return NULL;
+    mpsc_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
 
-    car_info *car = find_best_car(source, destination);
-    if (car) {
-        // Save current front before adding
-        char old_front_str[MAX_FLOOR_LEN] = "";
-        char *old_front = get_queue_front(car);
-        if (old_front) {
-            strncpy(old_front_str, old_front, sizeof(old_front_str) - 1);
-            old_front_str[sizeof(old_front_str) - 1] = '\0';
-        }
+controller_event *new_event(event_type type, connection *conn) {
+    controller_event *event = calloc(1, sizeof(controller_event));
+    if (event) {
+        event->type = type;
+        event->conn = conn;
+    }
+    return event;
+}
 
-        // Add source and destination to car's queue
-        add_to_queue(car, source);
-        add_to_queue(car, destination);
+void post_event(controller_event *event) {
+    mpsc_push(&ctrl.events, &event->link);
+    sem_post(&ctrl.events_ready);
+}
 
-        // Only tell car to move if the queue changed
-        char *new_front = get_queue_front(car);
-        if (new_front && (old_front_str[0] == '\0' || strncmp(old_front_str, new_front, MAX_FLOOR_LEN) != 0)) {
-            char floor_msg[64];
-            snprintf(floor_msg, sizeof(floor_msg), "FLOOR %s", new_front);
-            write_message(car->fd, floor_msg);
-        }
+// Last thing an I/O thread does with a connection; the dispatcher frees it
+void post_closed(connection *conn) {
+    controller_event *event = new_event(EVENT_CLOSED, conn);
+    if (event) post_event(event);
+}
 
-        char response[64];
-        snprintf(response, sizeof(response), "CAR %s", car->name);
-        write_message(client_fd, response);
-    } else {
-        write_message(client_fd, "UNAVAILABLE");
-    }
-
-    pthread_mutex_unlock(&ctrl.mutex);
-}
-
-void handle_car_message(car_info *car, const char *message) {
-    if (strncmp(message, "STATUS ", 7) == 0) {
-        char status[8], current[4], dest[4];
-        if (sscanf(message, "STATUS %7s %3s %3s", status, current, dest) == 3) {
-            pthread_mutex_lock(&ctrl.mutex);
-
-            // Update car status
-            strncpy(car->status, status, sizeof(car->status) - 1);
-            car->status[sizeof(car->status) - 1] = '\0';
-            strncpy(car->current_floor, current, sizeof(car->current_floor) - 1);
-            car->current_floor[sizeof(car->current_floor) - 1] = '\0';
-            strncpy(car->destination_floor, dest, sizeof(car->destination_floor) - 1);
-            car->destination_floor[sizeof(car->destination_floor) - 1] = '\0';
-
-            // Car opened at the requested floor - remove it from queue
-            char *front = get_queue_front(car);
-            if (front && strncmp(car->status, "Opening", MAX_STATUS_LEN) == 0 &&
-                strncmp(car->current_floor, front, MAX_FLOOR_LEN) == 0) {
-                pop_queue(car);
-
-                // Tell car to go to the next requested floor
-                front = get_queue_front(car);
-                if (front) {
-                    char floor_msg[64];
-                    snprintf(floor_msg, sizeof(floor_msg), "FLOOR %s", front);
-                    write_message(car->fd, floor_msg);
-                }
-            }
+connection *conn_create(int fd) {
+    connection *conn = calloc(1, sizeof(connection));
+    if (!conn) return NULL;
+    conn->notify[0] = conn->notify[1] = -1;
 
-            pthread_mutex_unlock(&ctrl.mutex);
+    // The event loop is woken through io_wake instead
+    if (ctrl.io_backend == IO_THREADS) {
+        if (pipe(conn->notify) == -1) {
+            free(conn);
+            return NULL;
         }
-    } else if (strcmp(message, "EMERGENCY") == 0) {
-        pthread_mutex_lock(&ctrl.mutex);
-        car->connected = 0;
-        free_queue(car->queue_head);
-        car->queue_head = car->queue_tail = NULL;
-        pthread_mutex_unlock(&ctrl.mutex);
-    } else if (strcmp(message, "INDIVIDUAL SERVICE") == 0) {
-        pthread_mutex_lock(&ctrl.mutex);
-        car->connected = 0;
-        free_queue(car->queue_head);
-        car->queue_head = car->queue_tail = NULL;
-        pthread_mutex_unlock(&ctrl.mutex);
+
+        // The dispatcher must never block on a slow peer, and the I/O thread
+        // drains whatever notify bytes are there
+        fcntl(conn->notify[0], F_SETFL, O_NONBLOCK);
+        fcntl(conn->notify[1], F_SETFL, O_NONBLOCK);
     }
+    conn->fd = fd;
+    conn->car_index = -1;
+    atomic_init(&conn->notified, 0);
+    mpsc_init(&conn->outbound);
+    return conn;
 }
 
-void *client_handler(void *arg) {
-    int client_fd = *(int*)arg;
-    free(arg);
+// Release a connection nobody else can reach any more. The socket itself
+// is closed by its I/O thread.
+void conn_free(connection *conn) {
+    mpsc_node *node;
+    while ((node = mpsc_pop(&conn->outbound)) != NULL) {
+        free(node);
+    }
+    if (conn->notify[0] >= 0) {
+        close(conn->notify[0]);
+        close(conn->notify[1]);
+    }
+    free(conn->rx);
+    free(conn->tx);
+    free(conn->sending);
+    free(conn);
+}
 
-    char *message = read_message(client_fd);
-    if (!message) {
-        close(client_fd);
-        return NULL;
+// Hand a message to the event loop and wake it if it isn't already awake
+void post_outbox(outbound_message *msg) {
+    mpsc_push(&ctrl.io_outbox, &msg->link);
+    if (!atomic_exchange(&ctrl.io_woken, 1)) {
+        (void)write(ctrl.io_wake[1], "m", 1);
     }
+}
 
-    if (strncmp(message, "CAR ", 4) == 0) {
-        // Car registration
-        char name[32], lowest[4], highest[4];
-        if (sscanf(message, "CAR %31s %3s %3s", name, lowest, highest) == 3) {
-            pthread_mutex_lock(&ctrl.mutex);
-
-            // Find existing car or create new
-            car_info *car = NULL;
-            for (int i = 0; i < ctrl.car_count; i++) {
-                if (strncmp(ctrl.cars[i].name, name, MAX_CAR_NAME_LEN) == 0) {
-                    car = &ctrl.cars[i];
-                    // Clean up old queue
-                    free_queue(car->queue_head);
-                    car->queue_head = car->queue_tail = NULL;
-                    break;
-                }
-            }
+// Dispatcher only: queue a frame for the peer and wake its I/O thread
+void conn_send(connection *conn, const char *text, int final) {
+    size_t len = strlen(text) + 1;
+    outbound_message *msg = malloc(sizeof(outbound_message) + len);
+    if (!msg) return;
+    msg->conn = conn;
+    msg->final = final;
+    msg->release = 0;
+    memcpy(msg->text, text, len);
 
-            if (!car && ctrl.car_count < 32) {
-                car = &ctrl.cars[ctrl.car_count++];
-            }
+    if (ctrl.io_backend != IO_THREADS) {
+        post_outbox(msg);
+        return;
+    }
+    mpsc_push(&conn->outbound, &msg->link);
 
-            if (car) {
-                strncpy(car->name, name, sizeof(car->name) - 1);
-                car->name[sizeof(car->name) - 1] = '\0';
-                strncpy(car->lowest, lowest, sizeof(car->lowest) - 1);
-                car->lowest[sizeof(car->lowest) - 1] = '\0';
-                strncpy(car->highest, highest, sizeof(car->highest) - 1);
-                car->highest[sizeof(car->highest) - 1] = '\0';
-                car->connected = 1;
-                car->fd = client_fd;
-                strncpy(car->current_floor, lowest, sizeof(car->current_floor) - 1);
-                car->current_floor[sizeof(car->current_floor) - 1] = '\0';
-                strncpy(car->destination_floor, lowest, sizeof(car->destination_floor) - 1);
-                car->destination_floor[sizeof(car->destination_floor) - 1] = '\0';
-                strncpy(car->status, "Closed", sizeof(car->status) - 1);
-                car->status[sizeof(car->status) - 1] = '\0';
-                car->queue_head = car->queue_tail = NULL;
-            }
+    if (!atomic_exchange(&conn->notified, 1)) {
+        (void)write(conn->notify[1], "m", 1);
+    }
+}
 
-            pthread_mutex_unlock(&ctrl.mutex);
+void conn_close(connection *conn) {
+    conn_send(conn, "", 1);
+}
 
-            if (car) {
-                // Now listen for status updates from the car
-                while (ctrl.running && !shutdown_requested && car->connected) {
-                    free(message);
-                    message = read_message(client_fd);
-                    if (!message) break;
+// Write out everything the dispatcher has queued. Returns 1 once a final
+// frame has gone (or the peer has), 0 to keep serving.
+int flush_outbound(connection *conn) {
+    char drain[16];
+    while (read(conn->notify[0], drain, sizeof(drain)) > 0) {
+    }
+    atomic_store(&conn->notified, 0);
 
-                    handle_car_message(car, message);
-                }
-            }
+    int done = 0;
+    mpsc_node *node;
+    while ((node = mpsc_pop(&conn->outbound)) != NULL) {
+        outbound_message *msg = (outbound_message *)node;
+        if (!done && msg->text[0] != '\0' && write_message(conn->fd, msg->text) < 0) {
+            done = 1;
         }
-    } else if (strncmp(message, "CALL ", 5) == 0) {
-        // Call request
-        handle_call_request(client_fd, message);
+        if (msg->final) done = 1;
+        free(msg);
     }
+    return done;
+}
 
-    free(message);
-    close(client_fd);
-    return NULL;
+// The car registered on a connection, or NULL if there isn't one (or the
+// car has since registered again on a newer connection)
+car_info *conn_car(connection *conn) {
+    if (!conn || conn->car_index < 0) return NULL;
+    car_info *car = &ctrl.cars[conn->car_index];
+    return car->conn == conn ? car : NULL;
 }
 
-int main() {
-    // Set up the dispatcher
-    memset(&ctrl, 0, sizeof(ctrl));
-    ctrl.running = 1;
-    ctrl.server_fd = -1;
-    pthread_mutex_init(&ctrl.mutex, NULL);
+// DWELL hint for a car that takes them
+void send_dwell(car_info *car, const char *hint) {
+    if (!car->conn || !(car->features & CAR_FEATURE_DWELL)) return;
+    char dwell_msg[32];
+    snprintf(dwell_msg, sizeof(dwell_msg), "DWELL %s", hint);
+    conn_send(car->conn, dwell_msg, 0);
+}
 
-    // Graceful shutdown on Ctrl+C
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = sigint_handler;
-    sa.sa_flags = SA_RESTART;  // Restart interrupted system calls
-    sigemptyset(&sa.sa_mask);
-    if (sigaction(SIGINT, &sa, NULL) == -1) {
-        perror("sigaction SIGINT");
-        return 1;
+void send_floor(car_info *car, const char *floor) {
+    if (!car->conn) return;
+    char floor_msg[64];
+    snprintf(floor_msg, sizeof(floor_msg), "FLOOR %s", floor);
+    conn_send(car->conn, floor_msg, 0);
+}
+
+// Route-capable cars hold the whole stop list and work through it on their
+// own: they get the full list on registration and an edit per new stop
+void send_route(car_info *car) {
+    if (!car->conn) return;
+    char route_msg[8 + MAX_FLOOR_COUNT * MAX_FLOOR_LEN];
+    size_t len = (size_t)snprintf(route_msg, sizeof(route_msg), "ROUTE");
+    for (floor_node *node = car->queue_head; node && len + MAX_FLOOR_LEN < sizeof(route_msg); node = node->next) {
+        len += (size_t)snprintf(route_msg + len, sizeof(route_msg) - len, " %s", node->floor);
     }
+    conn_send(car->conn, route_msg, 0);
+}
 
-    // Don't crash on broken connections
-    sa.sa_handler = SIG_IGN;
-    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
-        perror("sigaction SIGPIPE");
-        return 1;
+// A new stop is placed by how many stops follow it rather than by index, so
+// it still lands in the right place if the car has already served the head
+void send_route_stop(car_info *car, const char *floor) {
+    if (!car->conn) return;
+    int following = -1;
+    for (floor_node *node = car->queue_head; node; node = node->next) {
+        if (following >= 0) {
+            following++;
+        } else if (strncmp(node->floor, floor, MAX_FLOOR_LEN) == 0) {
+            following = 0;
+        }
+    }
+    if (following < 0) return;
+
+    char route_msg[64];
+    snprintf(route_msg, sizeof(route_msg), "ROUTE ADD %s %d", floor, following);
+    conn_send(car->conn, route_msg, 0);
+}
+
+void slot_floor(int slot, char *out) {
+    int numeric = slot_numeric(slot);
+    floor_to_string(numeric, numeric < 0, out);
+}
+
+int hall_call_pending(int direction, int slot) {
+    return (ctrl.hall_calls.pending[direction][slot / 64] >> (slot % 64)) & 1U;
+}
+
+// 1 if this car is one of those given the pickup
+int hall_call_held(const car_info *car, int direction, int slot) {
+    return (ctrl.hall_calls.cars[direction][slot] >> (car - ctrl.cars)) & 1U;
+}
+
+void hall_call_add(const car_info *car, int direction, int slot) {
+    ctrl.hall_calls.cars[direction][slot] |= 1U << (car - ctrl.cars);
+    ctrl.hall_calls.pending[direction][slot / 64] |= 1ULL << (slot % 64);
+}
+
+void hall_call_drop(const car_info *car, int direction, int slot) {
+    ctrl.hall_calls.cars[direction][slot] &= ~(1U << (car - ctrl.cars));
+    if (ctrl.hall_calls.cars[direction][slot] == 0) {
+        ctrl.hall_calls.pending[direction][slot / 64] &= ~(1ULL << (slot % 64));
+    }
+}
+
+// A car already coming for this floor and direction, if one can also take
+// the passenger where they're going
+car_info *find_hall_call_car(int source, int destination, const char *destination_str) {
+    int direction = destination > source ? HALL_UP : HALL_DOWN;
+    int slot = floor_slot(source);
+
+    uint32_t cars = ctrl.hall_calls.cars[direction][slot];
+    while (cars) {
+        car_info *car = &ctrl.cars[__builtin_ctz(cars)];
+        cars &= cars - 1;
+        if (is_car_alive(car) && !car->reserved && car_serves(car, destination_str)) return car;
+    }
+    return NULL;
+}
+
+void record_hall_call(int source, int destination, car_info *car) {
+    hall_call_add(car, destination > source ? HALL_UP : HALL_DOWN, floor_slot(source));
+}
+
+void record_wait(long ms) {
+    wait_histogram *h = &ctrl.waits;
+    long bucket = ms / WAIT_BUCKET_MS;
+    h->count[bucket < WAIT_BUCKETS ? bucket : WAIT_BUCKETS - 1]++;
+    h->total++;
+    if (ctrl.max_wait_ms > 0 && ms > ctrl.max_wait_ms) h->overdue++;
+    if (ms > h->max_ms) h->max_ms = ms;
+}
+
+static const char *const traffic_names[] = {"LIGHT", "INTERFLOOR", "UP-PEAK", "DOWN-PEAK"};
+
+// Re-read the traffic mode from the calls still in the window. A peak needs
+// TRAFFIC_PEAK_ENTER% of calls to start it but only TRAFFIC_PEAK_LEAVE% to
+// keep it, so the mode doesn't flap at the boundary.
+void classify_traffic(void) {
+    traffic_window *t = &ctrl.traffic;
+    if (ctrl.traffic_window_ms <= 0) return;
+
+    int total = 0, from = 0, to = 0;
+    for (int i = 0; i < TRAFFIC_HISTORY; i++) {
+        if (t->placed[i].tv_sec == 0 || ms_since(&t->placed[i]) > ctrl.traffic_window_ms) continue;
+        total++;
+        from += (t->lobby[i] & TRAFFIC_FROM_LOBBY) != 0;
+        to += (t->lobby[i] & TRAFFIC_TO_LOBBY) != 0;
+    }
+
+    int mode = TRAFFIC_LIGHT;
+    if (total >= TRAFFIC_MIN_CALLS) {
+        int up = from * 100 >= total * (t->mode == TRAFFIC_UP_PEAK ? TRAFFIC_PEAK_LEAVE : TRAFFIC_PEAK_ENTER);
+        int down = to * 100 >= total * (t->mode == TRAFFIC_DOWN_PEAK ? TRAFFIC_PEAK_LEAVE : TRAFFIC_PEAK_ENTER);
+        if (up && (!down || from >= to)) {
+            mode = TRAFFIC_UP_PEAK;
+        } else if (down) {
+            mode = TRAFFIC_DOWN_PEAK;
+        } else {
+            mode = TRAFFIC_INTERFLOOR;
+        }
+    }
+    t->mode = mode;
+}
+
+void record_traffic(int source, int destination) {
+    traffic_window *t = &ctrl.traffic;
+    clock_gettime(CLOCK_MONOTONIC, &t->placed[t->next]);
+    t->lobby[t->next] = (uint8_t)((source == ctrl.lobby ? TRAFFIC_FROM_LOBBY : 0U) |
+                                  (destination == ctrl.lobby ? TRAFFIC_TO_LOBBY : 0U));
+    t->next = (t->next + 1) % TRAFFIC_HISTORY;
+    classify_traffic();
+}
+
+// Wait in ms that a fraction of pickups came in under, to bucket resolution
+long wait_percentile(double fraction) {
+    wait_histogram *h = &ctrl.waits;
+    if (h->total == 0) return 0;
+
+    uint32_t rank = (uint32_t)(fraction * h->total + 0.999999);
+    if (rank < 1) rank = 1;
+    uint32_t seen = 0;
+    for (int b = 0; b < WAIT_BUCKETS - 1; b++) {
+        seen += h->count[b];
+        if (seen >= rank) {
+            long upper = (long)(b + 1) * WAIT_BUCKET_MS;
+            return upper < h->max_ms ? upper : h->max_ms;
+        }
+    }
+    return h->max_ms;
+}
+
+// 1 once a waiting call is old enough to jump the queue
+int call_is_aged(const call_record *call) {
+    return ctrl.max_wait_ms > 0 && ms_since(&call->placed) >= ctrl.max_wait_ms / 2;
+}
+
+// 1 if nothing new may go ahead of a waiting call: it is aged, or was placed
+// as PRIORITY or RESERVE
+int call_is_urgent(const call_record *call) {
+    return call->priority != CALL_NORMAL || call_is_aged(call);
+}
+
+// The car has stopped at a floor, so its pickups there are done
+void clear_hall_calls_at(car_info *car, int floor) {
+    int slot = floor_slot(floor);
+    for (int direction = HALL_UP; direction <= HALL_DOWN; direction++) {
+        hall_call_drop(car, direction, slot);
+    }
+
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (call->state == CALL_WAITING && call->car == car - ctrl.cars && call->source == slot) {
+            call->state = CALL_RIDING;
+            call->boarded = car->openings;
+            long wait = ms_since(&call->placed);
+            record_wait(wait);
+            if (call->eta_ms >= 0) {
+                ctrl.waits.eta_count++;
+                ctrl.waits.eta_abs_ms += labs(wait - call->eta_ms);
+                ctrl.waits.eta_bias_ms += wait - call->eta_ms;
+            }
+            if (call->watcher) {
+                conn_send(call->watcher, "ARRIVED", 1);
+                call->watcher = NULL;
+            }
+        }
+    }
+}
+
+// The car's queue was dropped - nobody is waiting on it any more
+void forget_hall_calls(car_info *car) {
+    for (int direction = HALL_UP; direction <= HALL_DOWN; direction++) {
+        for (unsigned word = 0; word < HALL_CALL_WORDS; word++) {
+            uint64_t bits = ctrl.hall_calls.pending[direction][word];
+            while (bits) {
+                int bit = __builtin_ctzll(bits);
+                bits &= bits - 1;
+                hall_call_drop(car, direction, (int)word * 64 + bit);
+            }
+        }
+    }
+}
+
+// Note a call against the car taking it. If the ledger is full the car is
+// left untracked, so none of its stops are dropped on the ledger's say-so,
+// and there is no record.
+call_record *record_call(car_info *car, int source, int destination, int priority) {
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (call->state != CALL_FREE) continue;
+
+        if (++ctrl.next_call_id == 0) ctrl.next_call_id = 1;
+        call->id = ctrl.next_call_id;
+        call->state = CALL_WAITING;
+        call->priority = (uint8_t)priority;
+        call->eta_ms = -1;
+        call->watcher = NULL;
+        call->car = (int8_t)(car - ctrl.cars);
+        call->source = (int16_t)floor_slot(source);
+        call->destination = (int16_t)floor_slot(destination);
+        clock_gettime(CLOCK_MONOTONIC, &call->placed);
+        call->since = call->placed;
+        return call;
+    }
+    car->untracked = 1;
+    return NULL;
+}
+
+// The car has opened at a floor, so whoever was riding there is done
+void finish_calls_at(car_info *car, int floor) {
+    int slot = floor_slot(floor);
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (call->state == CALL_RIDING && call->car == car - ctrl.cars && call->destination == slot) {
+            call->state = CALL_FREE;
+        }
+    }
+}
+
+void forget_calls(car_info *car) {
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (call->car != car - ctrl.cars) continue;
+        if (call->state == CALL_WAITING && call->watcher) {
+            conn_send(call->watcher, "UNAVAILABLE", 1);
+            call->watcher = NULL;
+        }
+        call->state = CALL_FREE;
+    }
+    car->untracked = 0;
+    car->reserved = 0;
+    car->parking = 0;
+}
+
+// 1 if a call on the car still needs it to stop at a floor slot
+int stop_needed(car_info *car, int slot) {
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (call->state == CALL_FREE || call->car != car - ctrl.cars) continue;
+        if (call->destination == slot || (call->state == CALL_WAITING && call->source == slot)) return 1;
+    }
+    return 0;
+}
+
+// Stop insertion. A call's pickup and drop-off go where they add the least
+// time overall: the delay they cause every stop already queued behind them,
+// plus the new passenger's own time to arrival. An urgent call counts only
+// its own time. Times are in floor-travel units, and each stop costs a door
+// cycle on top. A car that has sent its motion profile is timed by it: a
+// run costs the floors its travel time would take at full speed, so short
+// hops cost more than their length and long runs close to it.
+#define STOP_COST 3
+#define NO_PLAN INT_MAX
+
+// The car's queue flattened once into dense floor slots
+typedef struct {
+    int n;
+    int origin;                       // Slot of the car's commitment point
+    int moving;                       // Direction the car is committed to, or 0
+    int start;                        // Time before the car gets going again
+    int frozen;                       // Last stop with an urgent pickup, or -1
+    const motion_profile *motion;     // The car's, to time runs by, or NULL to count floors
+    int others;                       // Weight on delay to queued stops: 1, or 0 for an urgent call
+    int stop[MAX_FLOOR_COUNT];
+    int arrive[MAX_FLOOR_COUNT];      // Time the car reaches each stop
+    int leave[MAX_FLOOR_COUNT];       // Direction a pickup here must leave in, or 0
+} route_plan;
+
+static int sign(int x) {
+    return (x > 0) - (x < 0);
+}
+
+// Direction the car must leave a floor in to collect the passengers waiting
+// there, or 0 if there are none (or some each way)
+static int pickup_direction(car_info *car, int slot) {
+    return hall_call_held(car, HALL_UP, slot) - hall_call_held(car, HALL_DOWN, slot);
+}
+
+// Steps a car with work to do is running late: how long it has gone without
+// moving on, past a floor's travel or a stop's door cycle, e.g. with its
+// doors held open
+static int car_stall(car_info *car) {
+    if (car->step_ms <= 0 || !car->queue_head || is_car_parked(car)) return 0;
+    int steps = (int)(ms_since(&car->progressed) / car->step_ms);
+    int usual = strncmp(car->status, "Between", MAX_STATUS_LEN) == 0 ? car->report_floors : STOP_COST;
+    return steps > usual ? steps - usual : 0;
+}
+
+// Time to travel between two slots
+static int plan_travel(const route_plan *plan, int from, int to) {
+    int floors = topology_floors(&ctrl.topology, slot_numeric(from), slot_numeric(to));
+    if (!plan->motion || floors == 0) return floors;
+
+    const motion_profile *m = plan->motion;
+    double distance = topology_distance(&ctrl.topology, slot_numeric(from), slot_numeric(to), m->floor_height);
+    return (int)lround(motion_run_time(m, distance) * m->speed / m->floor_height);
+}
+
+void plan_build(car_info *car, route_plan *plan) {
+    plan->origin = floor_slot(get_car_position_numeric(car));
+    plan->moving = 0;
+    if (is_car_moving(car)) {
+        plan->moving = sign(compare_floors(car->destination_floor, car->current_floor));
+    }
+
+    // Floors where someone is waiting that nothing may go ahead of
+    uint64_t urgent[HALL_CALL_WORDS] = {0};
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (call->state == CALL_WAITING && call->car == car - ctrl.cars && call_is_urgent(call)) {
+            urgent[call->source / 64] |= 1ULL << (call->source % 64);
+        }
+    }
+
+    plan->n = 0;
+    plan->motion = car->motion.speed > 0.0 ? &car->motion : NULL;
+    plan->start = car_stall(car);
+    plan->frozen = -1;
+    plan->others = 1;
+    int at = plan->origin;
+    int time = plan->start;
+    for (floor_node *node = car->queue_head; node && plan->n < (int)MAX_FLOOR_COUNT; node = node->next) {
+        int slot = floor_slot(parse_floor(node->floor).numeric);
+        time += plan_travel(plan, at, slot);
+        plan->stop[plan->n] = slot;
+        plan->arrive[plan->n] = time;
+        plan->leave[plan->n] = pickup_direction(car, slot);
+        if ((urgent[slot / 64] >> (slot % 64)) & 1U) plan->frozen = plan->n;
+        plan->n++;
+        time += STOP_COST;
+        at = slot;
+    }
+}
+
+static int plan_index(const route_plan *plan, int slot) {
+    for (int i = 0; i < plan->n; i++) {
+        if (plan->stop[i] == slot) return i;
+    }
+    return -1;
+}
+
+// Where the car is coming from when it reaches slot i, and when it sets off
+static int plan_prev(const route_plan *plan, int i) {
+    return i == 0 ? plan->origin : plan->stop[i - 1];
+}
+
+static int plan_depart(const route_plan *plan, int i) {
+    return i == 0 ? plan->start : plan->arrive[i - 1] + STOP_COST;
+}
+
+// Extra time every stop from slot i on waits if floor x is inserted there
+static int plan_detour(const route_plan *plan, int i, int x) {
+    int prev = plan_prev(plan, i);
+    int detour = plan_travel(plan, prev, x) + STOP_COST;
+    if (i < plan->n) {
+        detour += plan_travel(plan, x, plan->stop[i]) - plan_travel(plan, prev, plan->stop[i]);
+    }
+    return detour;
+}
+
+// Can the car go to floor x at slot i? A moving car can't be sent back past
+// its commitment point, a pickup must still be left in its direction, and
+// nothing goes ahead of an urgent pickup.
+static int plan_reachable(const route_plan *plan, int i, int x) {
+    if (i <= plan->frozen) return 0;
+    if (i == 0) {
+        return !plan->moving || sign(x - plan->origin) == plan->moving;
+    }
+    return plan->leave[i - 1] == 0 || sign(x - plan->stop[i - 1]) == plan->leave[i - 1];
+}
+
+// Best slot for a drop-off when its pickup is already queued at index after
+static int plan_best_dropoff(const route_plan *plan, int after, int e) {
+    int best = NO_PLAN, best_j = plan->n;
+    for (int j = after + 1; j <= plan->n; j++) {
+        if (!plan_reachable(plan, j, e)) continue;
+        int cost = plan_detour(plan, j, e) * (plan->n - j) * plan->others +
+                   plan_depart(plan, j) + plan_travel(plan, plan_prev(plan, j), e);
+        if (cost < best) {
+            best = cost;
+            best_j = j;
+        }
+    }
+    return best_j;
+}
+
+// Best slot for a pickup when its drop-off is already queued at index before
+static int plan_best_pickup(const route_plan *plan, int before, int s, int direction) {
+    int best = NO_PLAN, best_i = -1;
+    for (int i = 0; i <= before; i++) {
+        if (!plan_reachable(plan, i, s) || sign(plan->stop[i] - s) != direction) continue;
+        int cost = plan_detour(plan, i, s) * ((plan->n - i) * plan->others + 1);
+        if (cost < best) {
+            best = cost;
+            best_i = i;
+        }
+    }
+    return best_i;
+}
+
+// Best slots for a new pickup and drop-off. The pickup goes in front of
+// index *i; the drop-off goes in front of index *j, straight after the pickup
+// if *j == *i. Every (i, j) pair is covered in one pass: the cost of i < j
+// splits into a pickup part and a drop-off part, so it is enough to keep the
+// cheapest pickup seen so far.
+static void plan_best_pair(const route_plan *plan, int s, int e, int *i_out, int *j_out) {
+    int direction = sign(e - s);
+    int best = NO_PLAN;
+    *i_out = *j_out = plan->n;
+
+    int best_pickup = NO_PLAN, best_pickup_i = -1;
+    for (int j = 0; j <= plan->n; j++) {
+        // Pickup and drop-off back to back in front of stop j
+        if (plan_reachable(plan, j, s)) {
+            int prev = plan_prev(plan, j);
+            int ride = plan_travel(plan, prev, s) + STOP_COST + plan_travel(plan, s, e);
+            int detour = ride + STOP_COST;
+            if (j < plan->n) {
+                detour += plan_travel(plan, e, plan->stop[j]) - plan_travel(plan, prev, plan->stop[j]);
+            }
+            int cost = detour * (plan->n - j) * plan->others + plan_depart(plan, j) + ride;
+            if (cost < best) {
+                best = cost;
+                *i_out = *j_out = j;
+            }
+        }
+
+        // Pickup in front of stop j-1, drop-off after it
+        if (j == 0) continue;
+        int i = j - 1;
+        if (plan_reachable(plan, i, s) && sign(plan->stop[i] - s) == direction) {
+            int cost = plan_detour(plan, i, s) * ((plan->n - i) * plan->others + 1);
+            if (cost < best_pickup) {
+                best_pickup = cost;
+                best_pickup_i = i;
+            }
+        }
+        if (best_pickup_i >= 0 && plan_reachable(plan, j, e)) {
+            int cost = best_pickup + plan_detour(plan, j, e) * (plan->n - j) * plan->others +
+                       plan_depart(plan, j) + plan_travel(plan, plan->stop[j - 1], e);
+            if (cost < best) {
+                best = cost;
+                *i_out = best_pickup_i;
+                *j_out = j;
+            }
+        }
+    }
+}
+
+// Dwell for a stop where someone gets on: up-peak crowds board at the lobby
+static const char *boarding_dwell(int slot) {
+    return ctrl.traffic.mode == TRAFFIC_UP_PEAK && slot == floor_slot(ctrl.lobby) ? "LONG" : "NORMAL";
+}
+
+// Put a call's stops into the car's queue. Floors already queued are shared.
+// Returns 1 if a floor that was already queued gets a second visit, which a
+// ROUTE ADD can't express.
+int insert_call(car_info *car, const char *source, const char *destination, int urgent) {
+    route_plan plan;
+    plan_build(car, &plan);
+    plan.others = !urgent;
+
+    int s = floor_slot(parse_floor(source).numeric);
+    int e = floor_slot(parse_floor(destination).numeric);
+    int ks = plan_index(&plan, s);
+    int ke = plan_index(&plan, e);
+    int moved = 0;
+
+    if (s == e) {
+        if (ks < 0) insert_queue_at(car, plan_best_dropoff(&plan, -1, s), source);
+        return 0;
+    }
+
+    // Doors already open at the pickup - they get straight on, so the doors
+    // mustn't close early on them
+    if (ks < 0 && is_door_open(car) && strncmp(car->current_floor, source, MAX_FLOOR_LEN) == 0) {
+        send_dwell(car, boarding_dwell(s));
+        clear_hall_calls_at(car, parse_floor(source).numeric);
+        if (ke < 0) insert_queue_at(car, plan_best_dropoff(&plan, -1, e), destination);
+        return 0;
+    }
+
+    // The drop-off is queued before the pickup. Other passengers may still
+    // need that stop, so visit the floor a second time after the pickup.
+    if (ks >= 0 && ke >= 0 && ke < ks) {
+        ke = -1;
+        moved = 1;
+    }
+
+    if (ks >= 0 && ke >= 0) {
+        return moved;
+    } else if (ks >= 0) {
+        insert_queue_at(car, plan_best_dropoff(&plan, ks, e), destination);
+    } else if (ke >= 0) {
+        int i = plan_best_pickup(&plan, ke, s, sign(e - s));
+        if (i >= 0) {
+            insert_queue_at(car, i, source);
+        } else {
+            // Nowhere to collect them on the way - make a fresh trip at the end
+            append_to_queue(car, source);
+            append_to_queue(car, destination);
+            moved = 1;
+        }
+    } else {
+        int i, j;
+        plan_best_pair(&plan, s, e, &i, &j);
+        insert_queue_at(car, j, destination);
+        insert_queue_at(car, i, source);
+    }
+    return moved;
+}
+
+// When a car would collect someone at slot s going to slot e, in plan time
+static int pickup_time(car_info *car, int s, int e, int urgent) {
+    route_plan plan;
+    plan_build(car, &plan);
+    plan.others = !urgent;
+    int k = plan_index(&plan, s);
+    if (k >= 0) return plan.arrive[k];
+
+    int i, j;
+    plan_best_pair(&plan, s, e, &i, &j);
+    return plan_depart(&plan, i) + plan_travel(&plan, plan_prev(&plan, i), s);
+}
+
+// Pickup estimates go out to watching clients when they drift this far from
+// the countdown the client is already showing
+#define ETA_REPORT_MS 500
+
+// Time per plan step: the car's own, the fleet's average before it has
+// moved, or 0 if no car has been timed yet
+static int step_estimate(car_info *car) {
+    if (car->step_ms > 0) return car->step_ms;
+    long total = 0;
+    int timed = 0;
+    for (int i = 0; i < ctrl.car_count; i++) {
+        if (ctrl.cars[i].step_ms > 0) {
+            total += ctrl.cars[i].step_ms;
+            timed++;
+        }
+    }
+    return timed ? (int)(total / timed) : 0;
+}
+
+// Milliseconds until the car opens for a waiting call, or -1 if unknown.
+// A car that has sent its motion profile has each run timed by it. Once a
+// car has been timed passing floors, pulling in, opening and pulling away,
+// each leg of the plan is timed from those instead, so a car that overlaps
+// its doors with its motion gets credit for its shorter stops. Until then
+// every plan step takes the same time.
+int call_eta(car_info *car, const route_plan *plan, const call_record *call) {
+    int k = plan_index(plan, call->source);
+    int step = step_estimate(car);
+    if (k < 0 || step <= 0) return -1;
+    const motion_profile *motion = plan->motion;
+    int timed = car->floor_ms > 0 && car->approach_ms > 0 && car->door_ms > 0 && car->depart_ms > 0;
+    if (!motion && !timed) return plan->arrive[k] * step;
+    int door = car->door_ms > 0 ? car->door_ms : STOP_COST * step;
+
+    // What's left of a stop the car is part way through
+    int eta = plan->start * step;
+    if ((is_door_open(car) || strncmp(car->status, "Closing", MAX_STATUS_LEN) == 0) &&
+        floor_slot(parse_floor(car->current_floor).numeric) != call->source) {
+        long spent = ms_since(&car->opened);
+        if (spent < door) eta += door - (int)spent;
+    }
+
+    int at = plan->origin;
+    int stopped = strncmp(car->status, "Between", MAX_STATUS_LEN) != 0;
+    for (int i = 0; i <= k; i++) {
+        int from = slot_numeric(at), to = slot_numeric(plan->stop[i]);
+        int floors = topology_floors(&ctrl.topology, from, to);
+        if (floors > 0 && motion) {
+            double distance = topology_distance(&ctrl.topology, from, to, motion->floor_height);
+            eta += (int)lround(1000.0 * motion_run_time(motion, distance));
+        } else if (floors > 0) {
+            eta += floors * car->floor_ms + car->approach_ms - car->floor_ms;
+            if (stopped) eta += car->depart_ms - car->floor_ms;
+        }
+        if (i < k) eta += door;
+        stopped = 1;
+        at = plan->stop[i];
+    }
+    return eta > 0 ? eta : 0;
+}
+
+// Send fresh estimates to clients watching the car's pickups: when the call
+// has moved to this car, or the estimate has drifted from the countdown
+void update_watchers(car_info *car) {
+    int index = (int)(car - ctrl.cars);
+    int watched = 0;
+    for (int i = 0; i < MAX_CALLS && !watched; i++) {
+        watched = ctrl.calls[i].state == CALL_WAITING && ctrl.calls[i].car == index && ctrl.calls[i].watcher;
+    }
+    if (!watched) return;
+
+    route_plan plan;
+    plan_build(car, &plan);
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (call->state != CALL_WAITING || call->car != index || !call->watcher) continue;
+
+        int eta = call_eta(car, &plan, call);
+        int moved = call->watch_car != index;
+        long countdown = call->reported_ms - ms_since(&call->reported_at);
+        if (!moved && (eta < 0 || (call->reported_ms >= 0 && labs(eta - countdown) < ETA_REPORT_MS))) continue;
+
+        char update[64];
+        if (moved && eta < 0) {
+            snprintf(update, sizeof(update), "CAR %s", car->name);
+        } else if (moved) {
+            snprintf(update, sizeof(update), "CAR %s ETA %d", car->name, eta);
+        } else {
+            snprintf(update, sizeof(update), "ETA %d", eta);
+        }
+        conn_send(call->watcher, update, 0);
+        call->watch_car = (int8_t)index;
+        call->reported_ms = eta;
+        clock_gettime(CLOCK_MONOTONIC, &call->reported_at);
+    }
+}
+
+// Headway: each car is placed on the round trip up the building and back
+// down, a loop twice the height of the floors served, by its floor and which
+// way it is going. Evenly spaced cars are loop / cars apart. A car close behind another reaches each floor just after
+// it and finds nobody left to collect.
+#define HEADWAY_BUNCHED_DIV 4        // Within a quarter of the even spacing is bunched
+
+typedef struct {
+    int lo, hi;                      // Floor slots served by any dispatchable car
+    int loop;                        // Loop length in floors, 0 with fewer than two cars
+    int cars;                        // Dispatchable cars
+    int phase[MAX_CARS];             // Position around the loop, -1 if not dispatchable
+    int ahead[MAX_CARS];             // Loop distance to the nearest car ahead
+    int behind[MAX_CARS];            // Loop distance to the nearest car behind
+} headway_map;
+
+// Which way a car is going: the run it's on, else its next stop, else 0
+static int car_heading(car_info *car) {
+    if (is_car_moving(car)) return sign(compare_floors(car->destination_floor, car->current_floor));
+    if (car->queue_head) return sign(compare_floors(car->queue_head->floor, car->current_floor));
+    return 0;
+}
+
+// Distance from a to b going forward round a loop
+static int loop_forward(int a, int b, int loop) {
+    return ((b - a) % loop + loop) % loop;
+}
+
+void measure_headway(headway_map *h) {
+    h->lo = INT_MAX;
+    h->hi = INT_MIN;
+    h->cars = 0;
+    for (int i = 0; i < ctrl.car_count; i++) {
+        car_info *car = &ctrl.cars[i];
+        h->phase[i] = -1;
+        if (!is_car_alive(car) || car->reserved) continue;
+        int low = floor_slot(parse_floor(car->lowest).numeric);
+        int high = floor_slot(parse_floor(car->highest).numeric);
+        if (low < h->lo) h->lo = low;
+        if (high > h->hi) h->hi = high;
+        h->cars++;
+    }
+    h->loop = h->cars >= 2 && h->hi > h->lo ? 2 * (h->hi - h->lo) : 0;
+    if (h->loop == 0) return;
+
+    // Idle cars count as on their way up
+    for (int i = 0; i < ctrl.car_count; i++) {
+        car_info *car = &ctrl.cars[i];
+        if (!is_car_alive(car) || car->reserved) continue;
+        int p = floor_slot(get_car_position_numeric(car)) - h->lo;
+        h->phase[i] = car_heading(car) < 0 ? (h->loop - p) % h->loop : p;
+    }
+    for (int i = 0; i < ctrl.car_count; i++) {
+        if (h->phase[i] < 0) continue;
+        h->ahead[i] = h->behind[i] = h->loop;
+        for (int j = 0; j < ctrl.car_count; j++) {
+            if (j == i || h->phase[j] < 0) continue;
+            int forward = loop_forward(h->phase[i], h->phase[j], h->loop);
+            int back = loop_forward(h->phase[j], h->phase[i], h->loop);
+            if (forward < h->ahead[i]) h->ahead[i] = forward;
+            if (back < h->behind[i]) h->behind[i] = back;
+        }
+    }
+}
+
+// Plan steps to add to a car's pickup time to pull bunched cars apart. A
+// stop slows a car down, so the car close behind another should take the
+// work and the one being followed should leave it.
+static int headway_bias(const headway_map *h, int index) {
+    if (h->loop == 0 || h->phase[index] < 0 || ctrl.headway_bias == 0) return 0;
+    int close = h->loop / (h->cars * HEADWAY_BUNCHED_DIV);
+    return (h->behind[index] <= close ? ctrl.headway_bias : 0) - (h->ahead[index] <= close ? ctrl.headway_bias : 0);
+}
+
+// Count a tick with two busy cars travelling bunched together. Ticks with
+// fewer than two cars busy aren't counted.
+void sample_headway(const headway_map *h) {
+    if (h->loop == 0) return;
+    int close = h->loop / (h->cars * HEADWAY_BUNCHED_DIV);
+    int busy = 0, bunched = 0;
+    for (int i = 0; i < ctrl.car_count; i++) {
+        if (h->phase[i] < 0 || !ctrl.cars[i].queue_head) continue;
+        busy++;
+        for (int j = 0; j < ctrl.car_count; j++) {
+            if (j == i || h->phase[j] < 0 || !ctrl.cars[j].queue_head) continue;
+            if (loop_forward(h->phase[i], h->phase[j], h->loop) <= close) bunched = 1;
+        }
+    }
+    if (busy < 2) return;
+    ctrl.headway.samples++;
+    ctrl.headway.bunched += (uint32_t)bunched;
+}
+
+// The car that would collect a call soonest. An ordinary call is timed where
+// it costs the car's riders least, with any headway bias; an urgent one is
+// timed where it is collected first.
+car_info *find_soonest_car(const char *source, const char *destination, int urgent) {
+    int s = floor_slot(parse_floor(source).numeric);
+    int e = floor_slot(parse_floor(destination).numeric);
+    headway_map headway;
+    if (!urgent) measure_headway(&headway);
+
+    car_info *best_car = NULL;
+    int best_time = INT_MAX;
+    for (int i = 0; i < ctrl.car_count; i++) {
+        car_info *car = &ctrl.cars[i];
+        if (!is_car_alive(car) || car->reserved ||
+            !car_serves(car, source) || !car_serves(car, destination)) {
+            continue;
+        }
+        int time = pickup_time(car, s, e, urgent);
+        if (!urgent) time += headway_bias(&headway, i);
+        if (time < best_time) {
+            best_time = time;
+            best_car = car;
+        }
+    }
+    return best_car;
+}
+
+// Take back a car sent to wait somewhere, before it is given work
+int unpark_car(car_info *car) {
+    if (!car->parking) return 0;
+    car->parking = 0;
+    if (car->queue_head) remove_from_queue(car, car->queue_head->floor);
+    return 1;
+}
+
+void handle_call_request(connection *conn, const char *source, const char *destination, int priority,
+                         int reply) {
+    floor_info source_info = parse_floor(source);
+    floor_info dest_info = parse_floor(destination);
+
+    // State is frozen while a new controller takes over
+    int frozen = atomic_load(&ctrl.handing_off) || atomic_load(&ctrl.handed_off);
+    car_info *car = NULL;
+    if (!frozen && source_info.ok && dest_info.ok) {
+        record_traffic(source_info.numeric, dest_info.numeric);
+
+        // A reservation that can't be granted is served as a priority call
+        if (priority == CALL_RESERVE) {
+            car = reserve_car(source, destination);
+            if (!car) priority = CALL_PRIORITY;
+        }
+
+        // Join a pickup that's already on its way before searching
+        if (!car) car = find_hall_call_car(source_info.numeric, dest_info.numeric, destination);
+        if (!car && priority == CALL_PRIORITY) car = find_soonest_car(source, destination, 1);
+
+        // Light traffic keeps the simple nearest-car rule. Once cars are busy,
+        // time each one's route instead.
+        if (!car && ctrl.traffic.mode != TRAFFIC_LIGHT) car = find_soonest_car(source, destination, 0);
+        if (!car) car = find_best_car(source, destination);
+    }
+    if (car) {
+        record_hall_call(source_info.numeric, dest_info.numeric, car);
+        call_record *call = record_call(car, source_info.numeric, dest_info.numeric, priority);
+        int unparked = unpark_car(car);
+
+        // Save current front before adding
+        char old_front_str[MAX_FLOOR_LEN] = "";
+        char *old_front = get_queue_front(car);
+        if (old_front) {
+            strncpy(old_front_str, old_front, sizeof(old_front_str) - 1);
+            old_front_str[sizeof(old_front_str) - 1] = '\0';
+        }
+
+        // Add source and destination to car's queue
+        int route = (car->features & CAR_FEATURE_ROUTE) != 0;
+        int source_known = queue_contains(car, source);
+        int destination_known = queue_contains(car, destination);
+        int moved;
+        if (priority == CALL_RESERVE && car->queue_head) {
+            // The reserved car takes its call once its riders are off
+            if (strncmp(car->queue_tail->floor, source, MAX_FLOOR_LEN) != 0) append_to_queue(car, source);
+            append_to_queue(car, destination);
+            moved = 1;
+        } else {
+            moved = insert_call(car, source, destination, priority != CALL_NORMAL);
+        }
+        if (route && (moved || unparked)) {
+            send_route(car);
+        } else if (route) {
+            // Drop-off first: the pickup's position counts the stops after it
+            if (!destination_known) send_route_stop(car, destination);
+            if (!source_known) send_route_stop(car, source);
+        }
+        checkpoint_save(car);
+
+        // Only tell car to move if the queue changed
+        char *new_front = get_queue_front(car);
+        if (!route && new_front &&
+            (old_front_str[0] == '\0' || strncmp(old_front_str, new_front, MAX_FLOOR_LEN) != 0)) {
+            send_floor(car, new_front);
+        }
+
+        // Every call gets an estimate, so predictions can be scored at pickup
+        if (call && call->state == CALL_WAITING) {
+            route_plan plan;
+            plan_build(car, &plan);
+            call->eta_ms = call_eta(car, &plan, call);
+        }
+
+        char response[64];
+        int len = snprintf(response, sizeof(response), "CAR %s", car->name);
+        if (reply & REPLY_ID) {
+            len += snprintf(response + len, sizeof(response) - (size_t)len, " %u", call ? call->id : 0U);
+        }
+        if ((reply & REPLY_ETA) && call && call->eta_ms >= 0) {
+            snprintf(response + len, sizeof(response) - (size_t)len, " ETA %d", call->eta_ms);
+        }
+        int watching = (reply & REPLY_WATCH) && call && call->state == CALL_WAITING;
+        if (watching) {
+            call->watcher = conn;
+            call->watch_car = call->car;
+            call->reported_ms = call->eta_ms;
+            clock_gettime(CLOCK_MONOTONIC, &call->reported_at);
+        }
+        conn_send(conn, response, !watching);
+
+        // Everyone else waiting on the car may now be later
+        update_watchers(car);
+    } else {
+        conn_send(conn, "UNAVAILABLE", 1);
+    }
+}
+
+// Reallocation moves a waiting pickup only when another car would get there
+// a clear margin sooner (any margin for an urgent call), and not within the
+// hold time of the call being placed or last moved, so calls don't bounce
+// between cars
+#define REALLOCATE_HOLD_MS 2000
+#define REALLOCATE_MARGIN (2 * STOP_COST)
+
+static int call_direction(const call_record *call) {
+    return call->destination > call->source ? HALL_UP : HALL_DOWN;
+}
+
+// 1 if a call is waiting on a car at a floor slot to go one direction
+static int call_waiting_for(const call_record *call, car_info *car, int direction, int slot) {
+    return call->state == CALL_WAITING && call->car == car - ctrl.cars && call->source == slot &&
+           call_direction(call) == direction;
+}
+
+// The car that would collect everyone waiting on another at a floor for one
+// direction soonest, if before best_time, or NULL
+static car_info *sooner_car(car_info *from, int direction, int slot, int best_time) {
+    char source[MAX_FLOOR_LEN], destination[MAX_FLOOR_LEN];
+    slot_floor(slot, source);
+
+    int e = -1, urgent = 0;
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (!call_waiting_for(call, from, direction, slot)) continue;
+        if (e < 0) e = call->destination;
+        urgent |= call_is_urgent(call);
+    }
+    if (e < 0) return NULL;
+
+    car_info *best_car = NULL;
+    for (int c = 0; c < ctrl.car_count; c++) {
+        car_info *car = &ctrl.cars[c];
+        if (car == from || !is_car_alive(car) || car->reserved ||
+            !car_serves(car, source)) {
+            continue;
+        }
+
+        // It has to be able to take every one of them where they're going
+        int fits = 1;
+        for (int i = 0; i < MAX_CALLS && fits; i++) {
+            call_record *call = &ctrl.calls[i];
+            if (!call_waiting_for(call, from, direction, slot)) continue;
+            slot_floor(call->destination, destination);
+            fits = car_serves(car, destination);
+        }
+        if (!fits) continue;
+
+        int time = pickup_time(car, slot, e, urgent);
+        if (time < best_time) {
+            best_time = time;
+            best_car = car;
+        }
+    }
+    return best_car;
+}
+
+// A car that would collect everyone waiting at a floor for one direction
+// sooner than the car they have, or NULL
+car_info *find_faster_car(car_info *from, int direction, int slot) {
+    char source[MAX_FLOOR_LEN];
+    slot_floor(slot, source);
+
+    // Already pulling in for them, or carrying stops nobody can account for
+    if (from->untracked) return NULL;
+    if (is_car_moving(from) && strncmp(from->destination_floor, source, MAX_FLOOR_LEN) == 0) return NULL;
+
+    // An urgent call goes to any car that is sooner at all. A reservation
+    // stays with its car.
+    int e = -1, urgent = 0;
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (!call_waiting_for(call, from, direction, slot)) continue;
+        if (call->priority == CALL_RESERVE || ms_since(&call->since) < REALLOCATE_HOLD_MS) return NULL;
+        if (e < 0) e = call->destination;
+        urgent |= call_is_urgent(call);
+    }
+    if (e < 0) return NULL;
+
+    int margin = urgent ? 0 : REALLOCATE_MARGIN;
+    return sooner_car(from, direction, slot, pickup_time(from, slot, e, urgent) - margin);
+}
+
+// Bring a car up to date after its queue changed other than at the back
+void resend_queue(car_info *car, const char *old_front) {
+    if (car->features & CAR_FEATURE_ROUTE) {
+        send_route(car);
+        return;
+    }
+    char *front = get_queue_front(car);
+    if (front && strncmp(front, old_front, MAX_FLOOR_LEN) != 0) {
+        send_floor(car, front);
+    }
+}
+
+// Hand everyone waiting at a floor for one direction to another car, then
+// drop the stops the old car no longer needs
+void move_pickup(car_info *from, car_info *to, int direction, int slot) {
+    char from_front[MAX_FLOOR_LEN] = "", to_front[MAX_FLOOR_LEN] = "";
+    if (from->queue_head) memcpy(from_front, from->queue_head->floor, MAX_FLOOR_LEN);
+    if (to->queue_head) memcpy(to_front, to->queue_head->floor, MAX_FLOOR_LEN);
+    unpark_car(to);
+
+    char source[MAX_FLOOR_LEN], destination[MAX_FLOOR_LEN];
+    slot_floor(slot, source);
+    hall_call_drop(from, direction, slot);
+    hall_call_add(to, direction, slot);
+
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (!call_waiting_for(call, from, direction, slot)) continue;
+        call->car = (int8_t)(to - ctrl.cars);
+        clock_gettime(CLOCK_MONOTONIC, &call->since);
+
+        slot_floor(call->destination, destination);
+        insert_call(to, source, destination, call_is_urgent(call));
+        if (!stop_needed(from, call->destination)) {
+            while (remove_from_queue(from, destination)) {
+            }
+        }
+    }
+    if (!stop_needed(from, slot)) {
+        while (remove_from_queue(from, source)) {
+        }
+    }
+
+    resend_queue(from, from_front);
+    resend_queue(to, to_front);
+    update_watchers(from);
+    update_watchers(to);
+    from->checkpoint_stale = CHECKPOINT_STALE;
+    checkpoint_save(to);
+}
+
+// Send an idle car to wait at a floor, or the nearest one it stops at
+void park_car(car_info *car, int slot) {
+    char floor[MAX_FLOOR_LEN];
+    slot_floor(slot, floor);
+    if (!is_valid_floor_range(floor, car->lowest, car->highest)) return;
+    for (int d = 1; !car_serves(car, floor) && d < (int)MAX_FLOOR_COUNT; d++) {
+        int near = slot + (d % 2 ? -(d + 1) / 2 : d / 2);
+        if (near >= 0 && near < (int)MAX_FLOOR_COUNT) slot_floor(near, floor);
+    }
+    if (strncmp(car->current_floor, floor, MAX_FLOOR_LEN) == 0 || !car_serves(car, floor)) return;
+    append_to_queue(car, floor);
+    car->parking = 1;
+    resend_queue(car, "");
+    checkpoint_save(car);
+}
+
+// How far a car waiting at a floor slot would be from the nearest of the
+// given loop positions, taking whichever way it sets off
+static int headway_gap(const headway_map *h, int slot, const int *phases, int count) {
+    if (h->loop == 0) return 0;
+    int up = slot - h->lo;
+    int down = (h->loop - up) % h->loop;
+    int gap = INT_MAX;
+    for (int i = 0; i < count; i++) {
+        int a = loop_forward(up, phases[i], h->loop), b = loop_forward(phases[i], up, h->loop);
+        int c = loop_forward(down, phases[i], h->loop), d = loop_forward(phases[i], down, h->loop);
+        int nearest = a < b ? a : b;
+        if (c < nearest) nearest = c;
+        if (d < nearest) nearest = d;
+        if (nearest < gap) gap = nearest;
+    }
+    return gap;
+}
+
+// Where idle cars wait for the next call. In up-peak they all go back to the
+// lobby. Otherwise the floors (only those above the lobby in down-peak) are
+// split into one zone per car, and idle cars spread into the zones no car
+// is in yet, taking the one furthest round the loop from the other cars so
+// they set off evenly spaced. Light traffic leaves cars where they stopped.
+void park_idle_cars(void) {
+    int mode = ctrl.traffic.mode;
+    if (mode == TRAFFIC_LIGHT) return;
+
+    headway_map headway;
+    measure_headway(&headway);
+    if (headway.cars == 0) return;
+
+    int lo = headway.lo, hi = headway.hi, zones = headway.cars;
+    int lobby = floor_slot(ctrl.lobby);
+    if (mode == TRAFFIC_DOWN_PEAK && lobby >= lo && lobby < hi) lo = lobby + 1;
+    int span = hi - lo + 1;
+    if (zones > span) zones = span;
+
+    // Cars with work, cars already on their way to park, and cars that only
+    // just stopped keep the zone they're in (or heading for)
+    int covered[MAX_CARS] = {0};
+    int phases[MAX_CARS], phase_count = 0;
+    car_info *idle[MAX_CARS];
+    int idle_count = 0;
+    for (int i = 0; i < ctrl.car_count; i++) {
+        car_info *car = &ctrl.cars[i];
+        if (!is_car_alive(car) || car->reserved) continue;
+
+        int at = floor_slot(get_car_position_numeric(car));
+        if (car->parking && car->queue_head) {
+            at = floor_slot(parse_floor(car->queue_head->floor).numeric);
+        } else if (!car->queue_head && is_car_parked(car) &&
+                   (mode == TRAFFIC_UP_PEAK || ms_since(&car->progressed) >= PARK_IDLE_MS)) {
+            idle[idle_count++] = car;
+            continue;
+        }
+        if (at >= lo && at <= hi) covered[(at - lo) * zones / span] = 1;
+        if (headway.phase[i] >= 0) phases[phase_count++] = headway.phase[i];
+    }
+
+    if (mode == TRAFFIC_UP_PEAK) {
+        for (int i = 0; i < idle_count; i++) park_car(idle[i], lobby);
+        return;
+    }
+
+    // Idle cars already in a free zone stay there
+    int placed[MAX_CARS] = {0};
+    for (int i = 0; i < idle_count; i++) {
+        int at = floor_slot(get_car_position_numeric(idle[i]));
+        if (at < lo || at > hi) continue;
+        int zone = (at - lo) * zones / span;
+        if (!covered[zone]) {
+            covered[zone] = 1;
+            placed[i] = 1;
+            phases[phase_count++] = at - headway.lo;
+        }
+    }
+
+    // The rest go to the middle of the free zone with most room round the
+    // loop, the nearest of those if several tie
+    for (int i = 0; i < idle_count; i++) {
+        if (placed[i]) continue;
+        int at = floor_slot(get_car_position_numeric(idle[i]));
+        int best = -1, best_gap = -1, best_distance = INT_MAX;
+        for (int zone = 0; zone < zones; zone++) {
+            if (covered[zone]) continue;
+            int middle = lo + (2 * zone + 1) * span / (2 * zones);
+            int gap = headway_gap(&headway, middle, phases, phase_count);
+            if (gap > best_gap || (gap == best_gap && abs(middle - at) < best_distance)) {
+                best = zone;
+                best_gap = gap;
+                best_distance = abs(middle - at);
+            }
+        }
+        if (best < 0) break;
+        int middle = lo + (2 * best + 1) * span / (2 * zones);
+        covered[best] = 1;
+        phases[phase_count++] = middle - headway.lo;
+        park_car(idle[i], middle);
+    }
+}
+
+// Look over every pickup nobody has collected yet
+void handle_reallocate(void) {
+    if (atomic_load(&ctrl.handing_off) || atomic_load(&ctrl.handed_off)) return;
+
+    for (int direction = HALL_UP; direction <= HALL_DOWN; direction++) {
+        for (unsigned word = 0; word < HALL_CALL_WORDS; word++) {
+            uint64_t bits = ctrl.hall_calls.pending[direction][word];
+            while (bits) {
+                int bit = __builtin_ctzll(bits);
+                bits &= bits - 1;
+                int slot = (int)word * 64 + bit;
+
+                // Each car holding the pickup has its own passengers waiting
+                uint32_t cars = ctrl.hall_calls.cars[direction][slot];
+                while (cars) {
+                    car_info *from = &ctrl.cars[__builtin_ctz(cars)];
+                    cars &= cars - 1;
+                    car_info *to = find_faster_car(from, direction, slot);
+                    if (to) move_pickup(from, to, direction, slot);
+                }
+            }
+        }
+    }
+
+    // The traffic mode decays as calls age out of the window
+    classify_traffic();
+    park_idle_cars();
+
+    headway_map headway;
+    measure_headway(&headway);
+    sample_headway(&headway);
+
+    // Estimates drift as cars run early or late
+    for (int i = 0; i < ctrl.car_count; i++) {
+        if (ctrl.cars[i].connected) update_watchers(&ctrl.cars[i]);
+    }
+}
+
+// Take a car out of dispatch for a RESERVE call: the one that would reach
+// the pickup soonest after its current queue, as long as at least half the
+// live cars stay in service. Pickups waiting on it go to other cars; riders
+// are still taken where they're going first.
+car_info *reserve_car(const char *source, const char *destination) {
+    int s = floor_slot(parse_floor(source).numeric);
+    int e = floor_slot(parse_floor(destination).numeric);
+    if (s == e) return NULL;
+
+    int alive = 0, reserved = 0;
+    for (int i = 0; i < ctrl.car_count; i++) {
+        if (!is_car_alive(&ctrl.cars[i])) continue;
+        alive++;
+        reserved += ctrl.cars[i].reserved;
+    }
+    if (2 * (reserved + 1) > alive) return NULL;
+
+    car_info *best_car = NULL;
+    int best_time = INT_MAX;
+    for (int i = 0; i < ctrl.car_count; i++) {
+        car_info *car = &ctrl.cars[i];
+        if (!is_car_alive(car) || car->reserved || car->untracked ||
+            !car_serves(car, source) || !car_serves(car, destination)) {
+            continue;
+        }
+        route_plan plan;
+        plan_build(car, &plan);
+        int time = plan_depart(&plan, plan.n) + plan_travel(&plan, plan_prev(&plan, plan.n), s);
+        if (time < best_time) {
+            best_time = time;
+            best_car = car;
+        }
+    }
+    if (!best_car) return NULL;
+    best_car->reserved = 1;
+
+    // Anyone it can't hand over is still collected on the way
+    for (int direction = HALL_UP; direction <= HALL_DOWN; direction++) {
+        for (unsigned word = 0; word < HALL_CALL_WORDS; word++) {
+            uint64_t bits = ctrl.hall_calls.pending[direction][word];
+            while (bits) {
+                int bit = __builtin_ctzll(bits);
+                bits &= bits - 1;
+                int slot = (int)word * 64 + bit;
+                if (!hall_call_held(best_car, direction, slot)) continue;
+
+                car_info *to = sooner_car(best_car, direction, slot, INT_MAX);
+                if (to) move_pickup(best_car, to, direction, slot);
+            }
+        }
+    }
+    return best_car;
+}
+
+// STATS <calls> <p50> <p99> <p999> <max> <overdue> <estimated> <eta_err>
+// <eta_bias> <traffic> <bunched>: pickup waits in ms, then how far the pickup
+// estimates were off on average, absolute and signed (positive means late),
+// the traffic mode, and the % of busy time cars spent bunched together
+void handle_stats(connection *conn) {
+    const wait_histogram *w = &ctrl.waits;
+    long eta_err = w->eta_count ? w->eta_abs_ms / (long)w->eta_count : 0;
+    long eta_bias = w->eta_count ? w->eta_bias_ms / (long)w->eta_count : 0;
+
+    const headway_stats *h = &ctrl.headway;
+    unsigned bunched = h->samples ? (unsigned)(100ULL * h->bunched / h->samples) : 0U;
+
+    char response[128];
+    snprintf(response, sizeof(response), "STATS %u %ld %ld %ld %ld %u %u %ld %ld %s %u",
+             w->total, wait_percentile(0.50), wait_percentile(0.99), wait_percentile(0.999),
+             w->max_ms, w->overdue, w->eta_count, eta_err, eta_bias, traffic_names[ctrl.traffic.mode], bunched);
+    conn_send(conn, response, 1);
+}
+
+// Take a call off its car, then drop whichever of its stops nobody else
+// needs. A car with stops the ledger doesn't know about keeps them all.
+void drop_call(call_record *call) {
+    car_info *car = &ctrl.cars[call->car];
+    char old_front[MAX_FLOOR_LEN] = "";
+    if (car->queue_head) memcpy(old_front, car->queue_head->floor, MAX_FLOOR_LEN);
+
+    int waiting = call->state == CALL_WAITING;
+    int direction = call_direction(call);
+    call->state = CALL_FREE;
+    if (call->watcher) {
+        char ended[32];
+        snprintf(ended, sizeof(ended), "CANCELLED %u", call->id);
+        conn_send(call->watcher, ended, 1);
+        call->watcher = NULL;
+    }
+
+    // The hall call goes too if it was the last one waiting on it
+    int others = 0;
+    for (int i = 0; i < MAX_CALLS && waiting; i++) {
+        others |= call_waiting_for(&ctrl.calls[i], car, direction, call->source);
+    }
+    if (waiting && !others) hall_call_drop(car, direction, call->source);
+
+    char floor[MAX_FLOOR_LEN];
+    if (!car->untracked && waiting && !stop_needed(car, call->source)) {
+        slot_floor(call->source, floor);
+        while (remove_from_queue(car, floor)) {
+        }
+    }
+    if (!car->untracked && !stop_needed(car, call->destination)) {
+        slot_floor(call->destination, floor);
+        while (remove_from_queue(car, floor)) {
+        }
+    }
+    if (!car->queue_head) {
+        car->untracked = 0;
+        car->reserved = 0;
+        car->parking = 0;
+    }
+
+    // Nobody needs the floor it has set off for, so stop at the next one
+    // rather than finish the trip
+    char next[MAX_FLOOR_LEN];
+    if (strncmp(car->current_floor, car->destination_floor, MAX_FLOOR_LEN) != 0 &&
+        !queue_contains(car, car->destination_floor) &&
+        next_floor_towards(car->current_floor, car->destination_floor, car->lowest, car->highest,
+                           &ctrl.topology, next, sizeof(next)) == 0 &&
+        strncmp(next, car->destination_floor, MAX_FLOOR_LEN) != 0) {
+        send_floor(car, next);
+    }
+    resend_queue(car, old_front);
+    update_watchers(car);
+    checkpoint_save(car);
+}
+
+// CANCEL id: CANCELLED id, or UNAVAILABLE if the call is unknown or done
+void handle_cancel(connection *conn, uint32_t id) {
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (call->state == CALL_FREE || call->id != id) continue;
+
+        drop_call(call);
+        char response[32];
+        snprintf(response, sizeof(response), "CANCELLED %u", id);
+        conn_send(conn, response, 1);
+        return;
+    }
+    conn_send(conn, "UNAVAILABLE", 1);
+}
+
+// Nobody came through the doors at the car's last stop, so whoever it picked
+// up there didn't show
+void handle_car_vacant(car_info *car, const char *floor) {
+    floor_info info = parse_floor(floor);
+    if (!info.ok) return;
+
+    int slot = floor_slot(info.numeric);
+    for (int i = 0; i < MAX_CALLS; i++) {
+        call_record *call = &ctrl.calls[i];
+        if (call->state == CALL_RIDING && call->car == car - ctrl.cars && call->source == slot &&
+            call->boarded == car->openings) {
+            drop_call(call);
+        }
+    }
+}
+
+void handle_car_register(connection *conn, const char *name, const char *lowest,
+                         const char *highest, unsigned int features) {
+    // Find existing car or create new
+    car_info *car = NULL;
+    int resume = 0;
+    for (int i = 0; i < ctrl.car_count; i++) {
+        if (strncmp(ctrl.cars[i].name, name, MAX_CAR_NAME_LEN) == 0) {
+            car = &ctrl.cars[i];
+            int same_range = strncmp(car->lowest, lowest, MAX_FLOOR_LEN) == 0 &&
+                             strncmp(car->highest, highest, MAX_FLOOR_LEN) == 0;
+            if (car->restored || same_range) {
+                // First registration since a warm restart, or the same car
+                // reconnecting - keep its stops and calls and resend them
+                resume = (car->queue_head != NULL);
+            } else {
+                // Serving a different range now, so the old stops may be out of reach
+                forget_hall_calls(car);
+                forget_calls(car);
+                free_queue(car->queue_head);
+                car->queue_head = car->queue_tail = NULL;
+            }
+            break;
+        }
+    }
+
+    if (!car && ctrl.car_count < 32) {
+        car = &ctrl.cars[ctrl.car_count++];
+    }
+
+    if (!car) {
+        conn_close(conn);
+        return;
+    }
+
+    strncpy(car->name, name, sizeof(car->name) - 1);
+    car->name[sizeof(car->name) - 1] = '\0';
+    strncpy(car->lowest, lowest, sizeof(car->lowest) - 1);
+    car->lowest[sizeof(car->lowest) - 1] = '\0';
+    strncpy(car->highest, highest, sizeof(car->highest) - 1);
+    car->highest[sizeof(car->highest) - 1] = '\0';
+    car->connected = 1;
+    car->conn = conn;
+    conn->car_index = (int)(car - ctrl.cars);
+    strncpy(car->current_floor, lowest, sizeof(car->current_floor) - 1);
+    car->current_floor[sizeof(car->current_floor) - 1] = '\0';
+    strncpy(car->destination_floor, lowest, sizeof(car->destination_floor) - 1);
+    car->destination_floor[sizeof(car->destination_floor) - 1] = '\0';
+    strncpy(car->status, "Closed", sizeof(car->status) - 1);
+    car->status[sizeof(car->status) - 1] = '\0';
+    car->restored = 0;
+    car->features = features;
+    car->unresponsive = 0;
+    car->step_ms = car->floor_ms = car->approach_ms = car->door_ms = car->depart_ms = 0;
+    car->leaving = 0;
+    car->report_floors = 1;
+    memset(&car->motion, 0, sizeof(car->motion));
+    car->topology_car = topology_car_index(&ctrl.topology, car->name);
+    clock_gettime(CLOCK_MONOTONIC, &car->last_seen);
+    car->stepped = car->progressed = car->last_seen;
+    if (!resume) {
+        car->queue_head = car->queue_tail = NULL;
+    }
+    checkpoint_save(car);
+
+    // Pick up where the previous controller left off. A route car also has
+    // any stops left over from an earlier connection replaced.
+    char *front = get_queue_front(car);
+    if (car->features & CAR_FEATURE_ROUTE) {
+        send_route(car);
+    } else if (front) {
+        send_floor(car, front);
+    }
+}
+
+// 1 if a pickup for this car is queued ahead of the first stop at a floor.
+// That stop may be the drop-off for someone who hasn't boarded yet.
+int pickup_queued_before(car_info *car, const char *floor) {
+    for (floor_node *node = car->queue_head; node; node = node->next) {
+        if (strncmp(node->floor, floor, MAX_FLOOR_LEN) == 0) return 0;
+
+        int slot = floor_slot(parse_floor(node->floor).numeric);
+        for (int direction = HALL_UP; direction <= HALL_DOWN; direction++) {
+            if (hall_call_held(car, direction, slot)) return 1;
+        }
+    }
+    return 0;
+}
+
+// How long a car that has just opened at a floor slot should hold its doors,
+// from who the ledger says is getting on and off there, or NULL for the
+// usual dwell. A car with stops the ledger doesn't know about always gets
+// the usual dwell.
+static const char *dwell_hint(car_info *car, int slot) {
+    if (car->untracked) return NULL;
+
+    int index = (int)(car - ctrl.cars);
+    int boarding = hall_call_held(car, HALL_UP, slot) || hall_call_held(car, HALL_DOWN, slot);
+    int alighting = 0;
+    for (int i = 0; i < MAX_CALLS; i++) {
+        const call_record *call = &ctrl.calls[i];
+        if (call->car != index) continue;
+        boarding |= call->state == CALL_WAITING && call->source == slot;
+        alighting |= call->state == CALL_RIDING && call->destination == slot;
+    }
+
+    if (boarding) return boarding_dwell(slot);
+    return alighting ? "SHORT" : "NONE";
+}
+
+// Fold a measured time into a smoothed one. A long sample (doors held
+// open) only nudges the average up.
+static void smooth_time(int *average, long sample) {
+    if (*average > 0 && sample > 2L * *average) sample = 2L * *average;
+    *average = *average > 0 ? (int)((3L * *average + sample) / 4) : (int)sample;
+}
+
+void handle_car_status(car_info *car, const char *status, const char *current, const char *dest) {
+    int was_open = is_door_open(car) && strncmp(car->current_floor, current, MAX_FLOOR_LEN) == 0;
+
+    // Time the car's steps, leaving out idle spells with the doors shut. A
+    // car on an express run reports every few floors, so its time on the
+    // move is spread over the floors it covered.
+    int new_floor = strncmp(car->current_floor, current, MAX_FLOOR_LEN) != 0;
+    if (new_floor || strncmp(car->status, status, MAX_STATUS_LEN) != 0) {
+        int was_moving = strncmp(car->status, "Between", MAX_STATUS_LEN) == 0;
+        int floors = 1;
+        if (was_moving && new_floor) {
+            floors = topology_floors(&ctrl.topology, parse_floor(car->current_floor).numeric,
+                                     parse_floor(current).numeric);
+            if (floors < 1) floors = 1;
+            if (floors > car->report_floors) car->report_floors = floors;
+        }
+        if (strncmp(car->status, "Closed", MAX_STATUS_LEN) != 0) {
+            smooth_time(&car->step_ms, ms_since(&car->stepped) / floors);
+        }
+
+        // Steps on the move are timed by kind: passing a floor, pulling in
+        // to a stop, or pulling away from one. A one-floor hop is both of
+        // the last two and isn't counted. The floors passed along with
+        // either end of a run count at the usual rate.
+        int moving = strncmp(status, "Between", MAX_STATUS_LEN) == 0;
+        if (was_moving && new_floor) {
+            long step = ms_since(&car->stepped);
+            if (moving && !car->leaving) {
+                smooth_time(&car->floor_ms, step / floors);
+            } else if (floors == 1 || car->floor_ms > 0) {
+                step -= (long)(floors - 1) * car->floor_ms;
+                if (step > 0 && moving) {
+                    smooth_time(&car->depart_ms, step);
+                } else if (step > 0 && !car->leaving) {
+                    smooth_time(&car->approach_ms, step);
+                }
+            }
+        }
+        car->leaving = moving && strncmp(car->status, "Between", MAX_STATUS_LEN) != 0;
+        clock_gettime(CLOCK_MONOTONIC, &car->stepped);
+
+        // A stop runs from the doors starting to open until the car sets off
+        // or settles with them shut. Doors reopening don't restart it.
+        int was_stopped = is_door_open(car) || strncmp(car->status, "Closing", MAX_STATUS_LEN) == 0;
+        int stopped = strncmp(status, "Opening", MAX_STATUS_LEN) == 0 ||
+                      strncmp(status, "Open", MAX_STATUS_LEN) == 0 ||
+                      strncmp(status, "Closing", MAX_STATUS_LEN) == 0;
+        if (stopped && (!was_stopped || new_floor)) {
+            car->opened = car->stepped;
+        } else if (was_stopped && !stopped && !new_floor) {
+            smooth_time(&car->door_ms, ms_since(&car->opened));
+        }
+
+        // Doors cycling open and shut again don't get the car anywhere, but
+        // a parked car starts afresh with whatever it does next
+        if (new_floor || is_car_parked(car) || strncmp(status, "Between", MAX_STATUS_LEN) == 0) {
+            car->progressed = car->stepped;
+        }
+    }
+
+    // Update car status
+    strncpy(car->status, status, sizeof(car->status) - 1);
+    car->status[sizeof(car->status) - 1] = '\0';
+    strncpy(car->current_floor, current, sizeof(car->current_floor) - 1);
+    car->current_floor[sizeof(car->current_floor) - 1] = '\0';
+    strncpy(car->destination_floor, dest, sizeof(car->destination_floor) - 1);
+    car->destination_floor[sizeof(car->destination_floor) - 1] = '\0';
+    car->checkpoint_stale = CHECKPOINT_STALE;
+
+    // Car opened at a requested floor - remove it from queue. It is usually the
+    // front, but a car that was retargeted after it had passed the new floor
+    // stops at its old destination first. Open counts too, since a car with a
+    // short delay can go through Opening between two status reports.
+    char *front = get_queue_front(car);
+    if (front && is_door_open(car) && !was_open) {
+        int was_front = strncmp(car->current_floor, front, MAX_FLOOR_LEN) == 0;
+        if (!was_front && pickup_queued_before(car, car->current_floor)) {
+            // Keep the stop for whoever is still to be picked up. A route
+            // car has already crossed it off, so give it the list again.
+            if (car->features & CAR_FEATURE_ROUTE) send_route(car);
+            return;
+        }
+        if (!remove_from_queue(car, car->current_floor)) return;
+
+        // Back-to-back stops at this floor are all served by this opening
+        while (was_front && (front = get_queue_front(car)) != NULL &&
+               strncmp(front, car->current_floor, MAX_FLOOR_LEN) == 0) {
+            remove_from_queue(car, car->current_floor);
+        }
+        car->openings++;
+        const char *hint = dwell_hint(car, floor_slot(parse_floor(car->current_floor).numeric));
+        if (hint && strcmp(hint, "NORMAL") != 0) send_dwell(car, hint);
+        clear_hall_calls_at(car, parse_floor(car->current_floor).numeric);
+        finish_calls_at(car, parse_floor(car->current_floor).numeric);
+        if (!car->queue_head) {
+            // Nothing left on it, so any reservation is done too
+            car->untracked = 0;
+            car->reserved = 0;
+            car->parking = 0;
+        }
+        checkpoint_save(car);
+
+        // Tell car to go to the next requested floor - a route car is
+        // already on its way there, and one that stopped short still has
+        // the front to go to
+        front = get_queue_front(car);
+        if (was_front && front && !(car->features & CAR_FEATURE_ROUTE)) {
+            send_floor(car, front);
+        }
+    }
+}
+
+// EMERGENCY or INDIVIDUAL SERVICE: the car leaves the pool until it registers again
+void handle_car_offline(car_info *car) {
+    car->connected = 0;
+    forget_hall_calls(car);
+    forget_calls(car);
+    free_queue(car->queue_head);
+    car->queue_head = car->queue_tail = NULL;
+    checkpoint_save(car);
+    conn_close(car->conn);
+    car->conn = NULL;
+}
+
+// Ping heartbeat-capable cars so a hung car shows up as silence
+void handle_heartbeat(void) {
+    if (atomic_load(&ctrl.handing_off) || atomic_load(&ctrl.handed_off)) return;
+
+    for (int i = 0; i < ctrl.car_count; i++) {
+        car_info *car = &ctrl.cars[i];
+        if (!car->connected || !car->conn || !(car->features & CAR_FEATURE_HEARTBEAT)) continue;
+
+        int alive = is_car_alive(car);
+        if (!alive && !car->unresponsive) {
+            printf("Car %s missed its heartbeat deadline\n", car->name);
+            fflush(stdout);
+        }
+        car->unresponsive = !alive;
+        conn_send(car->conn, "PING", 0);
+    }
+}
+
+// Capture the car table and connections for a handoff. Every car I/O
+// thread is parked by now, so anything still queued for a car is written
+// here rather than lost.
+void handle_snapshot(handoff_request *req) {
+    snapshot_cars(req->slot);
+
+    req->header.magic = HANDOFF_MAGIC;
+    req->fds[0] = ctrl.server_fd;
+    req->header.fd_count = 1;
+    for (int i = 0; i < ctrl.car_count; i++) {
+        car_info *car = &ctrl.cars[i];
+        if (car->connected && car->conn) {
+            flush_outbound(car->conn);
+            req->header.car_index[req->header.fd_count - 1] = i;
+            req->fds[req->header.fd_count++] = car->conn->fd;
+        }
+    }
+    sem_post(&req->done);
+}
+
+void dispatch_event(controller_event *event) {
+    car_info *car = conn_car(event->conn);
+
+    // Any traffic proves the car is alive
+    if (car) {
+        clock_gettime(CLOCK_MONOTONIC, &car->last_seen);
+    }
+
+    switch (event->type) {
+    case EVENT_CAR_REGISTER:
+        handle_car_register(event->conn, event->reg.name, event->reg.lowest,
+                            event->reg.highest, event->reg.features);
+        break;
+    case EVENT_CAR_STATUS:
+        if (car) {
+            handle_car_status(car, event->status.status, event->status.current,
+                              event->status.destination);
+            update_watchers(car);
+        }
+        break;
+    case EVENT_CAR_OFFLINE:
+        if (car) handle_car_offline(car);
+        break;
+    case EVENT_CAR_SEEN:
+        break;
+    case EVENT_CAR_VACANT:
+        if (car) handle_car_vacant(car, event->vacant);
+        break;
+    case EVENT_CAR_MOTION:
+        if (car) {
+            car->motion = event->motion;
+            car->checkpoint_stale = CHECKPOINT_STALE;
+        }
+        break;
+    case EVENT_CALL:
+        handle_call_request(event->conn, event->call.source, event->call.destination, event->call.priority,
+                            event->call.reply);
+        break;
+    case EVENT_CLOSED:
+        if (car) {
+            car->connected = 0;
+            car->conn = NULL;
+        }
+        for (int i = 0; i < MAX_CALLS; i++) {
+            if (ctrl.calls[i].watcher == event->conn) ctrl.calls[i].watcher = NULL;
+        }
+        if (ctrl.io_backend == IO_THREADS) {
+            conn_free(event->conn);
+        } else {
+            // The loop frees it once everything queued before this is delivered
+            outbound_message *msg = calloc(1, sizeof(outbound_message) + 1);
+            if (msg) {
+                msg->conn = event->conn;
+                msg->release = 1;
+                post_outbox(msg);
+            }
+        }
+        break;
+    case EVENT_HEARTBEAT:
+        handle_heartbeat();
+        break;
+    case EVENT_REALLOCATE:
+        handle_reallocate();
+        break;
+    case EVENT_STATS:
+        handle_stats(event->conn);
+        break;
+    case EVENT_CANCEL:
+        handle_cancel(event->conn, event->call_id);
+        break;
+    case EVENT_SNAPSHOT:
+        handle_snapshot(event->handoff);
+        break;
+    }
+}
+
+// Owns the car table, queues and assignments; nothing else touches them
+// once this is running, so none of it needs a lock
+void *dispatcher_thread(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        if (sem_wait(&ctrl.events_ready) != 0) continue;
+
+        // The semaphore says an event is there; a NULL pop just means its
+        // producer hasn't finished linking it in
+        mpsc_node *node;
+        while ((node = mpsc_pop(&ctrl.events)) == NULL) {
+            sched_yield();
+        }
+
+        controller_event *event = (controller_event *)node;
+        dispatch_event(event);
+        free(event);
+    }
+
+    return NULL;
+}
+
+// Called by I/O threads that saw the wake pipe. Returns 1 if the process has
+// been handed off and the thread should stop touching its socket.
+int park_for_handoff(int counted) {
+    pthread_mutex_lock(&ctrl.io_mutex);
+    if (counted) {
+        ctrl.car_threads--;
+        pthread_cond_broadcast(&ctrl.handoff_cond);
+    }
+    while (atomic_load(&ctrl.handing_off)) {
+        pthread_cond_wait(&ctrl.handoff_cond, &ctrl.io_mutex);
+    }
+    int done = atomic_load(&ctrl.handed_off);
+    if (counted && !done) {
+        ctrl.car_threads++;
+    }
+    pthread_mutex_unlock(&ctrl.io_mutex);
+    return done;
+}
+
+// "CAR name lowest highest [features]" as an event, or NULL if malformed
+controller_event *parse_registration(const message_tokens *tokens) {
+    if (tokens->field_count < 3) return NULL;
+    controller_event *event = new_event(EVENT_CAR_REGISTER, NULL);
+    if (!event) return NULL;
+
+    if (slice_copy(tokens->fields[0], event->reg.name, sizeof(event->reg.name)) != 0 ||
+        slice_copy(tokens->fields[1], event->reg.lowest, sizeof(event->reg.lowest)) != 0 ||
+        slice_copy(tokens->fields[2], event->reg.highest, sizeof(event->reg.highest)) != 0) {
+        free(event);
+        return NULL;
+    }
+
+    // Feature tokens run to the end of the frame
+    if (tokens->field_count > 3) {
+        event->reg.features = parse_car_features(tokens->fields[3].ptr);
+    }
+    return event;
+}
+
+// "CALL source destination [PRIORITY|RESERVE] [ID] [ETA] [WATCH]" as an event, or NULL if
+// malformed. The flags after the floors may come in any order.
+controller_event *parse_call(const message_tokens *tokens) {
+    if (tokens->field_count < 2) return NULL;
+    controller_event *event = new_event(EVENT_CALL, NULL);
+    if (!event) return NULL;
+
+    if (slice_copy(tokens->fields[0], event->call.source, sizeof(event->call.source)) != 0 ||
+        slice_copy(tokens->fields[1], event->call.destination, sizeof(event->call.destination)) != 0) {
+        free(event);
+        return NULL;
+    }
+
+    // The tokenizer leaves anything past its last field in one slice
+    const char *p = tokens->fields[2].ptr;
+    while (tokens->field_count > 2 && *p) {
+        size_t len = strcspn(p, " ");
+        if (len == 8 && memcmp(p, "PRIORITY", 8) == 0) {
+            event->call.priority = CALL_PRIORITY;
+        } else if (len == 7 && memcmp(p, "RESERVE", 7) == 0) {
+            event->call.priority = CALL_RESERVE;
+        } else if (len == 2 && memcmp(p, "ID", 2) == 0) {
+            event->call.reply |= REPLY_ID;
+        } else if (len == 3 && memcmp(p, "ETA", 3) == 0) {
+            event->call.reply |= REPLY_ETA;
+        } else if (len == 5 && memcmp(p, "WATCH", 5) == 0) {
+            event->call.reply |= REPLY_ETA | REPLY_WATCH;
+        } else {
+            free(event);
+            return NULL;
+        }
+        p += len;
+        while (*p == ' ') p++;
+    }
+    return event;
+}
+
+// "CANCEL id" as an event, or NULL if malformed
+controller_event *parse_cancel(const message_tokens *tokens) {
+    char id[16];
+    if (tokens->field_count != 1 || slice_copy(tokens->fields[0], id, sizeof(id)) != 0) return NULL;
+
+    char *end;
+    unsigned long value = strtoul(id, &end, 10);
+    if (*end != '\0' || value == 0 || value > UINT32_MAX) return NULL;
+
+    controller_event *event = new_event(EVENT_CANCEL, NULL);
+    if (event) event->call_id = (uint32_t)value;
+    return event;
+}
+
+// A call client's one request: CALL, CANCEL, or STATS for the wait metrics
+controller_event *parse_request(const message_tokens *tokens) {
+    if (tokens->opcode == MSG_STATS) return new_event(EVENT_STATS, NULL);
+    if (tokens->opcode == MSG_CANCEL) return parse_cancel(tokens);
+    return parse_call(tokens);
+}
+
+// Turn a car's message into an event for the dispatcher
+void post_car_message(connection *conn, const char *message) {
+    controller_event *event = new_event(EVENT_CAR_SEEN, conn);
+    if (!event) return;
+
+    message_tokens tokens;
+    switch (tokenize_message(message, &tokens)) {
+    case MSG_STATUS:
+        if (tokens.field_count == 3 &&
+            slice_copy(tokens.fields[0], event->status.status, sizeof(event->status.status)) == 0 &&
+            slice_copy(tokens.fields[1], event->status.current, sizeof(event->status.current)) == 0 &&
+            slice_copy(tokens.fields[2], event->status.destination, sizeof(event->status.destination)) == 0) {
+            event->type = EVENT_CAR_STATUS;
+        }
+        break;
+    case MSG_EMERGENCY:
+    case MSG_INDIVIDUAL_SERVICE:
+        if (tokens.field_count == 0) event->type = EVENT_CAR_OFFLINE;
+        break;
+    case MSG_VACANT:
+        if (tokens.field_count == 1 && slice_copy(tokens.fields[0], event->vacant, sizeof(event->vacant)) == 0) {
+            event->type = EVENT_CAR_VACANT;
+        }
+        break;
+    case MSG_MOTION:
+        if (tokens.field_count == 4 && parse_motion(tokens.fields[0].ptr, &event->motion) == 0) {
+            event->type = EVENT_CAR_MOTION;
+        }
+        break;
+    default:
+        break;
+    }
+    post_event(event);
+}
+
+// Relay a registered car's messages to the dispatcher and its replies back
+void serve_car(connection *conn) {
+    pthread_mutex_lock(&ctrl.io_mutex);
+    ctrl.car_threads++;
+    pthread_mutex_unlock(&ctrl.io_mutex);
+
+    set_receive_timeout(conn->fd);
+
+    int done = 0;
+    while (!done && ctrl.running && !shutdown_requested) {
+        struct pollfd pfds[3] = {
+            {conn->fd, POLLIN, 0},
+            {conn->notify[0], POLLIN, 0},
+            {ctrl.wake_pipe[0], POLLIN, 0}
+        };
+        if (poll(pfds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // Stay off the socket while a handoff is in progress so no message
+        // is consumed after the state snapshot
+        if (pfds[2].revents & POLLIN) {
+            if (park_for_handoff(1)) return;
+            continue;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            done = flush_outbound(conn);
+        }
+
+        if (!done && pfds[0].revents) {
+            char *message = read_message(conn->fd);
+            if (!message) break;
+            post_car_message(conn, message);
+            free(message);
+        }
+    }
+
+    // Close before un-counting so a handoff snapshot never sees a dead fd
+    close(conn->fd);
+    post_closed(conn);
+
+    pthread_mutex_lock(&ctrl.io_mutex);
+    ctrl.car_threads--;
+    pthread_cond_broadcast(&ctrl.handoff_cond);
+    pthread_mutex_unlock(&ctrl.io_mutex);
+}
+
+// Thread entry for car connections inherited from a previous controller
+void *adopted_car_handler(void *arg) {
+    serve_car(arg);
+    return NULL;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *ptr = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, ptr, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ptr += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *ptr = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, ptr, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;
+        ptr += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Pass the listening socket, car connections and dispatch state to a new
+// controller on peer_fd. Returns 0 once the peer has acknowledged.
+int handoff_send(int peer_fd) {
+    // Held throughout so no new car thread starts reading mid-handoff
+    pthread_mutex_lock(&ctrl.io_mutex);
+    atomic_store(&ctrl.handing_off, 1);
+    (void)write(ctrl.wake_pipe[1], "h", 1);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += HANDOFF_PARK_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (HANDOFF_PARK_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    int parked = 1;
+    while (ctrl.car_threads > 0) {
+        if (pthread_cond_timedwait(&ctrl.handoff_cond, &ctrl.io_mutex, &deadline) == ETIMEDOUT) {
+            parked = ctrl.car_threads == 0;
+            break;
+        }
+    }
+
+    handoff_request req;
+    memset(&req, 0, sizeof(req));
+    sem_init(&req.done, 0, 0);
+    req.slot = parked ? calloc(1, sizeof(checkpoint_slot)) : NULL;
+    controller_event *event = req.slot ? new_event(EVENT_SNAPSHOT, NULL) : NULL;
+    if (!parked) {
+        printf("Handoff abandoned: %d car thread(s) did not park\n", ctrl.car_threads);
+        fflush(stdout);
+    }
+
+    int result = -1;
+    if (event) {
+        // Queued behind everything the parked threads already posted
+        event->handoff = &req;
+        post_event(event);
+        while (sem_wait(&req.done) != 0) {
+        }
+
+        union {
+            char buf[CMSG_SPACE(sizeof(int) * (MAX_CARS + 1))];
+            struct cmsghdr align;
+        } control;
+        memset(&control, 0, sizeof(control));
+
+        struct iovec iov = {&req.header, sizeof(req.header)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * req.header.fd_count);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * req.header.fd_count);
+        memcpy(CMSG_DATA(cmsg), req.fds, sizeof(int) * req.header.fd_count);
+
+        char ack = 0;
+        if (sendmsg(peer_fd, &msg, 0) == (ssize_t)sizeof(req.header) &&
+            write_all(peer_fd, req.slot, sizeof(*req.slot)) == 0 &&
+            read_all(peer_fd, &ack, 1) == 0 && ack == 'A') {
+            result = 0;
+        }
+    }
+    free(req.slot);
+    sem_destroy(&req.done);
+
+    if (result == 0) {
+        atomic_store(&ctrl.handed_off, 1);
+    } else {
+        // New controller went away or a car thread never parked - carry on as before
+        char drain;
+        (void)read(ctrl.wake_pipe[0], &drain, 1);
+    }
+    atomic_store(&ctrl.handing_off, 0);
+    pthread_cond_broadcast(&ctrl.handoff_cond);
+    pthread_mutex_unlock(&ctrl.io_mutex);
+    return result;
+}
+
+// Wait on a Unix socket for a replacement controller and hand everything over
+void *handoff_listener(void *arg) {
+    const char *path = arg;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("handoff socket");
+        return NULL;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("handoff bind");
+        close(fd);
+        return NULL;
+    }
+
+    while (ctrl.running && !shutdown_requested) {
+        int peer = accept(fd, NULL, NULL);
+        if (peer < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        int ok = handoff_send(peer);
+        close(peer);
+        if (ok == 0) {
+            printf("Handed off to new controller\n");
+            fflush(stdout);
+            // Leave the path alone - the new controller may already be listening on it
+            _exit(0);
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// Take over the listening socket, car connections and dispatch state from
+// a running controller that was started with --handoff <path>
+int handoff_receive(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("takeover socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("takeover connect");
+        close(fd);
+        return -1;
+    }
+
+    handoff_header header;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * (MAX_CARS + 1))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n = recvmsg(fd, &msg, 0);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n <= 0 || !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "Takeover: no descriptors received\n");
+        close(fd);
+        return -1;
+    }
+
+    int fds[MAX_CARS + 1];
+    size_t fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (fd_count > MAX_CARS + 1) fd_count = MAX_CARS + 1;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * fd_count);
+
+    checkpoint_slot *slot = calloc(1, sizeof(checkpoint_slot));
+    if (!slot ||
+        ((size_t)n < sizeof(header) && read_all(fd, (char *)&header + n, sizeof(header) - (size_t)n) != 0) ||
+        header.magic != HANDOFF_MAGIC || header.fd_count != fd_count ||
+        read_all(fd, slot, sizeof(*slot)) != 0) {
+        fprintf(stderr, "Takeover: malformed state\n");
+        for (size_t i = 0; i < fd_count; i++) close(fds[i]);
+        free(slot);
+        close(fd);
+        return -1;
+    }
+
+    // The dispatcher isn't running yet, so the car table is ours
+    if (restore_cars(slot) < 0) {
+        fprintf(stderr, "Takeover: malformed state\n");
+        for (size_t i = 0; i < fd_count; i++) close(fds[i]);
+        free(slot);
+        close(fd);
+        return -1;
+    }
+    free(slot);
+
+    ctrl.server_fd = fds[0];
+    for (size_t i = 1; i < fd_count; i++) {
+        int index = header.car_index[i - 1];
+        if (index < 0 || index >= ctrl.car_count) {
+            close(fds[i]);
+            continue;
+        }
+        connection *conn = conn_create(fds[i]);
+        if (!conn) {
+            close(fds[i]);
+            continue;
+        }
+        car_info *car = &ctrl.cars[index];
+        car->conn = conn;
+        car->connected = 1;
+        car->restored = 0;
+        conn->car_index = index;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, adopted_car_handler, conn) != 0) {
+            perror("pthread_create");
+            car->connected = 0;
+            car->conn = NULL;
+            close(fds[i]);
+            conn_free(conn);
+        } else {
+            pthread_detach(thread);
+        }
+    }
+
+    // Old controller exits once it sees this
+    char ack = 'A';
+    int result = write_all(fd, &ack, 1);
+    close(fd);
+
+    printf("Took over %zu car connection(s) from previous controller\n", fd_count - 1);
+    return result;
+}
+
+// Let the kernel notice peers that vanished without closing (cable pulled, host down)
+void set_keepalive(int fd) {
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+    int idle = KEEPALIVE_IDLE_S, interval = KEEPALIVE_INTERVAL_S, count = KEEPALIVE_COUNT;
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+}
+
+// A car thread reads whole frames with a blocking read_message(). Bound each
+// read by the heartbeat silence limit so a car that stalls mid-frame drops its
+// connection instead of pinning the thread past the point it'd be declared dead.
+void set_receive_timeout(int fd) {
+    int interval = ctrl.heartbeat_ms > 0 ? ctrl.heartbeat_ms : DEFAULT_HEARTBEAT_MS;
+    long limit_ms = (long)interval * HEARTBEAT_MISSES;
+    struct timeval timeout = {limit_ms / 1000, (limit_ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Tick the dispatcher so it can ping heartbeat-capable cars
+void *heartbeat_thread(void *arg) {
+    (void)arg;
+
+    while (ctrl.running && !shutdown_requested) {
+        delay_ms(ctrl.heartbeat_ms);
+
+        controller_event *event = new_event(EVENT_HEARTBEAT, NULL);
+        if (event) post_event(event);
+    }
+
+    return NULL;
+}
+
+// Tick the dispatcher so it can look for pickups to move to a faster car
+void *reallocate_thread(void *arg) {
+    (void)arg;
+
+    while (ctrl.running && !shutdown_requested) {
+        delay_ms(ctrl.reallocate_ms);
+
+        controller_event *event = new_event(EVENT_REALLOCATE, NULL);
+        if (event) post_event(event);
+    }
+
+    return NULL;
+}
+
+// Wait (bounded) for a client's first message so an idle connection can't
+// tie up a worker forever
+char *read_first_message(int fd, int timeout_ms) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+
+    if (ready <= 0) return NULL;
+    return read_message(fd);
+}
+
+// Look at the start of the first frame without consuming it. The length
+// prefix can arrive in a segment of its own, so keep looking until the
+// first word is here too or timeout_ms runs out.
+int classify_connection(int fd, int timeout_ms) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char peek[6];
+    for (;;) {
+        ssize_t n = recv(fd, peek, sizeof(peek), MSG_PEEK | MSG_DONTWAIT);
+        if (n >= (ssize_t)sizeof(peek)) break;
+        if (n == 0) return CONN_UNKNOWN;
+
+        long left = timeout_ms - ms_since(&start);
+        if (left <= 0) return CONN_UNKNOWN;
+        if (n > 0) {
+            delay_ms(1);   // Part of the header is here; poll would return at once
+            continue;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, (int)left) < 0 && errno != EINTR) return CONN_UNKNOWN;
+    }
+
+    if (memcmp(peek + 2, "CAR ", 4) == 0) return CONN_CAR;
+    return CONN_CALL;
+}
+
+// Start a dedicated thread for a car connection. Cars stay connected for
+// their whole life, so they never occupy a pool worker.
+int spawn_car_thread(int fd, char *message) {
+    pending_connection *conn = malloc(sizeof(pending_connection));
+    if (!conn) return -1;
+    conn->fd = fd;
+    conn->message = message;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, client_handler, conn) != 0) {
+        perror("pthread_create");
+        free(conn);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Tell an overflowing client to come back later
+void reject_overloaded(int fd) {
+    // Consume the request if it is already here, so closing doesn't reset
+    // the connection before the client reads our reply
+    char *message = NULL;
+    if (classify_connection(fd, 0) != CONN_UNKNOWN) {
+        message = read_message(fd);
+    }
+
+    char reply[32];
+    snprintf(reply, sizeof(reply), "UNAVAILABLE RETRY %d", OVERLOAD_RETRY_MS);
+    write_message(fd, reply);
+    free(message);
+    close(fd);
+}
+
+// Relay the dispatcher's frames for a call connection until the final one,
+// or until the client hangs up. Closes the connection.
+void *stream_replies(void *arg) {
+    connection *conn = arg;
+    int done = 0;
+    while (!done) {
+        struct pollfd pfds[2] = {{conn->notify[0], POLLIN, 0}, {conn->fd, POLLIN, 0}};
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done = flush_outbound(conn);
+        if (!done && (pfds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            char byte;
+            if (recv(conn->fd, &byte, 1, MSG_DONTWAIT) <= 0) break;
+        }
+    }
+
+    close(conn->fd);
+    post_closed(conn);
+    return NULL;
+}
+
+// Hand a call to the dispatcher and relay its answer. Closes fd.
+void serve_call(int fd, const char *message) {
+    connection *conn = NULL;
+    message_tokens tokens;
+    tokenize_message(message, &tokens);
+    controller_event *event = parse_request(&tokens);
+    if (!event || (conn = conn_create(fd)) == NULL) {
+        write_message(fd, "UNAVAILABLE");
+        free(event);
+        close(fd);
+        return;
+    }
+    event->conn = conn;
+    int watch = event->type == EVENT_CALL && (event->call.reply & REPLY_WATCH);
+    post_event(event);
+
+    // A watch lasts until pickup, far too long to hold a pool worker
+    pthread_t thread;
+    if (watch && pthread_create(&thread, NULL, stream_replies, conn) == 0) {
+        pthread_detach(thread);
+        return;
+    }
+    stream_replies(conn);
+}
+
+// Pool workers handle call connections from the accept queue
+void *worker_thread(void *arg) {
+    (void)arg;
+
+    while (ctrl.running && !shutdown_requested) {
+        pthread_mutex_lock(&ctrl.pending.mutex);
+        while (ctrl.pending.count == 0) {
+            pthread_cond_wait(&ctrl.pending.not_empty, &ctrl.pending.mutex);
+        }
+        int fd = ctrl.pending.fds[ctrl.pending.head];
+        ctrl.pending.head = (ctrl.pending.head + 1) % ACCEPT_QUEUE_LEN;
+        ctrl.pending.count--;
+        pthread_mutex_unlock(&ctrl.pending.mutex);
+
+        char *message = read_first_message(fd, FIRST_MESSAGE_TIMEOUT_MS);
+        if (!message) {
+            close(fd);
+            continue;
+        }
+
+        message_tokens tokens;
+        switch (tokenize_message(message, &tokens)) {
+        case MSG_CAR:
+            // A car whose registration arrived late - give it its own thread
+            if (spawn_car_thread(fd, message) != 0) {
+                free(message);
+                close(fd);
+            }
+            continue;
+        case MSG_CALL:
+        case MSG_CANCEL:
+        case MSG_STATS:
+            serve_call(fd, message);
+            break;
+        default:
+            close(fd);
+            break;
+        }
+        free(message);
+    }
+
+    return NULL;
+}
+
+// Queue a connection for the pool. Returns -1 if the queue is full.
+int enqueue_connection(int fd) {
+    int result = -1;
+    pthread_mutex_lock(&ctrl.pending.mutex);
+    if (ctrl.pending.count < ACCEPT_QUEUE_LEN) {
+        int tail = (ctrl.pending.head + ctrl.pending.count) % ACCEPT_QUEUE_LEN;
+        ctrl.pending.fds[tail] = fd;
+        ctrl.pending.count++;
+        pthread_cond_signal(&ctrl.pending.not_empty);
+        result = 0;
+    }
+    pthread_mutex_unlock(&ctrl.pending.mutex);
+    return result;
+}
+
+// Route a freshly accepted connection: cars straight to a dedicated thread,
+// calls to the bounded pool, and a fast retry-after reply when that's full
+void admit_connection(int fd) {
+    int kind = classify_connection(fd, 0);
+    if (kind == CONN_CAR) {
+        if (spawn_car_thread(fd, NULL) != 0) close(fd);
+        return;
+    }
+
+    if (enqueue_connection(fd) == 0) return;
+
+    // Full - give a car that is mid-handshake a moment to identify itself
+    if (kind == CONN_UNKNOWN && classify_connection(fd, OVERLOAD_PEEK_MS) == CONN_CAR) {
+        if (spawn_car_thread(fd, NULL) != 0) close(fd);
+        return;
+    }
+    reject_overloaded(fd);
+}
+
+void *client_handler(void *arg) {
+    pending_connection *conn = arg;
+    int client_fd = conn->fd;
+    char *message = conn->message;
+    free(conn);
+
+    if (!message) {
+        message = read_first_message(client_fd, FIRST_MESSAGE_TIMEOUT_MS);
+    }
+    if (!message) {
+        close(client_fd);
+        return NULL;
+    }
+
+    message_tokens tokens;
+    message_opcode opcode = tokenize_message(message, &tokens);
+    if (opcode == MSG_CAR) {
+        // Car registration, optionally followed by feature tokens
+        controller_event *event = parse_registration(&tokens);
+        connection *car_conn = NULL;
+        if (event && (car_conn = conn_create(client_fd)) != NULL) {
+            event->conn = car_conn;
+            set_keepalive(client_fd);
+            post_event(event);
+            free(message);
+
+            // Closes the socket when the car goes away
+            serve_car(car_conn);
+            return NULL;
+        }
+        free(event);
+    } else if (opcode == MSG_CALL || opcode == MSG_CANCEL || opcode == MSG_STATS) {
+        // Call, cancellation or metrics request
+        serve_call(client_fd, message);
+        free(message);
+        return NULL;
+    }
+
+    free(message);
+    close(client_fd);
+    return NULL;
+}
+
+// Event-loop backends (--io epoll|uring): one thread owns every socket,
+// splits input into frames itself and batches output. A connection is
+// freed by the loop once it has closed it and the dispatcher has let go.
+
+static int buffer_append(char **buf, size_t *len, size_t *cap, const void *data, size_t n) {
+    // Keep a spare byte so a frame can be NUL-terminated in place
+    if (*len + n + 1 > *cap) {
+        size_t new_cap = *cap ? *cap : 256;
+        while (*len + n + 1 > new_cap) new_cap *= 2;
+        char *grown = realloc(*buf, new_cap);
+        if (!grown) return -1;
+        *buf = grown;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+static void buffer_consume(char *buf, size_t *len, size_t n) {
+    memmove(buf, buf + n, *len - n);
+    *len -= n;
+}
+
+// Put a connection on the list flushed at the end of this loop iteration
+void reactor_mark_dirty(connection *conn, connection **dirty) {
+    if (conn->dirty || conn->closed) return;
+    conn->dirty = 1;
+    conn->next_dirty = *dirty;
+    *dirty = conn;
+}
+
+void reactor_queue_frame(connection *conn, const char *text) {
+    size_t n = strlen(text);
+    uint16_t len = htons((uint16_t)n);
+    if (buffer_append(&conn->tx, &conn->tx_len, &conn->tx_cap, &len, sizeof(len)) != 0 ||
+        buffer_append(&conn->tx, &conn->tx_len, &conn->tx_cap, text, n) != 0) {
+        conn->closing = 1;
+    }
+}
+
+// The first frame decides what the connection is
+void reactor_frame(connection *conn, const char *message, connection **dirty) {
+    if (conn->kind == CONN_CAR) {
+        post_car_message(conn, message);
+        return;
+    }
+    if (conn->kind == CONN_CALL) {
+        return;   // Nothing more is expected from a call client
+    }
+
+    controller_event *event = NULL;
+    message_tokens tokens;
+    switch (tokenize_message(message, &tokens)) {
+    case MSG_CAR:
+        conn->kind = CONN_CAR;
+        event = parse_registration(&tokens);
+        if (event) set_keepalive(conn->fd);
+        break;
+    case MSG_CALL:
+    case MSG_CANCEL:
+    case MSG_STATS:
+        conn->kind = CONN_CALL;
+        event = parse_request(&tokens);
+        if (!event) reactor_queue_frame(conn, "UNAVAILABLE");
+        break;
+    default:
+        break;
+    }
+
+    if (!event) {
+        conn->closing = 1;
+        reactor_mark_dirty(conn, dirty);
+        return;
+    }
+    event->conn = conn;
+    post_event(event);
+}
+
+// Feed received bytes through the framer
+void reactor_input(connection *conn, const char *data, size_t n, connection **dirty) {
+    if (conn->closing) return;
+    if (buffer_append(&conn->rx, &conn->rx_len, &conn->rx_cap, data, n) != 0) {
+        conn->closing = 1;
+        reactor_mark_dirty(conn, dirty);
+        return;
+    }
+
+    size_t off = 0;
+    while (conn->rx_len - off >= sizeof(uint16_t) && !conn->closing) {
+        uint16_t len;
+        memcpy(&len, conn->rx + off, sizeof(len));
+        len = ntohs(len);
+        if (conn->rx_len - off - sizeof(len) < len) break;
+
+        // Terminate in place; the byte after the frame is put back afterwards
+        char *message = conn->rx + off + sizeof(len);
+        char saved = message[len];
+        message[len] = '\0';
+        reactor_frame(conn, message, dirty);
+        message[len] = saved;
+        off += sizeof(len) + len;
+    }
+    buffer_consume(conn->rx, &conn->rx_len, off);
+}
+
+// Move the dispatcher's output onto send buffers. Released connections go
+// on the graveyard list, to be freed after this iteration's flush.
+void reactor_drain_outbox(connection **dirty, connection **graveyard) {
+    mpsc_node *node;
+    while ((node = mpsc_pop(&ctrl.io_outbox)) != NULL) {
+        outbound_message *msg = (outbound_message *)node;
+        connection *conn = msg->conn;
+
+        if (msg->release) {
+            conn->next_dirty = *graveyard;
+            *graveyard = conn;
+        } else if (!conn->closed && !conn->closing) {
+            if (msg->text[0] != '\0') reactor_queue_frame(conn, msg->text);
+            if (msg->final) conn->closing = 1;
+            reactor_mark_dirty(conn, dirty);
+        }
+        free(msg);
+    }
+}
+
+// The socket is gone; tell the dispatcher, which will release conn
+void reactor_closed(connection *conn) {
+    close(conn->fd);
+    conn->closed = 1;
+    post_closed(conn);
+}
+
+void reactor_free_graveyard(connection *graveyard) {
+    while (graveyard) {
+        connection *next = graveyard->next_dirty;
+        conn_free(graveyard);
+        graveyard = next;
+    }
+}
+
+void reactor_drain_wake(void) {
+    char drain[64];
+    while (read(ctrl.io_wake[0], drain, sizeof(drain)) > 0) {
+    }
+    atomic_store(&ctrl.io_woken, 0);
+}
+
+#ifdef __linux__
+// Distinct addresses marking the listening socket and wake pipe in epoll data
+static char epoll_listen_tag, epoll_wake_tag;
+
+void epoll_close(int ep, connection *conn) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, conn->fd, NULL);
+    reactor_closed(conn);
+}
+
+// Write as much as the socket takes; wait for EPOLLOUT for the rest
+void epoll_flush(int ep, connection *conn) {
+    while (conn->tx_len > 0) {
+        ssize_t n = send(conn->fd, conn->tx, conn->tx_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            buffer_consume(conn->tx, &conn->tx_len, (size_t)n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        epoll_close(ep, conn);
+        return;
+    }
+
+    if (conn->closing && conn->tx_len == 0) {
+        epoll_close(ep, conn);
+        return;
+    }
+
+    int want_out = conn->tx_len > 0;
+    if (want_out != conn->want_out) {
+        struct epoll_event ev = {EPOLLIN | (want_out ? EPOLLOUT : 0), {.ptr = conn}};
+        epoll_ctl(ep, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->want_out = want_out;
+    }
+}
+
+void epoll_accept(int ep) {
+    for (;;) {
+        int fd = accept(ctrl.server_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            return;   // EAGAIN, or a transient error we'll see again
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        connection *conn = conn_create(fd);
+        struct epoll_event ev = {EPOLLIN, {.ptr = conn}};
+        if (!conn || epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            if (conn) conn_free(conn);
+            close(fd);
+        }
+    }
+}
+
+// Read until the socket is dry. Closes the connection on EOF or error.
+void epoll_read(int ep, connection *conn, connection **dirty) {
+    char buf[URING_BUFFER_SIZE];
+    for (;;) {
+        ssize_t n = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) {
+            reactor_input(conn, buf, (size_t)n, dirty);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        epoll_close(ep, conn);
+        return;
+    }
+}
+
+int run_epoll_loop(void) {
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    struct epoll_event ev = {EPOLLIN, {.ptr = &epoll_listen_tag}};
+    struct epoll_event wake = {EPOLLIN, {.ptr = &epoll_wake_tag}};
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, ctrl.server_fd, &ev) < 0 ||
+        epoll_ctl(ep, EPOLL_CTL_ADD, ctrl.io_wake[0], &wake) < 0) {
+        perror("epoll_ctl");
+        close(ep);
+        return -1;
+    }
+
+    struct epoll_event events[64];
+    while (ctrl.running && !shutdown_requested) {
+        int n = epoll_wait(ep, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        connection *dirty = NULL;
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &epoll_listen_tag) {
+                epoll_accept(ep);
+            } else if (tag == &epoll_wake_tag) {
+                reactor_drain_wake();
+            } else {
+                connection *conn = tag;
+                if (conn->closed) continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    epoll_read(ep, conn, &dirty);
+                }
+                if (!conn->closed && (events[i].events & EPOLLOUT)) {
+                    reactor_mark_dirty(conn, &dirty);
+                }
+            }
+        }
+
+        connection *graveyard = NULL;
+        reactor_drain_outbox(&dirty, &graveyard);
+        while (dirty) {
+            connection *conn = dirty;
+            dirty = conn->next_dirty;
+            conn->dirty = 0;
+            if (!conn->closed) epoll_flush(ep, conn);
+        }
+        reactor_free_graveyard(graveyard);
+    }
+
+    close(ep);
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;          // SQEs prepared, published on the next submit
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_sqe *sqes;
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs;                      // URING_BUFFERS provided buffers back to back
+    unsigned short buf_tail;
+} uring_state;
+
+static struct io_uring_sqe *uring_get_sqe(uring_state *ring);
+
+static int uring_enter(uring_state *ring, unsigned wait_nr) {
+    atomic_store_explicit(ring->sq_tail, ring->sq_local_tail, memory_order_release);
+    unsigned pending = ring->sq_local_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+
+    int ret;
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, ring->fd, pending, wait_nr,
+                           wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR && !shutdown_requested);
+    return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_state *ring) {
+    unsigned head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        // Full - push what we have to the kernel first
+        uring_enter(ring, 0);
+        head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+        if (ring->sq_local_tail - head >= ring->sq_entries) return NULL;
+    }
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+static void uring_give_buffer(uring_state *ring, unsigned short bid) {
+    // Only addr/len/bid are written: bufs[0].resv doubles as the ring tail
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    atomic_store_explicit((_Atomic unsigned short *)&ring->buf_ring->tail, ring->buf_tail,
+                          memory_order_release);
+}
+
+// Map the rings and register the provided-buffer ring. Returns -1 if this
+// kernel (or sandbox) can't do what we need.
+int uring_init(uring_state *ring) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char *rings = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    size_t buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    void *buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufs = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (rings == MAP_FAILED || sqes == MAP_FAILED || buf_ring == MAP_FAILED || !ring->bufs) {
+        goto fail;
+    }
+
+    ring->sq_head = (_Atomic unsigned *)(rings + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned *)(rings + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(rings + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(rings + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = atomic_load(ring->sq_tail);
+    ring->cq_head = (_Atomic unsigned *)(rings + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned *)(rings + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    ring->sqes = sqes;
+    ring->buf_ring = buf_ring;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        goto fail;
+    }
+    for (unsigned i = 0; i < URING_BUFFERS; i++) {
+        uring_give_buffer(ring, (unsigned short)i);
+    }
+    return 0;
+
+fail:
+    // Mappings are left for process exit; we're about to fall back anyway
+    free(ring->bufs);
+    close(ring->fd);
+    return -1;
+}
+
+static void uring_prep(uring_state *ring, uint8_t opcode, int fd, connection *conn, uint64_t tag,
+                       struct io_uring_sqe **out) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    *out = sqe;
+    if (!sqe) return;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | tag;
+}
+
+// One SQE keeps accepting until it errors
+void uring_arm_accept(uring_state *ring) {
+    struct io_uring_sqe *sqe;
+    uring_prep(ring, IORING_OP_ACCEPT, ctrl.server_fd, NULL, URING_ACCEPT, &sqe);
+    if (sqe) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void uring_arm_wake(uring_state *ring) {
+    struct io_uring_sqe *sqe;
+    uring_prep(ring, IORING_OP_POLL_ADD, ctrl.io_wake[0], NULL, URING_WAKE, &sqe);
+    if (sqe) {
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+}
+
+// One SQE keeps receiving into provided buffers until EOF or error
+void uring_arm_recv(uring_state *ring, connection *conn) {
+    struct io_uring_sqe *sqe;
+    uring_prep(ring, IORING_OP_RECV, conn->fd, conn, URING_RECV, &sqe);
+    if (!sqe) {
+        conn->read_done = 1;
+        return;
+    }
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+}
+
+// Only one send per connection is in flight, so frames can't reorder
+void uring_send(uring_state *ring, connection *conn) {
+    if (conn->send_inflight) return;
+    if (!conn->sending && conn->tx_len > 0) {
+        conn->sending = conn->tx;
+        conn->sending_len = conn->tx_len;
+        conn->sending_off = 0;
+        conn->tx = NULL;
+        conn->tx_len = conn->tx_cap = 0;
+    }
+    if (!conn->sending) return;
+
+    struct io_uring_sqe *sqe;
+    uring_prep(ring, IORING_OP_SEND, conn->fd, conn, URING_SEND, &sqe);
+    if (!sqe) return;
+    sqe->addr = (uint64_t)(uintptr_t)(conn->sending + conn->sending_off);
+    sqe->len = (uint32_t)(conn->sending_len - conn->sending_off);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    conn->send_inflight = 1;
+}
+
+// Shut the socket down once output is written; the recv then ends with EOF
+void uring_flush(uring_state *ring, connection *conn) {
+    uring_send(ring, conn);
+    if (conn->closing && !conn->send_inflight && !conn->shut) {
+        shutdown(conn->fd, SHUT_RDWR);
+        conn->shut = 1;
+    }
+    if (conn->read_done && !conn->send_inflight && !conn->closed) {
+        reactor_closed(conn);
+    }
+}
+
+void uring_complete(uring_state *ring, struct io_uring_cqe *cqe, connection **dirty) {
+    uint64_t tag = cqe->user_data & URING_TAG_MASK;
+    connection *conn = (connection *)(uintptr_t)(cqe->user_data & ~URING_TAG_MASK);
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    switch (tag) {
+    case URING_ACCEPT:
+        if (cqe->res >= 0) {
+            connection *accepted = conn_create(cqe->res);
+            if (accepted) {
+                uring_arm_recv(ring, accepted);
+            } else {
+                close(cqe->res);
+            }
+        }
+        if (!more && cqe->res != -EINVAL) uring_arm_accept(ring);
+        break;
+    case URING_WAKE:
+        reactor_drain_wake();
+        if (!more) uring_arm_wake(ring);
+        break;
+    case URING_RECV:
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            if (cqe->res > 0) {
+                reactor_input(conn, ring->bufs + (size_t)bid * URING_BUFFER_SIZE, (size_t)cqe->res, dirty);
+            }
+            uring_give_buffer(ring, bid);
+        }
+        if (!more) {
+            // Out of buffers isn't the peer's fault - just go again
+            if ((cqe->res > 0 || cqe->res == -ENOBUFS) && !conn->shut) {
+                uring_arm_recv(ring, conn);
+            } else {
+                conn->read_done = 1;
+            }
+        }
+        if (conn->read_done) reactor_mark_dirty(conn, dirty);
+        break;
+    case URING_SEND:
+        conn->send_inflight = 0;
+        if (cqe->res < 0) {
+            conn->closing = 1;
+            free(conn->sending);
+            conn->sending = NULL;
+            conn->tx_len = 0;
+        } else {
+            conn->sending_off += (size_t)cqe->res;
+            if (conn->sending_off >= conn->sending_len) {
+                free(conn->sending);
+                conn->sending = NULL;
+            }
+        }
+        reactor_mark_dirty(conn, dirty);
+        break;
+    }
+}
+
+int run_uring_loop(uring_state *ring) {
+    uring_arm_accept(ring);
+    uring_arm_wake(ring);
+
+    while (ctrl.running && !shutdown_requested) {
+        // Submit everything queued last round and wait for at least one completion
+        if (uring_enter(ring, 1) < 0) {
+            if (errno == EINTR) break;
+            perror("io_uring_enter");
+            return -1;
+        }
+
+        connection *dirty = NULL;
+        unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+        while (head != tail) {
+            uring_complete(ring, &ring->cqes[head & *ring->cq_mask], &dirty);
+            head++;
+        }
+        atomic_store_explicit(ring->cq_head, head, memory_order_release);
+
+        connection *graveyard = NULL;
+        reactor_drain_outbox(&dirty, &graveyard);
+        while (dirty) {
+            connection *conn = dirty;
+            dirty = conn->next_dirty;
+            conn->dirty = 0;
+            if (!conn->closed) uring_flush(ring, conn);
+        }
+        reactor_free_graveyard(graveyard);
+    }
+
+    // The armed accept holds the listening socket until the ring is torn
+    // down after we exit, so stop listening now to free the port
+    shutdown(ctrl.server_fd, SHUT_RDWR);
+    return 0;
+}
+#endif
+
+// Serve every socket from this thread on the chosen backend
+int run_event_loop(void) {
+    if (pipe(ctrl.io_wake) == -1) {
+        perror("pipe");
+        return -1;
     }
+    fcntl(ctrl.io_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(ctrl.io_wake[1], F_SETFL, O_NONBLOCK);
+    fcntl(ctrl.server_fd, F_SETFL, O_NONBLOCK);
 
-    // Listen for car and call connections
-    ctrl.server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (ctrl.server_fd < 0) {
-        perror("socket");
+#ifdef __linux__
+    if (ctrl.io_backend == IO_URING) {
+        uring_state ring;
+        if (uring_init(&ring) == 0) {
+            printf("Using io_uring I/O backend\n");
+            fflush(stdout);
+            return run_uring_loop(&ring);
+        }
+        fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+        ctrl.io_backend = IO_EPOLL;
+    }
+    printf("Using epoll I/O backend\n");
+    fflush(stdout);
+    return run_epoll_loop();
+#else
+    fprintf(stderr, "Event-loop I/O backends need Linux\n");
+    return -1;
+#endif
+}
+
+int main(int argc, char *argv[]) {
+    const char *checkpoint_path = NULL;
+    const char *handoff_path = NULL;
+    const char *takeover_path = NULL;
+    int heartbeat_ms = DEFAULT_HEARTBEAT_MS;
+    int reallocate_ms = DEFAULT_REALLOCATE_MS;
+    int max_wait_ms = DEFAULT_MAX_WAIT_MS;
+    int traffic_window_ms = DEFAULT_TRAFFIC_WINDOW_MS;
+    const char *lobby = DEFAULT_LOBBY;
+    const char *topology_path = NULL;
+    int headway_bias = 0;
+    int workers = DEFAULT_WORKERS;
+    int dispatcher_cpu = -1;
+    int io_backend = IO_THREADS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint_path = argv[++i];
+        } else if (strcmp(argv[i], "--handoff") == 0 && i + 1 < argc) {
+            handoff_path = argv[++i];
+        } else if (strcmp(argv[i], "--takeover") == 0 && i + 1 < argc) {
+            takeover_path = argv[++i];
+        } else if (strcmp(argv[i], "--heartbeat") == 0 && i + 1 < argc) {
+            heartbeat_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--reallocate") == 0 && i + 1 < argc) {
+            reallocate_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-wait") == 0 && i + 1 < argc) {
+            max_wait_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--traffic-window") == 0 && i + 1 < argc) {
+            traffic_window_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--headway-bias") == 0 && i + 1 < argc) {
+            headway_bias = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lobby") == 0 && i + 1 < argc && parse_floor(argv[i + 1]).ok) {
+            lobby = argv[++i];
+        } else if (strcmp(argv[i], "--topology") == 0 && i + 1 < argc) {
+            topology_path = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dispatcher-cpu") == 0 && i + 1 < argc) {
+            dispatcher_cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "threads") == 0 || strcmp(argv[i + 1], "epoll") == 0 ||
+                    strcmp(argv[i + 1], "uring") == 0)) {
+            i++;
+            io_backend = strcmp(argv[i], "threads") == 0 ? IO_THREADS :
+                         strcmp(argv[i], "epoll") == 0 ? IO_EPOLL : IO_URING;
+        } else {
+            fprintf(stderr, "Usage: %s [--checkpoint <file>] [--handoff <socket>] [--takeover <socket>]"
+                            " [--heartbeat <ms>] [--reallocate <ms>] [--max-wait <ms>] [--traffic-window <ms>]"
+                            " [--lobby <floor>] [--topology <file>] [--headway-bias <steps>] [--workers <n>]"
+                            " [--dispatcher-cpu <cpu>] [--io threads|epoll|uring]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Handoff parks per-connection threads, which the event loop doesn't have
+    if (io_backend != IO_THREADS && (handoff_path || takeover_path)) {
+        fprintf(stderr, "--handoff and --takeover need --io threads\n");
         return 1;
     }
 
-    int reuse = 1;
-    if (setsockopt(ctrl.server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-        perror("setsockopt");
-        close(ctrl.server_fd);
+    // Set up the dispatcher
+    memset(&ctrl, 0, sizeof(ctrl));
+    ctrl.running = 1;
+    ctrl.server_fd = -1;
+    ctrl.heartbeat_ms = heartbeat_ms;
+    ctrl.reallocate_ms = reallocate_ms;
+    ctrl.max_wait_ms = max_wait_ms;
+    ctrl.traffic_window_ms = traffic_window_ms;
+    ctrl.lobby = parse_floor(lobby).numeric;
+    ctrl.headway_bias = headway_bias;
+    ctrl.dispatcher_cpu = dispatcher_cpu;
+    ctrl.io_backend = io_backend;
+    if (topology_path && load_topology(topology_path, &ctrl.topology) != 0) return 1;
+    mpsc_init(&ctrl.events);
+    mpsc_init(&ctrl.io_outbox);
+    sem_init(&ctrl.events_ready, 0, 0);
+    pthread_mutex_init(&ctrl.io_mutex, NULL);
+    pthread_cond_init(&ctrl.handoff_cond, NULL);
+    pthread_mutex_init(&ctrl.pending.mutex, NULL);
+    pthread_cond_init(&ctrl.pending.not_empty, NULL);
+    if (pipe(ctrl.wake_pipe) == -1) {
+        perror("pipe");
         return 1;
     }
+    ctrl.io_wake[0] = ctrl.io_wake[1] = -1;
 
-    // Start listening for clients
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(CONTROLLER_IP);
-    addr.sin_port = htons(CONTROLLER_PORT);
+    // Graceful shutdown on Ctrl+C
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigint_handler;
+    sa.sa_flags = SA_RESTART;  // Restart interrupted system calls
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1) {
+        perror("sigaction SIGINT");
+        return 1;
+    }
 
-    if (bind(ctrl.server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        close(ctrl.server_fd);
+    // Don't crash on broken connections
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+        perror("sigaction SIGPIPE");
         return 1;
     }
 
-    if (listen(ctrl.server_fd, 10) < 0) {
-        perror("listen");
-        close(ctrl.server_fd);
+    if (takeover_path) {
+        // Inherit the socket and cars from the running controller
+        if (handoff_receive(takeover_path) != 0) {
+            return 1;
+        }
+        if (checkpoint_path) {
+            if (checkpoint_open(checkpoint_path, 0) != 0) {
+                return 1;
+            }
+            checkpoint_save(NULL);
+        }
+    } else {
+        // Warm restart from the last checkpoint if one was requested
+        if (checkpoint_path && checkpoint_open(checkpoint_path, 1) != 0) {
+            return 1;
+        }
+
+        // Listen for car and call connections
+        ctrl.server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (ctrl.server_fd < 0) {
+            perror("socket");
+            return 1;
+        }
+
+        int reuse = 1;
+        if (setsockopt(ctrl.server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+            perror("setsockopt");
+            close(ctrl.server_fd);
+            return 1;
+        }
+
+        // Start listening for clients
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr(CONTROLLER_IP);
+        addr.sin_port = htons(CONTROLLER_PORT);
+
+        if (bind(ctrl.server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("bind");
+            close(ctrl.server_fd);
+            return 1;
+        }
+
+        if (listen(ctrl.server_fd, SOMAXCONN) < 0) {
+            perror("listen");
+            close(ctrl.server_fd);
+            return 1;
+        }
+    }
+
+    // From here on only the dispatcher touches the car table
+    pthread_t dispatcher;
+    if (pthread_create(&dispatcher, NULL, dispatcher_thread, NULL) != 0) {
+        perror("pthread_create");
         return 1;
     }
+    pthread_detach(dispatcher);
+#ifdef __linux__
+    if (ctrl.dispatcher_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(ctrl.dispatcher_cpu, &cpus);
+        int err = pthread_setaffinity_np(dispatcher, sizeof(cpus), &cpus);
+        if (err != 0) {
+            fprintf(stderr, "Couldn't pin dispatcher to CPU %d: %s\n", ctrl.dispatcher_cpu, strerror(err));
+        }
+    }
+#endif
 
     printf("Controller listening on %s:%d\n", CONTROLLER_IP, CONTROLLER_PORT);
+    fflush(stdout);
+
+    // Accept the next controller's takeover request in the background
+    if (handoff_path) {
+        pthread_t handoff_thread;
+        if (pthread_create(&handoff_thread, NULL, handoff_listener, (void *)handoff_path) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(handoff_thread);
+    }
+
+    if (workers < 1) workers = 1;
+    for (int i = 0; ctrl.io_backend == IO_THREADS && i < workers; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, worker_thread, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(worker);
+    }
+
+    if (ctrl.heartbeat_ms > 0) {
+        pthread_t hb_thread;
+        if (pthread_create(&hb_thread, NULL, heartbeat_thread, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(hb_thread);
+    }
+
+    if (ctrl.reallocate_ms > 0) {
+        pthread_t realloc_thread;
+        if (pthread_create(&realloc_thread, NULL, reallocate_thread, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(realloc_thread);
+    }
+
+    if (ctrl.io_backend != IO_THREADS) {
+        run_event_loop();
+        cleanup_and_exit();
+    }
 
     // Main server loop - accept client connections
     while (ctrl.running && !shutdown_requested) {
+        struct pollfd pfds[2] = {
+            {ctrl.server_fd, POLLIN, 0},
+            {ctrl.wake_pipe[0], POLLIN, 0}
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        // Leave pending connections for the new controller during a handoff
+        if (pfds[1].revents & POLLIN) {
+            if (park_for_handoff(0)) break;
+            continue;
+        }
+
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
         int client_fd = accept(ctrl.server_fd, (struct sockaddr*)&client_addr, &client_len);
@@ -578,20 +4258,9 @@ int main() {
             break;
         }
 
-        // Handle each client in its own thread
-        pthread_t thread;
-        int *fd_ptr = malloc(sizeof(int));
-        *fd_ptr = client_fd;
-
-        if (pthread_create(&thread, NULL, client_handler, fd_ptr) != 0) {
-            perror("pthread_create");
-            close(client_fd);
-            free(fd_ptr);
-        } else {
-            pthread_detach(thread);
-        }
+        admit_connection(client_fd);
     }
 
     cleanup_and_exit();
     return 0;
-}
\ No newline at end of file
+}
@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -22,12 +23,22 @@
 #include <errno.h>
 #include <sys/select.h>
 #include <limits.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+#include <semaphore.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 // Size constants
 #define MAX_FLOOR_LEN 4U
 #define MAX_STATUS_LEN 8U
 #define MAX_CAR_NAME_LEN 32U
 #define MAX_CARS 32U
+#define MAX_FLOOR_COUNT 1098U   // B99-B1 and 1-999
 
 // Shared memory structure
 typedef struct {
@@ -46,6 +57,20 @@ typedef struct {
     uint8_t emergency_mode;          // 1 if in emergency mode, else 0
 } car_shared_mem;
 
+// Layout of a car's segment. Only the owning car knows about the trailer -
+// other processes map sizeof(car_shared_mem) and never see it.
+#define CAR_SHM_MAGIC 0x43415253U        // "CARS"
+#define CAR_SHM_LAYOUT_VERSION 2U
+
+typedef struct {
+    car_shared_mem mem;              // Must stay first
+    uint32_t magic;                  // CAR_SHM_MAGIC once fully initialised
+    uint32_t layout_version;         // CAR_SHM_LAYOUT_VERSION
+    char lowest[MAX_FLOOR_LEN];      // Range the segment was created for
+    char highest[MAX_FLOOR_LEN];
+    pid_t owner;                     // Car process currently driving the segment
+} car_shm_segment;
+
 // Floor parsing result
 typedef struct {
     int ok;           // 1 if valid, 0 if invalid
@@ -53,21 +78,122 @@ typedef struct {
     int is_basement;  // 1 if basement floor, 0 if regular
 } floor_info;
 
+// Kinematic motion profile. A run of any length speeds up and slows down
+// within the jerk and acceleration limits, and cruises at the speed limit if
+// it is long enough to reach it.
+typedef struct {
+    double speed;             // m/s
+    double accel;             // m/s^2
+    double jerk;              // m/s^3
+    double floor_height;      // m
+} motion_profile;
+
+// Building topology, read from a --topology file. Floors that aren't in the
+// file don't exist, and a car named in it may not stop at every floor it
+// passes. The tables are indexed by floor_slot(), so lookups are O(1).
+#define TOPOLOGY_LABEL_LEN 16U
+#define TOPOLOGY_WORDS ((MAX_FLOOR_COUNT + 63U) / 64U)
+
+typedef struct {
+    char name[MAX_CAR_NAME_LEN];
+    uint64_t stops[TOPOLOGY_WORDS];  // Slots the car may open at
+} topology_car;
+
+typedef struct {
+    int floor_count;                 // 0 if no topology was loaded
+    int16_t rank[MAX_FLOOR_COUNT];   // Floors below each slot's floor, -1 if there is no such floor
+    int16_t slot[MAX_FLOOR_COUNT];   // Slot of the floor at each rank
+    double level[MAX_FLOOR_COUNT];   // Metres above the lowest floor, by slot
+    char label[MAX_FLOOR_COUNT][TOPOLOGY_LABEL_LEN]; // By slot, empty if the floor has none
+    int car_count;
+    topology_car cars[MAX_CARS];     // Cars with floors they skip; any other car stops everywhere
+} building_topology;
+
 // Network constants
 #define CONTROLLER_PORT 3000
 #define CONTROLLER_IP "127.0.0.1"
 
+// Optional capabilities a car lists after "CAR <name> <lowest> <highest>".
+// Cars that list none get the original protocol.
+#define CAR_FEATURE_HEARTBEAT 0x01U  // "HEARTBEAT": answers PING with PONG
+#define CAR_FEATURE_ROUTE 0x02U      // "ROUTE": takes its stop list as ROUTE edits instead of FLOOR
+#define CAR_FEATURE_VACANT 0x04U     // "VACANT": reports VACANT when nobody used the doorway at a stop
+#define CAR_FEATURE_DWELL 0x08U      // "DWELL": takes DWELL hints for how long to hold its doors open
+
+// Protocol tokenizer: a frame is split in one pass into an opcode and up to
+// MAX_MESSAGE_FIELDS space-separated fields that point into the frame
+#define MAX_MESSAGE_FIELDS 8
+
+typedef enum {
+    MSG_UNKNOWN = 0,
+    MSG_CAR,                  // CAR <name> <lowest> <highest> [features...]
+    MSG_CALL,                 // CALL <source> <destination> [PRIORITY|RESERVE] [ID] [ETA] [WATCH]
+    MSG_CANCEL,               // CANCEL <id>
+    MSG_STATUS,               // STATUS <status> <current> <destination>
+    MSG_FLOOR,                // FLOOR <floor>
+    MSG_ROUTE,                // ROUTE [stops...] | ROUTE ADD <floor> <following>
+    MSG_EMERGENCY,            // EMERGENCY
+    MSG_INDIVIDUAL_SERVICE,   // INDIVIDUAL SERVICE
+    MSG_PING,
+    MSG_PONG,
+    MSG_UNAVAILABLE,          // UNAVAILABLE [RETRY <ms>]
+    MSG_STATS,                // STATS | STATS <calls> <p50> <p99> <p999> <max> <overdue> <estimated> <eta_err> <eta_bias> <traffic> <bunched>
+    MSG_VACANT,               // VACANT <floor>
+    MSG_DWELL,                // DWELL NONE|SHORT|NORMAL|LONG
+    MSG_MOTION,               // MOTION <speed> <accel> <jerk> <floor-height>
+    MSG_OPCODE_COUNT
+} message_opcode;
+
+typedef struct {
+    const char *ptr;          // Not NUL-terminated
+    size_t len;
+} message_slice;
+
+typedef struct {
+    message_opcode opcode;
+    int field_count;
+    message_slice fields[MAX_MESSAGE_FIELDS];
+} message_tokens;
+
 // Function declarations
 floor_info parse_floor(const char *const floor_str);
+int decode_floor(const char *floor, size_t len, int *numeric);
 int compare_floors(const char *const floor1, const char *const floor2);
 int is_valid_floor_range(const char *const floor, const char *const lowest, const char *const highest);
 void floor_to_string(int numeric, int is_basement, char *output);
 int next_floor_towards(const char *const current, const char *const destination,
-                       const char *const lowest, const char *const highest, char *output, size_t output_size);
+                       const char *const lowest, const char *const highest,
+                       const building_topology *topology, char *output, size_t output_size);
+int floor_slot(int numeric);
+int slot_numeric(int slot);
+
+int load_topology(const char *path, building_topology *topo);
+int topology_car_index(const building_topology *topo, const char *name);
+int topology_find_label(const building_topology *topo, const char *label, int *numeric);
+int topology_stops_at(const building_topology *topo, int car, int numeric);
+int topology_move(const building_topology *topo, int numeric, int floors);
+int topology_floors(const building_topology *topo, int from, int to);
+double topology_distance(const building_topology *topo, int from, int to, double floor_height);
 
-car_shared_mem *create_shared_memory(const char *const car_name, const char *const lowest_floor);
+car_shared_mem *create_shared_memory(const char *const car_name, const char *const lowest_floor,
+                                     const char *const highest_floor);
+car_shared_mem *reattach_shared_memory(const char *const car_name, const char *const lowest_floor,
+                                       const char *const highest_floor);
+int lock_shared_memory(car_shared_mem *mem);
+int wait_shared_memory(car_shared_mem *mem, const struct timespec *deadline);
 car_shared_mem *open_shared_memory(const char *const car_name);
 void cleanup_shared_memory(const char *const car_name);
+void release_shared_memory(const char *const car_name);
+
+unsigned int parse_car_features(const char *tokens);
+
+int parse_motion(const char *spec, motion_profile *out);
+double motion_run_time(const motion_profile *motion, double distance);
+double motion_time_at(const motion_profile *motion, double distance, double position);
+
+message_opcode tokenize_message(const char *message, message_tokens *tokens);
+int slice_copy(message_slice slice, char *out, size_t out_size);
+int slice_equals(message_slice slice, const char *text);
 
 int write_message(int fd, const char *const message);
 char *read_message(int fd);
@@ -22,7 +22,10 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    pthread_mutex_lock(&shm->mutex);
+    if (lock_shared_memory(shm) != 0) {
+        printf("Unable to access car %s.\n", car_name);
+        return 1;
+    }
 
     if (strcmp(operation, "open") == 0) {
         shm->open_button = 1;
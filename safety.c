@@ -238,7 +238,7 @@ int main(int argc, char *argv[]) {
 
     // Main monitoring loop - run until shutdown signal received
     while (!shutdown_requested) {
-        int mutex_result = pthread_mutex_lock(&shm->mutex);
+        int mutex_result = lock_shared_memory(shm);
         if (mutex_result != 0) {
             break;  // Can't acquire mutex, give up
         }
@@ -263,10 +263,13 @@ int main(int argc, char *argv[]) {
                 }
             }
 
-            pthread_cond_timedwait(&shm->cond, &shm->mutex, &timeout);
+            mutex_result = wait_shared_memory(shm, &timeout);
         } else {
             // clock_gettime failed, fall back to regular wait
-            pthread_cond_wait(&shm->cond, &shm->mutex);
+            mutex_result = wait_shared_memory(shm, NULL);
+        }
+        if (mutex_result != 0) {
+            break;  // Mutex is unrecoverable and no longer held
         }
 
         // Perform all safety checks and enforce failsafes
@@ -0,0 +1,120 @@
+#include "elevator.h"
+
+// Benchmark for the protocol tokenizer: messages/sec on one core, against
+// the strncmp/sscanf parsing it replaced
+
+#define ROUNDS 2000000
+
+static const char *const messages[] = {
+    "STATUS Between 7 9",
+    "STATUS Opening B12 B12",
+    "CALL 3 17",
+    "CAR Alpha B4 120 HEARTBEAT",
+    "FLOOR 42",
+    "PONG",
+    "EMERGENCY",
+    "INDIVIDUAL SERVICE",
+};
+#define MESSAGE_COUNT (sizeof(messages) / sizeof(messages[0]))
+
+static volatile int sink;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_legacy(const char *message) {
+    char a[32], b[8], c[8];
+    if (strncmp(message, "STATUS ", 7) == 0) {
+        if (sscanf(message, "STATUS %7s %3s %3s", a, b, c) == 3) {
+            return parse_floor(b).numeric + parse_floor(c).numeric;
+        }
+    } else if (strncmp(message, "CALL ", 5) == 0) {
+        if (sscanf(message, "CALL %3s %3s", b, c) == 2) {
+            return parse_floor(b).numeric + parse_floor(c).numeric;
+        }
+    } else if (strncmp(message, "CAR ", 4) == 0) {
+        int consumed = 0;
+        if (sscanf(message, "CAR %31s %3s %3s%n", a, b, c, &consumed) == 3) {
+            return (int)parse_car_features(message + consumed) + parse_floor(b).numeric;
+        }
+    } else if (strncmp(message, "FLOOR ", 6) == 0) {
+        return parse_floor(message + 6).numeric;
+    } else if (strcmp(message, "PONG") == 0) {
+        return 1;
+    } else if (strcmp(message, "EMERGENCY") == 0 || strcmp(message, "INDIVIDUAL SERVICE") == 0) {
+        return 2;
+    }
+    return 0;
+}
+
+static int parse_tokenized(const char *message) {
+    message_tokens tokens;
+    int a = 0, b = 0;
+    switch (tokenize_message(message, &tokens)) {
+    case MSG_STATUS:
+        if (tokens.field_count == 3 &&
+            decode_floor(tokens.fields[1].ptr, tokens.fields[1].len, &a) == 0 &&
+            decode_floor(tokens.fields[2].ptr, tokens.fields[2].len, &b) == 0) {
+            return a + b;
+        }
+        break;
+    case MSG_CALL:
+        if (tokens.field_count == 2 &&
+            decode_floor(tokens.fields[0].ptr, tokens.fields[0].len, &a) == 0 &&
+            decode_floor(tokens.fields[1].ptr, tokens.fields[1].len, &b) == 0) {
+            return a + b;
+        }
+        break;
+    case MSG_CAR:
+        if (tokens.field_count >= 3 &&
+            decode_floor(tokens.fields[1].ptr, tokens.fields[1].len, &a) == 0) {
+            return (int)(tokens.field_count > 3 ? parse_car_features(tokens.fields[3].ptr) : 0) + a;
+        }
+        break;
+    case MSG_FLOOR:
+        if (tokens.field_count == 1 && decode_floor(tokens.fields[0].ptr, tokens.fields[0].len, &a) == 0) {
+            return a;
+        }
+        break;
+    case MSG_PONG:
+        return 1;
+    case MSG_EMERGENCY:
+    case MSG_INDIVIDUAL_SERVICE:
+        return 2;
+    default:
+        break;
+    }
+    return 0;
+}
+
+static double run(const char *label, int (*parse)(const char *)) {
+    int total = 0;
+    double start = now_seconds();
+    for (int round = 0; round < ROUNDS; round++) {
+        total += parse(messages[round % MESSAGE_COUNT]);
+    }
+    double elapsed = now_seconds() - start;
+    sink = total;
+
+    double rate = ROUNDS / elapsed;
+    printf("%-10s %10.0f messages/sec (%.1f ns/message)\n", label, rate, 1e9 / rate);
+    return rate;
+}
+
+int main(void) {
+    // Both parsers must agree before their speed means anything
+    for (size_t i = 0; i < MESSAGE_COUNT; i++) {
+        if (parse_legacy(messages[i]) != parse_tokenized(messages[i])) {
+            fprintf(stderr, "Parsers disagree on \"%s\"\n", messages[i]);
+            return 1;
+        }
+    }
+
+    double legacy = run("sscanf", parse_legacy);
+    double tokenized = run("tokenizer", parse_tokenized);
+    printf("Speedup: %.1fx\n", tokenized / legacy);
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for CANCEL (call ids, cancelled stops and call --cancel) and
+// VACANT no-show detection on both sides
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(void);
+pid_t car(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void recv_until(int, const char *);
+void cleanup(pid_t);
+void server_init();
+void *simulate_heartbeat(void *);
+
+static car_shared_mem *shm;
+
+int server_fd;
+pthread_t heartbeat_tid;
+int heartbeat_cancel = 0;
+
+int main()
+{
+  pid_t p = controller();
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10 VACANT");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+
+  // Asking for an id gets one back with the car
+  test_call("CALL 5 8 ID", "CAR Alpha 1");
+  test_recv(alpha, "RECV: FLOOR 5");
+  test_call("CALL 3 4 ID", "CAR Alpha 2");
+  test_recv(alpha, "RECV: FLOOR 3");
+
+  // Alpha has set off for 3, so cancelling that call stops it at the next
+  // floor on the way before it carries on to 5
+  send_message(alpha, "STATUS Between 1 3");
+  usleep(DELAY);
+  test_call("CANCEL 2", "CANCELLED 2");
+  test_recv(alpha, "RECV: FLOOR 2");
+  test_recv(alpha, "RECV: FLOOR 5");
+
+  // A call that's gone, or never was, can't be cancelled
+  test_call("CANCEL 2", "UNAVAILABLE");
+  test_call("CANCEL 99", "UNAVAILABLE");
+  test_call("CANCEL x", "UNAVAILABLE");
+
+  // Nobody else needs 5 or 8, so both go
+  send_message(alpha, "STATUS Opening 2 2");
+  usleep(DELAY);
+  test_call("CALL 6 9 ID", "CAR Alpha 3");
+  msg("Call 1 cancelled.");
+  fflush(stdout);
+  system("./call --cancel 1");
+  test_recv(alpha, "RECV: FLOOR 6");
+
+  // Alpha has picked someone up at 6 for 9, but nobody comes
+  // through the doors at 7, so the stop at 8 goes
+  send_message(alpha, "STATUS Opening 6 6");
+  test_recv(alpha, "RECV: FLOOR 9");
+  send_message(alpha, "STATUS Closed 6 6");
+  usleep(DELAY);
+  test_call("CALL 7 8 ID", "CAR Alpha 4");
+  test_recv(alpha, "RECV: FLOOR 7");
+  send_message(alpha, "STATUS Opening 7 7");
+  test_recv(alpha, "RECV: FLOOR 8");
+  send_message(alpha, "STATUS Closed 7 7");
+  send_message(alpha, "VACANT 7");
+  test_recv(alpha, "RECV: FLOOR 9");
+  test_call("CANCEL 4", "UNAVAILABLE");
+
+  close(alpha);
+  cleanup(p);
+
+  // A car with --vacant reports a door cycle nobody used
+  shm_unlink("/carTest");
+  server_init();
+  p = car();
+  int fd = accept(server_fd, NULL, NULL);
+  test_recv(fd, "RECV: CAR Test 1 6 VACANT");
+  test_recv(fd, "RECV: STATUS Closed 1 1");
+  send_message(fd, "FLOOR 3");
+  recv_until(fd, "STATUS Closed 3 3");
+  test_recv(fd, "RECV: VACANT 3");
+
+  // A press of a door button counts as someone there
+  send_message(fd, "FLOOR 4");
+  recv_until(fd, "STATUS Open 4 4");
+  pthread_mutex_lock(&shm->mutex);
+  shm->open_button = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_mutex_unlock(&shm->mutex);
+  recv_until(fd, "STATUS Closed 4 4");
+  send_message(fd, "FLOOR 5");
+  test_recv(fd, "RECV: STATUS Between 4 5");
+
+  heartbeat_cancel = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_join(heartbeat_tid, NULL);
+  munmap(shm, sizeof(car_shared_mem));
+  close(fd);
+  close(server_fd);
+  cleanup(p);
+  shm_unlink("/carTest");
+
+  printf("\nTests completed.\n");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+// Skip status updates until the expected one arrives
+void recv_until(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  while (strcmp(m, t) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(t);
+  printf("%s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow the process to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", NULL);
+  }
+
+  return pid;
+}
+
+pid_t car(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./car", "./car", "Test", "1", "6", "100", "--vacant", NULL);
+  }
+  usleep(DELAY);
+  int shm_fd = shm_open("/carTest", O_RDWR, 0666);
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  pthread_create(&heartbeat_tid, NULL, simulate_heartbeat, NULL);
+
+  return pid;
+}
+
+void server_init()
+{
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(3000);
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt_enable = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable));
+  if (bind(server_fd, (const struct sockaddr *)&a, sizeof(a)) == -1) {
+    perror("bind()");
+    exit(1);
+  }
+
+  listen(server_fd, 10);
+}
+
+void *simulate_heartbeat(void *_)
+{
+  pthread_mutex_lock(&shm->mutex);
+  for (;;) {
+
+    if (shm->safety_system != 1) {
+      shm->safety_system = 1;
+      pthread_cond_broadcast(&shm->cond);
+    }
+    pthread_cond_wait(&shm->cond, &shm->mutex);
+    if (heartbeat_cancel) break;
+  }
+  pthread_mutex_unlock(&shm->mutex);
+  return NULL;
+}
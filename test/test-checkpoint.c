@@ -0,0 +1,126 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for controller --checkpoint (warm restart after a crash)
+
+#define DELAY 50000 // 50ms
+#define CHECKPOINT "/tmp/test-checkpoint"
+
+pid_t controller(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void crash(pid_t);
+void cleanup(pid_t);
+
+int main()
+{
+  unlink(CHECKPOINT);
+
+  pid_t p = controller();
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 6");
+  send_message(alpha, "STATUS Closed 1 1");
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 6");
+  send_message(beta, "STATUS Closed 6 6");
+  usleep(DELAY);
+
+  // Give each car a call, so both checkpoint slots are written
+  test_call("CALL 2 4", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 2");
+  test_call("CALL 5 3", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 5");
+  send_message(alpha, "STATUS Between 1 2");
+  send_message(alpha, "STATUS Opening 2 2");
+  test_recv(alpha, "RECV: FLOOR 4");
+  usleep(DELAY);
+
+  // Kill the controller without giving it a chance to clean up
+  crash(p);
+  close(alpha);
+  close(beta);
+
+  p = controller();
+  usleep(DELAY);
+
+  // Each car gets its next stop as soon as it registers again
+  beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 6");
+  test_recv(beta, "RECV: FLOOR 5");
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 6");
+  test_recv(alpha, "RECV: FLOOR 4");
+
+  send_message(beta, "STATUS Between 6 5");
+  send_message(beta, "STATUS Opening 5 5");
+  test_recv(beta, "RECV: FLOOR 3");
+
+  cleanup(p);
+  close(alpha);
+  close(beta);
+  unlink(CHECKPOINT);
+
+  printf("\nTests completed.\n");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void crash(pid_t p)
+{
+  kill(p, SIGKILL);
+  waitpid(p, NULL, 0);
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--checkpoint", CHECKPOINT, NULL);
+  }
+
+  return pid;
+}
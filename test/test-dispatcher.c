@@ -0,0 +1,136 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for the dispatcher thread (controller --dispatcher-cpu, many
+// clients and cars talking to it at once)
+
+#define DELAY 50000 // 50ms
+#define CARS 4
+#define CALLERS 8
+#define CALLS_PER_CALLER 25
+
+pid_t controller(void);
+int connect_to_controller(void);
+void test_recv(int, const char *);
+void *caller(void *);
+void *drain(void *);
+void cleanup(pid_t);
+
+int answered = 0;
+int unanswered = 0;
+pthread_mutex_t count_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int main()
+{
+  pid_t p = controller();
+  usleep(DELAY);
+
+  // Every car sits at a different floor and reads whatever it is sent
+  int cars[CARS];
+  pthread_t drainers[CARS];
+  for (int i = 0; i < CARS; i++) {
+    char buf[64];
+    cars[i] = connect_to_controller();
+    snprintf(buf, sizeof(buf), "CAR Car%d 1 10", i);
+    send_message(cars[i], buf);
+    snprintf(buf, sizeof(buf), "STATUS Closed %d %d", i * 3 + 1, i * 3 + 1);
+    send_message(cars[i], buf);
+  }
+  usleep(DELAY);
+  for (int i = 0; i < CARS; i++) {
+    pthread_create(&drainers[i], NULL, drain, &cars[i]);
+  }
+
+  // Callers all at once, while the cars keep reporting in
+  pthread_t callers[CALLERS];
+  for (int i = 0; i < CALLERS; i++) {
+    pthread_create(&callers[i], NULL, caller, NULL);
+  }
+  for (int n = 0; n < CALLS_PER_CALLER; n++) {
+    for (int i = 0; i < CARS; i++) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "STATUS Closed %d %d", i * 3 + 1, i * 3 + 1);
+      send_message(cars[i], buf);
+    }
+  }
+  for (int i = 0; i < CALLERS; i++) {
+    pthread_join(callers[i], NULL);
+  }
+
+  msg("Calls answered: 200, unanswered: 0");
+  printf("Calls answered: %d, unanswered: %d\n", answered, unanswered);
+
+  for (int i = 0; i < CARS; i++) {
+    shutdown(cars[i], SHUT_RDWR);
+  }
+  cleanup(p);
+  for (int i = 0; i < CARS; i++) {
+    pthread_join(drainers[i], NULL);
+    close(cars[i]);
+  }
+  printf("\nTests completed.\n");
+}
+
+void *caller(void *_)
+{
+  for (int n = 0; n < CALLS_PER_CALLER; n++) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "CALL %d %d", n % 10 + 1, (n + 5) % 10 + 1);
+    int fd = connect_to_controller();
+    send_message(fd, buf);
+    char *reply = receive_msg(fd);
+    pthread_mutex_lock(&count_mutex);
+    if (strncmp(reply, "CAR Car", 7) == 0) {
+      answered++;
+    } else {
+      unanswered++;
+    }
+    pthread_mutex_unlock(&count_mutex);
+    free(reply);
+    close(fd);
+  }
+  return NULL;
+}
+
+// Read and discard FLOOR messages until the connection goes away
+void *drain(void *arg)
+{
+  int fd = *(int *)arg;
+  char buf[256];
+  while (read(fd, buf, sizeof(buf)) > 0);
+  return NULL;
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--dispatcher-cpu", "0", NULL);
+  }
+
+  return pid;
+}
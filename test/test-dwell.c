@@ -0,0 +1,254 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for DWELL hints (what the controller sends, and how long a car
+// with --dwell holds its doors for each)
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(const char *);
+pid_t car(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void recv_until(int, const char *);
+void test_dwell(int, const char *, const char *, const char *);
+void cleanup(pid_t);
+void server_init();
+void *simulate_heartbeat(void *);
+
+static car_shared_mem *shm;
+
+int server_fd;
+pthread_t heartbeat_tid;
+int heartbeat_cancel = 0;
+
+int main()
+{
+  pid_t p = controller("0");
+  usleep(DELAY);
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10 DWELL");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+
+  // Someone gets on at 3, which needs the usual dwell, so there's no hint;
+  // they only get off at 6
+  test_call("CALL 3 6", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 3");
+  send_message(alpha, "STATUS Opening 3 3");
+  test_recv(alpha, "RECV: FLOOR 6");
+  send_message(alpha, "STATUS Opening 6 6");
+  test_recv(alpha, "RECV: DWELL SHORT");
+
+  // ... until someone calls the car while its doors are open there
+  test_call("CALL 6 2", "CAR Alpha");
+  test_recv(alpha, "RECV: DWELL NORMAL");
+  test_recv(alpha, "RECV: FLOOR 2");
+  close(alpha);
+  cleanup(p);
+
+  // In up-peak, a car parked at the lobby expects nobody until someone
+  // calls it there, and then a crowd
+  p = controller("20000");
+  usleep(DELAY);
+  for (int i = 0; i < 12; i++) {
+    char call[16];
+    snprintf(call, sizeof(call), "CALL 1 %d", 3 + i % 6);
+    int fd = connect_to_controller();
+    send_message(fd, call);
+    free(receive_msg(fd));
+    close(fd);
+  }
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10 DWELL");
+  send_message(alpha, "STATUS Closed 5 5");
+  test_recv(alpha, "RECV: FLOOR 1");
+  send_message(alpha, "STATUS Opening 1 1");
+  test_recv(alpha, "RECV: DWELL NONE");
+  test_call("CALL 1 4", "CAR Alpha");
+  test_recv(alpha, "RECV: DWELL LONG");
+  test_recv(alpha, "RECV: FLOOR 4");
+  close(alpha);
+  cleanup(p);
+
+  // The car holds its doors as told, for the stop they are open at
+  shm_unlink("/carTest");
+  server_init();
+  p = car();
+  int fd = accept(server_fd, NULL, NULL);
+  test_recv(fd, "RECV: CAR Test 1 6 DWELL");
+  test_recv(fd, "RECV: STATUS Closed 1 1");
+  test_dwell(fd, "FLOOR 2", "DWELL NONE", "none");
+  test_dwell(fd, "FLOOR 3", "DWELL SHORT", "short");
+  test_dwell(fd, "FLOOR 4", "DWELL LONG", "long");
+  test_dwell(fd, "FLOOR 5", NULL, "usual");
+
+  // A hint that comes once the doors are closing is dropped
+  send_message(fd, "DWELL NONE");
+  test_dwell(fd, "FLOOR 6", NULL, "usual");
+
+  heartbeat_cancel = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_join(heartbeat_tid, NULL);
+  munmap(shm, sizeof(car_shared_mem));
+  close(fd);
+  close(server_fd);
+  cleanup(p);
+  shm_unlink("/carTest");
+
+  printf("\nTests completed.\n");
+}
+
+// Send the car to a floor, give it a hint (if any) as its doors open there,
+// and time how long they take to start closing again. Opening takes the
+// car's delay of 300ms, and a door cycle is too short for every status to
+// be sent, so the Open in between isn't waited for.
+void test_dwell(int fd, const char *floor, const char *hint, const char *expected)
+{
+  char opening[32];
+  snprintf(opening, sizeof(opening), "STATUS Opening %s ", floor + 6);
+
+  send_message(fd, floor);
+  char *m = receive_msg(fd);
+  while (strncmp(m, opening, strlen(opening)) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  free(m);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (hint) send_message(fd, hint);
+
+  m = receive_msg(fd);
+  while (strncmp(m, "STATUS Clos", 11) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  free(m);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long held_ms = (end.tv_sec - start.tv_sec) * 1000L + (end.tv_nsec - start.tv_nsec) / 1000000L - 300;
+
+  const char *held = held_ms < 75 ? "none" : held_ms < 225 ? "short" : held_ms < 450 ? "usual" : "long";
+  char line[32];
+  snprintf(line, sizeof(line), "Doors held: %s", expected);
+  msg(line);
+  printf("Doors held: %s\n", held);
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+// Skip status updates until the expected one arrives
+void recv_until(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  while (strcmp(m, t) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(t);
+  printf("%s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow the process to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(const char *window_ms)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--traffic-window", window_ms, NULL);
+  }
+
+  return pid;
+}
+
+pid_t car(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./car", "./car", "Test", "1", "6", "300", "--dwell", NULL);
+  }
+  usleep(DELAY);
+  int shm_fd = shm_open("/carTest", O_RDWR, 0666);
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  pthread_create(&heartbeat_tid, NULL, simulate_heartbeat, NULL);
+
+  return pid;
+}
+
+void server_init()
+{
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(3000);
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt_enable = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable));
+  if (bind(server_fd, (const struct sockaddr *)&a, sizeof(a)) == -1) {
+    perror("bind()");
+    exit(1);
+  }
+
+  listen(server_fd, 10);
+}
+
+void *simulate_heartbeat(void *_)
+{
+  pthread_mutex_lock(&shm->mutex);
+  for (;;) {
+
+    if (shm->safety_system != 1) {
+      shm->safety_system = 1;
+      pthread_cond_broadcast(&shm->cond);
+    }
+    pthread_cond_wait(&shm->cond, &shm->mutex);
+    if (heartbeat_cancel) break;
+  }
+  pthread_mutex_unlock(&shm->mutex);
+  return NULL;
+}
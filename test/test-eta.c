@@ -0,0 +1,167 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for ETA in the CALL reply and WATCH updates (and call --eta/--watch)
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+int test_watch(const char *, const char *);
+void test_update(int, const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  pid_t p = controller();
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+
+  // Nothing has been timed yet, so there's no estimate to give
+  test_call("CALL 5 8 ETA", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 5");
+
+  // Once Alpha has been seen passing floors there is, after the id
+  send_message(alpha, "STATUS Between 1 5");
+  usleep(2 * DELAY);
+  send_message(alpha, "STATUS Between 2 5");
+  usleep(2 * DELAY);
+  send_message(alpha, "STATUS Between 3 5");
+  usleep(2 * DELAY);
+  test_call("CALL 6 8 ETA", "CAR Alpha ETA <ms>");
+  test_call("CALL 6 8 ID ETA", "CAR Alpha 3 ETA <ms>");
+
+  // A watched call gets an estimate straight away and ends with the car
+  // opening its doors at the pickup
+  int watch = test_watch("CALL 7 9 ID WATCH", "CAR Alpha 4 ETA <ms>");
+  send_message(alpha, "STATUS Between 4 5");
+  send_message(alpha, "STATUS Opening 5 5");
+  send_message(alpha, "STATUS Between 5 6");
+  send_message(alpha, "STATUS Opening 6 6");
+  send_message(alpha, "STATUS Between 6 7");
+  send_message(alpha, "STATUS Opening 7 7");
+  test_update(watch, "ARRIVED");
+  close(watch);
+
+  // ... or with the call being cancelled
+  watch = test_watch("CALL 2 1 ID WATCH", "CAR Alpha 5 ETA <ms>");
+  test_call("CANCEL 5", "CANCELLED 5");
+  test_update(watch, "CANCELLED 5");
+  close(watch);
+
+  // ... or with its car leaving service
+  watch = test_watch("CALL 2 1 ID WATCH", "CAR Alpha 6 ETA <ms>");
+  send_message(alpha, "INDIVIDUAL SERVICE");
+  test_update(watch, "UNAVAILABLE");
+  close(watch);
+  close(alpha);
+
+  // The call point follows a watched call through to the end
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 7 7");
+  usleep(DELAY);
+  fflush(stdout);
+  FILE *out = popen("./call 4 2 --watch", "r");
+  test_recv(alpha, "RECV: FLOOR 4");
+  send_message(alpha, "STATUS Between 7 4");
+  send_message(alpha, "STATUS Opening 4 4");
+  char line[128], last[128] = "";
+  while (fgets(line, sizeof(line), out) != NULL) {
+    if (strncmp(line, "Now arriving", 12) != 0) strcpy(last, line);
+  }
+  pclose(out);
+  msg("Your car has arrived.");
+  printf("%s", last);
+
+  close(alpha);
+  cleanup(p);
+  printf("\nTests completed.\n");
+}
+
+// Like test_call, but the estimate in the reply is shown as <ms>, and the
+// connection is handed back for the updates that follow
+int test_watch(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  char *eta = strstr(reply, " ETA ");
+  if (eta && atoi(eta + 5) > 0) strcpy(eta + 5, "<ms>");
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  return fd;
+}
+
+// Skip countdown updates until the stream ends, which closes it
+void test_update(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  while (strncmp(m, "ETA ", 4) == 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(t);
+  printf("%s\n", m);
+  free(m);
+
+  char buf[64];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0);
+  msg("Connection closed");
+  printf("%s\n", n == 0 ? "Connection closed" : "read() failed");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  close(test_watch(sendmsg, expectedreply));
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", NULL);
+  }
+
+  return pid;
+}
@@ -0,0 +1,195 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for car --express (position reports every few floors on a run)
+
+#define DELAY 50000 // 50ms
+
+pid_t car(void);
+void test_recv(int, const char *);
+void recv_until(int, const char *);
+void recv_open(int, const char *);
+void test_run(int, const char *, const char *);
+void cleanup(pid_t);
+void server_init();
+void *simulate_heartbeat(void *);
+
+static car_shared_mem *shm;
+
+int server_fd;
+pthread_t heartbeat_tid;
+int heartbeat_cancel = 0;
+
+int main()
+{
+  shm_unlink("/carTest");
+  server_init();
+  pid_t p = car();
+  int fd = accept(server_fd, NULL, NULL);
+  test_recv(fd, "RECV: CAR Test 1 30");
+  test_recv(fd, "RECV: STATUS Closed 1 1");
+
+  // The car reports where it is every 4 floors on the way, then as it
+  // arrives
+  test_run(fd, "FLOOR 20", "Between 1 5 9 13 17, Opening 20");
+  recv_until(fd, "STATUS Closed 20 20");
+
+  // A new destination mid-run is reported straight away, then the floor
+  // the car has really got to rather than the last one it reported
+  send_message(fd, "FLOOR 2");
+  recv_until(fd, "STATUS Between 16 2");
+  usleep(2 * DELAY);
+  send_message(fd, "FLOOR 12");
+  test_recv(fd, "RECV: STATUS Between 16 12");
+  {
+    char *m = receive_msg(fd);
+    int at = 0;
+    char dest[8] = "";
+    sscanf(m, "STATUS Between %d %7s", &at, dest);
+    msg("STATUS Between (13 to 15) 12");
+    printf("STATUS Between (%s) %s\n", at >= 13 && at <= 15 ? "13 to 15" : "elsewhere", dest);
+    free(m);
+  }
+  recv_open(fd, "12");
+  recv_until(fd, "STATUS Closed 12 12");
+
+  // SIGINT stops the car mid-run without waiting for it to arrive
+  send_message(fd, "FLOOR 30");
+  recv_until(fd, "STATUS Between 16 30");
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  cleanup(p);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long exit_ms = (end.tv_sec - start.tv_sec) * 1000L + (end.tv_nsec - start.tv_nsec) / 1000000L;
+  msg("Exited promptly");
+  printf("%s\n", exit_ms < 300 ? "Exited promptly" : "Exited late");
+
+  heartbeat_cancel = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_join(heartbeat_tid, NULL);
+  munmap(shm, sizeof(car_shared_mem));
+  close(fd);
+  close(server_fd);
+  shm_unlink("/carTest");
+
+  printf("\nTests completed.\n");
+}
+
+// Send the car on a run and list the floors of the statuses on the way
+void test_run(int fd, const char *floor, const char *expected)
+{
+  char seen[128] = "Between";
+  send_message(fd, floor);
+  char *m = receive_msg(fd);
+  while (strncmp(m, "STATUS Between ", 15) == 0) {
+    int at;
+    if (sscanf(m, "STATUS Between %d", &at) == 1) {
+      snprintf(seen + strlen(seen), sizeof(seen) - strlen(seen), " %d", at);
+    }
+    free(m);
+    m = receive_msg(fd);
+  }
+  // A brief Opening may be reported as Open instead
+  int at = 0;
+  sscanf(m, "STATUS %*s %d", &at);
+  snprintf(seen + strlen(seen), sizeof(seen) - strlen(seen), ", Opening %d", at);
+  free(m);
+  msg(expected);
+  printf("%s\n", seen);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+// Skip status updates until the expected one arrives
+void recv_until(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  while (strcmp(m, t) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(t);
+  printf("%s\n", m);
+  free(m);
+}
+
+// Skip status updates until the doors open at floor. A brief Opening may
+// be reported as Open instead.
+void recv_open(int fd, const char *floor)
+{
+  char opening[32], open[32];
+  snprintf(opening, sizeof(opening), "STATUS Opening %s %s", floor, floor);
+  snprintf(open, sizeof(open), "STATUS Open %s %s", floor, floor);
+  char *m = receive_msg(fd);
+  while (strcmp(m, opening) != 0 && strcmp(m, open) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(opening);
+  printf("%s\n", opening);
+  free(m);
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow the process to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t car(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./car", "./car", "Test", "1", "30", "50", "--express", "4", NULL);
+  }
+  usleep(DELAY);
+  int shm_fd = shm_open("/carTest", O_RDWR, 0666);
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  pthread_create(&heartbeat_tid, NULL, simulate_heartbeat, NULL);
+
+  return pid;
+}
+
+void server_init()
+{
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(3000);
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt_enable = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable));
+  if (bind(server_fd, (const struct sockaddr *)&a, sizeof(a)) == -1) {
+    perror("bind()");
+    exit(1);
+  }
+
+  listen(server_fd, 10);
+}
+
+void *simulate_heartbeat(void *_)
+{
+  pthread_mutex_lock(&shm->mutex);
+  for (;;) {
+
+    if (shm->safety_system != 1) {
+      shm->safety_system = 1;
+      pthread_cond_broadcast(&shm->cond);
+    }
+    pthread_cond_wait(&shm->cond, &shm->mutex);
+    if (heartbeat_cancel) break;
+  }
+  pthread_mutex_unlock(&shm->mutex);
+  return NULL;
+}
@@ -0,0 +1,160 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for hall call coalescing (a call joins a pickup that's already
+// on its way to the same floor in the same direction)
+
+#define DELAY 50000 // 50ms
+#define HOLD 2500000 // A little over the 2s a call stays put after it's placed
+
+pid_t controller(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  pid_t p = controller();
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 8");
+  send_message(beta, "STATUS Closed 6 6");
+  usleep(DELAY);
+
+  test_call("CALL 5 8", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 5");
+
+  // Alpha ends up closer, but someone else going up from 5 joins the
+  // pickup Beta is already making
+  send_message(alpha, "STATUS Closed 5 5");
+  usleep(DELAY);
+  test_call("CALL 5 7", "CAR Beta");
+
+  // Beta can't go to 10, so that call gets a car of its own
+  test_call("CALL 5 10", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 5");
+
+  // Going down is a different button, so it doesn't join either pickup
+  // going up; Alpha is at 5 already
+  send_message(alpha, "STATUS Opening 5 5");
+  test_recv(alpha, "RECV: FLOOR 10");
+  test_call("CALL 5 2", "CAR Alpha");
+
+  // Alpha stopping at 5 only collects its own passengers; Beta is still
+  // coming for the rest going up
+  usleep(DELAY);
+  test_call("CALL 5 6", "CAR Beta");
+
+  // Beta picks everyone up and drops the riders going up first
+  send_message(beta, "STATUS Between 6 5");
+  send_message(beta, "STATUS Opening 5 5");
+  test_recv(beta, "RECV: FLOOR 6");
+
+  // Once Beta has been, the next call up from 5 is dispatched afresh
+  // rather than joining Beta
+  usleep(DELAY);
+  test_call("CALL 5 6", "CAR Alpha");
+
+  close(alpha);
+  close(beta);
+  cleanup(p);
+
+  // Beta and Alpha both hold the pickup going up from 5. Beta holds its
+  // doors open instead of going, so its passengers move to Gamma; Alpha
+  // is already pulling in and keeps its own.
+  p = controller();
+  usleep(DELAY);
+
+  beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 8");
+  send_message(beta, "STATUS Closed 4 4");
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 9 9");
+  usleep(DELAY);
+
+  test_call("CALL 5 8", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 5");
+  test_call("CALL 5 10", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 5");
+  send_message(alpha, "STATUS Between 9 5");
+  send_message(beta, "STATUS Opening 4 5");
+  usleep(DELAY);
+  send_message(beta, "STATUS Open 4 5");
+
+  int gamma = connect_to_controller();
+  send_message(gamma, "CAR Gamma 1 10");
+  send_message(gamma, "STATUS Closed 5 5");
+  usleep(HOLD);
+  test_recv(gamma, "RECV: FLOOR 5");
+  send_message(gamma, "STATUS Opening 5 5");
+  test_recv(gamma, "RECV: FLOOR 8");
+
+  // Gamma has been, but Alpha is still on its way
+  usleep(DELAY);
+  test_call("CALL 5 7", "CAR Alpha");
+
+  close(alpha);
+  close(beta);
+  close(gamma);
+  cleanup(p);
+  printf("\nTests completed.\n");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", NULL);
+  }
+
+  return pid;
+}
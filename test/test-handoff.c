@@ -0,0 +1,133 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for controller --handoff / --takeover (upgrade without dropping cars)
+
+#define DELAY 50000 // 50ms
+#define HANDOFF "/tmp/test-handoff"
+
+pid_t controller(const char *, const char *);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void test_exit(pid_t, const char *, const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  unlink(HANDOFF);
+
+  pid_t old = controller("--handoff", HANDOFF);
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 4");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+  test_call("CALL 2 4", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 2");
+
+  // The new controller takes over the car's connection and its stops
+  pid_t new = controller("--takeover", HANDOFF);
+  test_exit(old, "Old", "Old controller exited with status 0");
+
+  send_message(alpha, "STATUS Between 1 2");
+  send_message(alpha, "STATUS Opening 2 2");
+  test_recv(alpha, "RECV: FLOOR 4");
+  test_call("CALL 1 3", "CAR Alpha");
+
+  cleanup(new);
+  close(alpha);
+  unlink(HANDOFF);
+
+  // A car stuck halfway through a frame can't be quiesced, so the
+  // handoff is abandoned and the old controller carries on
+  old = controller("--handoff", HANDOFF);
+  usleep(DELAY);
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 4");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+  uint16_t len = htons(16);
+  send_looped(alpha, &len, sizeof(len));
+
+  new = controller("--takeover", HANDOFF);
+  test_exit(new, "New", "New controller exited with status 1");
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 4");
+  send_message(beta, "STATUS Closed 3 3");
+  usleep(DELAY);
+  test_call("CALL 3 4", "CAR Beta");
+
+  cleanup(old);
+  close(alpha);
+  close(beta);
+  unlink(HANDOFF);
+
+  printf("\nTests completed.\n");
+}
+
+void test_exit(pid_t p, const char *who, const char *expected)
+{
+  int status;
+  waitpid(p, &status, 0);
+  msg(expected);
+  if (WIFEXITED(status)) {
+    printf("%s controller exited with status %d\n", who, WEXITSTATUS(status));
+  } else {
+    printf("%s controller was killed by signal %d\n", who, WTERMSIG(status));
+  }
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(const char *flag, const char *path)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", flag, path, NULL);
+  }
+
+  return pid;
+}
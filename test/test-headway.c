@@ -0,0 +1,191 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for headway control (zone parking, the bunching figure in STATS
+// and --headway-bias)
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(const char *);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void test_bunched(const char *);
+void place_calls(const char *);
+void start(int *, int *, const char *, const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  // Alpha has been idle for a while in the same zone as Beta, so it goes
+  // to wait in the middle of the other one
+  pid_t p = controller("0");
+  int alpha, beta;
+  start(&alpha, &beta, "STATUS Closed 2 2", NULL);
+  usleep(30 * DELAY);
+  send_message(beta, "STATUS Closed 2 2");
+  test_recv(alpha, "RECV: FLOOR 8");
+  close(alpha);
+  close(beta);
+  cleanup(p);
+
+  // Alpha is close behind Beta on the way up, and the call ahead of them
+  // goes to Beta, which gets there first
+  p = controller("0");
+  start(&alpha, &beta, "STATUS Closed 1 1", "STATUS Closed 4 4");
+  test_call("CALL 1 10", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 1");
+  send_message(alpha, "STATUS Opening 1 1");
+  test_recv(alpha, "RECV: FLOOR 10");
+  test_call("CALL 4 9", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 4");
+  send_message(beta, "STATUS Opening 4 4");
+  test_recv(beta, "RECV: FLOOR 9");
+  send_message(alpha, "STATUS Between 3 10");
+  send_message(beta, "STATUS Between 4 9");
+  usleep(DELAY);
+  test_call("CALL 7 8", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 7");
+  usleep(25 * DELAY);
+  test_bunched("Bunched: 100%");
+  close(alpha);
+  close(beta);
+  cleanup(p);
+
+  // With a bias, Alpha takes it, so Beta can pull away
+  p = controller("5");
+  start(&alpha, &beta, "STATUS Closed 1 1", "STATUS Closed 4 4");
+  test_call("CALL 1 10", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 1");
+  send_message(alpha, "STATUS Opening 1 1");
+  test_recv(alpha, "RECV: FLOOR 10");
+  test_call("CALL 4 9", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 4");
+  send_message(beta, "STATUS Opening 4 4");
+  test_recv(beta, "RECV: FLOOR 9");
+  send_message(alpha, "STATUS Between 3 10");
+  send_message(beta, "STATUS Between 4 9");
+  usleep(DELAY);
+  test_call("CALL 7 8", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 7");
+  close(alpha);
+  close(beta);
+  cleanup(p);
+
+  // Cars going opposite ways aren't bunched, however near they are
+  p = controller("0");
+  start(&alpha, &beta, "STATUS Closed 1 1", "STATUS Closed 9 9");
+  test_call("CALL 1 10", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 1");
+  send_message(alpha, "STATUS Opening 1 1");
+  test_recv(alpha, "RECV: FLOOR 10");
+  test_call("CALL 9 2", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 9");
+  send_message(beta, "STATUS Opening 9 9");
+  test_recv(beta, "RECV: FLOOR 2");
+  send_message(alpha, "STATUS Between 4 10");
+  send_message(beta, "STATUS Between 5 2");
+  usleep(25 * DELAY);
+  test_bunched("Bunched: 0%");
+  close(alpha);
+  close(beta);
+  cleanup(p);
+
+  printf("\nTests completed.\n");
+}
+
+// Fill the traffic window with calls between floors, so cars are dispatched
+// and parked as in busy traffic, then register Alpha and Beta. Beta's first
+// status can be left for later, which keeps it from being idle yet.
+void start(int *alpha, int *beta, const char *alpha_status, const char *beta_status)
+{
+  usleep(DELAY);
+  place_calls("CALL %d 9");
+  *alpha = connect_to_controller();
+  send_message(*alpha, "CAR Alpha 1 10");
+  send_message(*alpha, alpha_status);
+  *beta = connect_to_controller();
+  send_message(*beta, "CAR Beta 1 10");
+  if (beta_status) send_message(*beta, beta_status);
+  usleep(DELAY);
+}
+
+// Twelve calls from floors 3 to 8, enough to tell the traffic apart
+void place_calls(const char *fmt)
+{
+  for (int i = 0; i < 12; i++) {
+    char call[32];
+    snprintf(call, sizeof(call), fmt, 3 + i % 6);
+    int fd = connect_to_controller();
+    send_message(fd, call);
+    free(receive_msg(fd));
+    close(fd);
+  }
+}
+
+// Only the share of time spent bunched; the other fields depend on timing
+void test_bunched(const char *expected)
+{
+  int fd = connect_to_controller();
+  send_message(fd, "STATS");
+  char *reply = receive_msg(fd);
+  unsigned bunched = 0;
+  sscanf(reply, "STATS %*u %*d %*d %*d %*d %*u %*u %*d %*d %*s %u", &bunched);
+  msg(expected);
+  printf("Bunched: %u%%\n", bunched);
+  free(reply);
+  close(fd);
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(const char *bias)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--traffic-window", "20000", "--headway-bias", bias, NULL);
+  }
+
+  return pid;
+}
@@ -0,0 +1,215 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for heartbeats (controller --heartbeat, car --heartbeat, PING/PONG)
+
+#define DELAY 50000 // 50ms
+#define HEARTBEAT "100"
+
+pid_t controller(void);
+pid_t car(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void recv_skipping(int, const char *, const char *);
+void test_closed(int, const char *);
+void cleanup(pid_t);
+void server_init();
+void *simulate_heartbeat(void *);
+
+static car_shared_mem *shm;
+
+int server_fd;
+pthread_t heartbeat_tid;
+int heartbeat_cancel = 0;
+
+int main()
+{
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  pid_t p = controller();
+  usleep(DELAY);
+
+  // A heartbeat car is pinged and answers
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 6 HEARTBEAT");
+  send_message(alpha, "STATUS Closed 1 1");
+  test_recv(alpha, "RECV: PING");
+  send_message(alpha, "PONG");
+
+  // A car without heartbeats is never pinged or written off
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 4");
+  send_message(beta, "STATUS Closed 4 4");
+
+  // Alpha stops answering. Once it misses its deadline, calls go to
+  // Beta even though Alpha is closer.
+  usleep(500000);
+  test_call("CALL 1 2", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 1");
+
+  // Alpha is back in service as soon as it's heard from again
+  send_message(alpha, "PONG");
+  usleep(DELAY);
+  test_call("CALL 5 6", "CAR Alpha");
+  recv_skipping(alpha, "PING", "RECV: FLOOR 5");
+
+  // A car that stalls halfway through a frame is disconnected
+  int gamma = connect_to_controller();
+  send_message(gamma, "CAR Gamma 1 4");
+  send_message(gamma, "STATUS Closed 2 2");
+  uint16_t len = htons(16);
+  send_looped(gamma, &len, sizeof(len));
+  test_closed(gamma, "Gamma disconnected");
+
+  close(alpha);
+  close(beta);
+  close(gamma);
+  cleanup(p);
+
+  // The car side answers PINGs
+  shm_unlink("/carTest");
+  server_init();
+  p = car();
+  int fd = accept(server_fd, NULL, NULL);
+  test_recv(fd, "RECV: CAR Test 1 4 HEARTBEAT");
+  send_message(fd, "PING");
+  recv_skipping(fd, "STATUS Closed 1 1", "RECV: PONG");
+
+  heartbeat_cancel = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_join(heartbeat_tid, NULL);
+  munmap(shm, sizeof(car_shared_mem));
+  close(fd);
+  close(server_fd);
+  cleanup(p);
+  shm_unlink("/carTest");
+
+  printf("\nTests completed.\n");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+// Like test_recv, but ignores any messages matching skip first
+void recv_skipping(int fd, const char *skip, const char *t)
+{
+  char *m = receive_msg(fd);
+  while (strcmp(m, skip) == 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+// Waits for the other end to close the connection
+void test_closed(int fd, const char *t)
+{
+  char buf[64];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0);
+  msg(t);
+  printf("%s\n", n == 0 ? t : "Still connected");
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow the process to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--heartbeat", HEARTBEAT, NULL);
+  }
+
+  return pid;
+}
+
+pid_t car(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./car", "./car", "Test", "1", "4", "20", "--heartbeat", NULL);
+  }
+  usleep(DELAY);
+  int shm_fd = shm_open("/carTest", O_RDWR, 0666);
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  pthread_create(&heartbeat_tid, NULL, simulate_heartbeat, NULL);
+
+  return pid;
+}
+
+void server_init()
+{
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(3000);
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt_enable = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable));
+  if (bind(server_fd, (const struct sockaddr *)&a, sizeof(a)) == -1) {
+    perror("bind()");
+    exit(1);
+  }
+
+  listen(server_fd, 10);
+}
+
+void *simulate_heartbeat(void *_)
+{
+  pthread_mutex_lock(&shm->mutex);
+  for (;;) {
+
+    if (shm->safety_system != 1) {
+      shm->safety_system = 1;
+      pthread_cond_broadcast(&shm->cond);
+    }
+    pthread_cond_wait(&shm->cond, &shm->mutex);
+    if (heartbeat_cancel) break;
+  }
+  pthread_mutex_unlock(&shm->mutex);
+  return NULL;
+}
@@ -0,0 +1,110 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for stop insertion (where a new call's pickup and drop-off go in
+// a car's route)
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  pid_t p = controller();
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+
+  test_call("CALL 5 8", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 5");
+
+  // A pickup on the way up goes in ahead of the existing one
+  test_call("CALL 3 6", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 3");
+
+  // A trip the other way waits until the sweep up is done
+  test_call("CALL 7 2", "CAR Alpha");
+
+  // A drop-off already in the route is shared, not repeated. The front
+  // stop doesn't change, so the car isn't sent anything.
+  test_call("CALL 4 8", "CAR Alpha");
+
+  // Stops in order: 3 4 5 6 8 on the way up, then 7 and 2 on the way
+  // down - the passenger at 7 isn't picked up while the car goes up
+  send_message(alpha, "STATUS Opening 3 3");
+  test_recv(alpha, "RECV: FLOOR 4");
+  send_message(alpha, "STATUS Opening 4 4");
+  test_recv(alpha, "RECV: FLOOR 5");
+  send_message(alpha, "STATUS Opening 5 5");
+  test_recv(alpha, "RECV: FLOOR 6");
+  send_message(alpha, "STATUS Opening 6 6");
+  test_recv(alpha, "RECV: FLOOR 8");
+  send_message(alpha, "STATUS Opening 8 8");
+  test_recv(alpha, "RECV: FLOOR 7");
+  send_message(alpha, "STATUS Opening 7 7");
+  test_recv(alpha, "RECV: FLOOR 2");
+
+  close(alpha);
+  cleanup(p);
+  printf("\nTests completed.\n");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", NULL);
+  }
+
+  return pid;
+}
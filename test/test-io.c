@@ -0,0 +1,125 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for controller --io epoll|uring (event-loop I/O backends). io_uring
+// falls back to epoll where the kernel doesn't offer it, so the expected
+// results are the same either way.
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(const char *);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void test_backend(const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  test_backend("epoll");
+  test_backend("uring");
+
+  printf("\nTests completed.\n");
+}
+
+void test_backend(const char *backend)
+{
+  pid_t p = controller(backend);
+  usleep(DELAY);
+
+  test_call("CALL 1 2", "UNAVAILABLE");
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha B1 4");
+  send_message(alpha, "STATUS Closed B1 B1");
+  usleep(DELAY);
+
+  test_call("CALL 1 2", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 1");
+
+  // Two frames in one write
+  {
+    char buf[64];
+    const char *a = "STATUS Between B1 1";
+    const char *b = "STATUS Opening 1 1";
+    uint16_t alen = htons(strlen(a)), blen = htons(strlen(b));
+    size_t n = 0;
+    memcpy(buf + n, &alen, 2); n += 2;
+    memcpy(buf + n, a, strlen(a)); n += strlen(a);
+    memcpy(buf + n, &blen, 2); n += 2;
+    memcpy(buf + n, b, strlen(b)); n += strlen(b);
+    send_looped(alpha, buf, n);
+  }
+  test_recv(alpha, "RECV: FLOOR 2");
+
+  // A frame that trickles in a byte at a time
+  {
+    const char *m = "STATUS Opening 2 2";
+    uint16_t len = htons(strlen(m));
+    send_looped(alpha, &len, 1);
+    usleep(DELAY);
+    send_looped(alpha, (char *)&len + 1, 1);
+    for (size_t i = 0; i < strlen(m); i++) {
+      send_looped(alpha, m + i, 1);
+    }
+  }
+  usleep(DELAY);
+  test_call("CALL 4 1", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 4");
+
+  close(alpha);
+  cleanup(p);
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(const char *backend)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--io", backend, NULL);
+  }
+
+  return pid;
+}
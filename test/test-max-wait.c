@@ -0,0 +1,146 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for controller --max-wait (a pickup that has waited half the bound
+// stops new stops from going ahead of it) and the wait metrics in STATS
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(const char *);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void test_stats(void);
+int run(const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  // Alpha is on its way up to 8 when someone at 3 wants to go down, and
+  // someone else gets on at 6 on the way. By the time a call up from 9
+  // comes in, the pickup at 3 is old enough that 9 has to wait for it.
+  pid_t p = controller("400");
+  int alpha = run("CALL 9 10");
+  send_message(alpha, "STATUS Opening 8 8");
+  test_recv(alpha, "RECV: FLOOR 3");
+  send_message(alpha, "STATUS Opening 3 3");
+  test_recv(alpha, "RECV: FLOOR 1");
+  send_message(alpha, "STATUS Opening 1 1");
+  test_recv(alpha, "RECV: FLOOR 9");
+  test_stats();
+  close(alpha);
+  cleanup(p);
+
+  // Without a bound, the car carries on up first
+  p = controller("0");
+  alpha = run("CALL 9 10");
+  send_message(alpha, "STATUS Opening 8 8");
+  test_recv(alpha, "RECV: FLOOR 9");
+  send_message(alpha, "STATUS Opening 9 9");
+  test_recv(alpha, "RECV: FLOOR 10");
+  send_message(alpha, "STATUS Opening 10 10");
+  test_recv(alpha, "RECV: FLOOR 3");
+  test_stats();
+  close(alpha);
+  cleanup(p);
+
+  printf("\nTests completed.\n");
+}
+
+// The shared start of both runs, up to Alpha being sent to 8
+int run(const char *late_call)
+{
+  usleep(DELAY);
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 4 4");
+  usleep(DELAY);
+
+  test_call("CALL 4 8", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 4");
+  send_message(alpha, "STATUS Opening 4 4");
+  test_recv(alpha, "RECV: FLOOR 8");
+  send_message(alpha, "STATUS Between 4 8");
+
+  // A fresh pickup going the other way waits for the sweep up, and a new
+  // one on the way goes ahead of it
+  test_call("CALL 3 1", "CAR Alpha");
+  test_call("CALL 6 7", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 6");
+
+  usleep(300000);
+  test_call(late_call, "CAR Alpha");
+  send_message(alpha, "STATUS Opening 6 6");
+  test_recv(alpha, "RECV: FLOOR 7");
+  send_message(alpha, "STATUS Opening 7 7");
+  test_recv(alpha, "RECV: FLOOR 8");
+  return alpha;
+}
+
+// Only the fields that don't depend on timing
+void test_stats(void)
+{
+  int fd = connect_to_controller();
+  send_message(fd, "STATS");
+  char *reply = receive_msg(fd);
+  unsigned calls = 0, overdue = 0;
+  long p50, p99, p999, max;
+  sscanf(reply, "STATS %u %ld %ld %ld %ld %u", &calls, &p50, &p99, &p999, &max, &overdue);
+  msg("Pickups: 3, p50 <= p99 <= max: yes");
+  printf("Pickups: %u, p50 <= p99 <= max: %s\n", calls, p50 <= p99 && p99 <= max ? "yes" : "no");
+  free(reply);
+  close(fd);
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(const char *max_wait_ms)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--max-wait", max_wait_ms, NULL);
+  }
+
+  return pid;
+}
@@ -0,0 +1,238 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for motion profiles (car --motion, and MOTION in dispatch)
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(void);
+pid_t car(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void recv_until(int, const char *);
+void test_motion(const char *, const char *);
+long time_until(int, const char *);
+void cleanup(pid_t);
+void server_init();
+void *simulate_heartbeat(void *);
+
+static car_shared_mem *shm;
+
+int server_fd;
+pthread_t heartbeat_tid;
+int heartbeat_cancel = 0;
+
+int main()
+{
+  // Alpha is nearer, but takes a long time to get going, so a one-floor
+  // hop costs it more than Beta's two floors
+  test_motion("MOTION 4 0.5 0.5 1", "CAR Beta");
+
+  // A malformed profile is ignored
+  test_motion("MOTION 4 0.5 0.5 x", "CAR Alpha");
+
+  // The car sends its profile after registering, and times its runs by it
+  shm_unlink("/carTest");
+  server_init();
+  pid_t p = car();
+  int fd = accept(server_fd, NULL, NULL);
+  test_recv(fd, "RECV: CAR Test 1 10");
+  test_recv(fd, "RECV: MOTION 4 4 16 1");
+  test_recv(fd, "RECV: STATUS Closed 1 1");
+
+  // The first storey of a run is spent speeding up; the middle ones go
+  // by at full speed, far quicker than the delay of 500ms
+  send_message(fd, "FLOOR 8");
+  long first = time_until(fd, "STATUS Between 2 8");
+  time_until(fd, "STATUS Between 4 8");
+  long middle = time_until(fd, "STATUS Between 5 8");
+  msg("First storey slower than a middle one: yes");
+  printf("First storey slower than a middle one: %s\n", first > 2 * middle ? "yes" : "no");
+  msg("Middle storey quicker than the delay: yes");
+  printf("Middle storey quicker than the delay: %s\n", middle < 400 ? "yes" : "no");
+  recv_until(fd, "STATUS Closed 8 8");
+
+  heartbeat_cancel = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_join(heartbeat_tid, NULL);
+  munmap(shm, sizeof(car_shared_mem));
+  close(fd);
+  close(server_fd);
+  cleanup(p);
+  shm_unlink("/carTest");
+
+  // Profiles that aren't four positive numbers are rejected
+  msg("Rejected");
+  fflush(stdout);
+  int status = system("./car Test 1 10 500 --motion 4,4,16 2>/dev/null");
+  printf("%s\n", WIFEXITED(status) && WEXITSTATUS(status) == 1 ? "Rejected" : "Accepted");
+  msg("Rejected");
+  fflush(stdout);
+  status = system("./car Test 1 10 500 --motion 0,4,16,1 2>/dev/null");
+  printf("%s\n", WIFEXITED(status) && WEXITSTATUS(status) == 1 ? "Rejected" : "Accepted");
+
+  printf("\nTests completed.\n");
+}
+
+// Alpha at 4 with the given profile and Beta at 7 without one, in busy
+// traffic so that calls go to the car whose route gets there soonest
+void test_motion(const char *motion, const char *expected)
+{
+  pid_t p = controller();
+  usleep(DELAY);
+  for (int i = 0; i < 12; i++) {
+    char call[16];
+    snprintf(call, sizeof(call), "CALL %d 9", 3 + i % 6);
+    int fd = connect_to_controller();
+    send_message(fd, call);
+    free(receive_msg(fd));
+    close(fd);
+  }
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, motion);
+  send_message(alpha, "STATUS Closed 4 4");
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 10");
+  send_message(beta, "STATUS Closed 7 7");
+  usleep(DELAY);
+  test_call("CALL 5 6", expected);
+
+  close(alpha);
+  close(beta);
+  cleanup(p);
+}
+
+// Milliseconds until the car sends the given status
+long time_until(int fd, const char *t)
+{
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  char *m = receive_msg(fd);
+  while (strcmp(m, t) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  free(m);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) * 1000L + (end.tv_nsec - start.tv_nsec) / 1000000L;
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+// Skip status updates until the expected one arrives
+void recv_until(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  while (strcmp(m, t) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(t);
+  printf("%s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow the process to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--traffic-window", "20000", NULL);
+  }
+
+  return pid;
+}
+
+pid_t car(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./car", "./car", "Test", "1", "10", "500", "--motion", "4,4,16,1", NULL);
+  }
+  usleep(DELAY);
+  int shm_fd = shm_open("/carTest", O_RDWR, 0666);
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  pthread_create(&heartbeat_tid, NULL, simulate_heartbeat, NULL);
+
+  return pid;
+}
+
+void server_init()
+{
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(3000);
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt_enable = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable));
+  if (bind(server_fd, (const struct sockaddr *)&a, sizeof(a)) == -1) {
+    perror("bind()");
+    exit(1);
+  }
+
+  listen(server_fd, 10);
+}
+
+void *simulate_heartbeat(void *_)
+{
+  pthread_mutex_lock(&shm->mutex);
+  for (;;) {
+
+    if (shm->safety_system != 1) {
+      shm->safety_system = 1;
+      pthread_cond_broadcast(&shm->cond);
+    }
+    pthread_cond_wait(&shm->cond, &shm->mutex);
+    if (heartbeat_cancel) break;
+  }
+  pthread_mutex_unlock(&shm->mutex);
+  return NULL;
+}
@@ -0,0 +1,169 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for car --overlap (door travel overlapped with the steps into and
+// out of a stop)
+
+#define DELAY 50000 // 50ms
+
+pid_t car(const char *);
+void test_recv(int, const char *);
+void recv_until(int, const char *);
+void test_run(int, const char *, const char *, long, const char *);
+void test_car(const char *, const char *);
+void cleanup(pid_t);
+void server_init();
+void *simulate_heartbeat(void *);
+
+static car_shared_mem *shm;
+
+int server_fd;
+pthread_t heartbeat_tid;
+int heartbeat_cancel = 0;
+
+int main()
+{
+  server_init();
+
+  // Each step takes the car's delay of 200ms
+  test_car(NULL, "full");
+
+  // The step into a stop and the step out of it are each 100ms shorter
+  test_car("100", "shortened");
+
+  // The overlap is capped at half the delay
+  test_car("500", "shortened");
+
+  close(server_fd);
+  printf("\nTests completed.\n");
+}
+
+// Send a car from 1 to 3, then on to 5 as soon as its doors open at 3, and
+// time both runs of two floors, the second from when the doors start closing
+void test_car(const char *overlap, const char *expected)
+{
+  shm_unlink("/carTest");
+  pid_t p = car(overlap);
+  int fd = accept(server_fd, NULL, NULL);
+  test_recv(fd, "RECV: CAR Test 1 6");
+  test_recv(fd, "RECV: STATUS Closed 1 1");
+
+  test_run(fd, "FLOOR 3", "STATUS Opening 3 3", 400, expected);
+  send_message(fd, "FLOOR 5");
+  recv_until(fd, "STATUS Closing 3 5");
+  test_run(fd, NULL, "STATUS Opening 5 5", 600, expected);
+
+  heartbeat_cancel = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_join(heartbeat_tid, NULL);
+  heartbeat_cancel = 0;
+  munmap(shm, sizeof(car_shared_mem));
+  close(fd);
+  cleanup(p);
+  shm_unlink("/carTest");
+}
+
+// Time from sending a FLOOR (or from now) until the car opens at the end of
+// its run. Shortening the steps into and out of a stop saves 200ms on the
+// full time.
+void test_run(int fd, const char *floor, const char *arrived, long full_ms, const char *expected)
+{
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (floor) send_message(fd, floor);
+  char *m = receive_msg(fd);
+  while (strcmp(m, arrived) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  free(m);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long run_ms = (end.tv_sec - start.tv_sec) * 1000L + (end.tv_nsec - start.tv_nsec) / 1000000L;
+
+  char line[32];
+  snprintf(line, sizeof(line), "Run: %s", expected);
+  msg(line);
+  printf("Run: %s\n", run_ms < full_ms - 100 ? "shortened" : "full");
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+// Skip status updates until the expected one arrives
+void recv_until(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  while (strcmp(m, t) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(t);
+  printf("%s\n", m);
+  free(m);
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow the process to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t car(const char *overlap)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (overlap) {
+      execlp("./car", "./car", "Test", "1", "6", "200", "--overlap", overlap, NULL);
+    }
+    execlp("./car", "./car", "Test", "1", "6", "200", NULL);
+  }
+  usleep(DELAY);
+  int shm_fd = shm_open("/carTest", O_RDWR, 0666);
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  pthread_create(&heartbeat_tid, NULL, simulate_heartbeat, NULL);
+
+  return pid;
+}
+
+void server_init()
+{
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(3000);
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt_enable = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable));
+  if (bind(server_fd, (const struct sockaddr *)&a, sizeof(a)) == -1) {
+    perror("bind()");
+    exit(1);
+  }
+
+  listen(server_fd, 10);
+}
+
+void *simulate_heartbeat(void *_)
+{
+  pthread_mutex_lock(&shm->mutex);
+  for (;;) {
+
+    if (shm->safety_system != 1) {
+      shm->safety_system = 1;
+      pthread_cond_broadcast(&shm->cond);
+    }
+    pthread_cond_wait(&shm->cond, &shm->mutex);
+    if (heartbeat_cancel) break;
+  }
+  pthread_mutex_unlock(&shm->mutex);
+  return NULL;
+}
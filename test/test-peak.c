@@ -0,0 +1,171 @@
+#include "shared.h"
+#include <sys/wait.h>
+#include <poll.h>
+
+// Tester for traffic mode detection (--traffic-window, --lobby) and
+// parking idle cars at the lobby in up-peak
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(const char *);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void test_quiet(int);
+void test_traffic(const char *);
+void place_calls(const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  // Most calls start at the lobby, which is 2 here
+  pid_t p = controller("10000");
+  usleep(DELAY);
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+  test_traffic("LIGHT");
+  place_calls("CALL 2 %d");
+  test_traffic("UP-PEAK");
+
+  // A car with nothing to do goes back to the lobby
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 10");
+  send_message(beta, "STATUS Closed 9 9");
+  test_recv(beta, "RECV: FLOOR 2");
+  close(alpha);
+  close(beta);
+  cleanup(p);
+
+  // Most calls end at the lobby
+  p = controller("10000");
+  usleep(DELAY);
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+  place_calls("CALL %d 2");
+  test_traffic("DOWN-PEAK");
+  close(alpha);
+  cleanup(p);
+
+  // Neither
+  p = controller("10000");
+  usleep(DELAY);
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+  place_calls("CALL %d 9");
+  test_traffic("INTERFLOOR");
+  close(alpha);
+  cleanup(p);
+
+  // With no window it stays light, and idle cars stay where they are
+  p = controller("0");
+  usleep(DELAY);
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+  place_calls("CALL 2 %d");
+  test_traffic("LIGHT");
+  beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 10");
+  send_message(beta, "STATUS Closed 9 9");
+  test_quiet(beta);
+  close(alpha);
+  close(beta);
+  cleanup(p);
+
+  printf("\nTests completed.\n");
+}
+
+// Twelve calls, enough to tell the traffic apart, to or from floors 3 to 8
+void place_calls(const char *fmt)
+{
+  for (int i = 0; i < 12; i++) {
+    char call[32];
+    snprintf(call, sizeof(call), fmt, 3 + i % 6);
+    int fd = connect_to_controller();
+    send_message(fd, call);
+    free(receive_msg(fd));
+    close(fd);
+  }
+}
+
+// Only the traffic mode; the other fields depend on timing
+void test_traffic(const char *expected)
+{
+  int fd = connect_to_controller();
+  send_message(fd, "STATS");
+  char *reply = receive_msg(fd);
+  char mode[16] = "";
+  sscanf(reply, "STATS %*u %*d %*d %*d %*d %*u %*u %*d %*d %15s", mode);
+  msg(expected);
+  printf("%s\n", mode);
+  free(reply);
+  close(fd);
+}
+
+// Nothing is sent for a couple of reallocation passes
+void test_quiet(int fd)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  msg("Nothing received");
+  printf("%s\n", poll(&pfd, 1, 1200) == 0 ? "Nothing received" : "Message received");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(const char *window_ms)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--lobby", "2", "--traffic-window", window_ms, NULL);
+  }
+
+  return pid;
+}
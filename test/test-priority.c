@@ -0,0 +1,142 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for PRIORITY and RESERVE calls (and call --priority/--reserve)
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  pid_t p = controller();
+  usleep(DELAY);
+
+  // Alpha is taking someone from 1 to 8 and has a pickup at 5 after that
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+  test_call("CALL 1 8", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 1");
+  send_message(alpha, "STATUS Opening 1 1");
+  test_recv(alpha, "RECV: FLOOR 8");
+  send_message(alpha, "STATUS Between 1 8");
+  test_call("CALL 5 3", "CAR Alpha");
+
+  // A priority call is collected on the way and taken straight where
+  // it's going, ahead of everyone already in the car
+  test_call("CALL 6 2 PRIORITY", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 6");
+  send_message(alpha, "STATUS Opening 6 6");
+  test_recv(alpha, "RECV: FLOOR 2");
+  send_message(alpha, "STATUS Opening 2 2");
+  test_recv(alpha, "RECV: FLOOR 8");
+  send_message(alpha, "STATUS Opening 8 8");
+  test_recv(alpha, "RECV: FLOOR 5");
+  close(alpha);
+  cleanup(p);
+
+  // Only Alpha can get to 2, so it's reserved for the call there
+  p = controller();
+  usleep(DELAY);
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 5 5");
+  usleep(DELAY);
+  test_call("CALL 8 9", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 8");
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 5 10");
+  send_message(beta, "STATUS Closed 6 6");
+  usleep(DELAY);
+
+  // Its waiting pickup is handed to Beta
+  test_call("CALL 2 3 RESERVE", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 2");
+  test_recv(beta, "RECV: FLOOR 8");
+
+  // Nothing else goes to Alpha meanwhile, even a call only Alpha can take
+  test_call("CALL 5 7", "CAR Beta");
+  test_call("CALL 4 1", "UNAVAILABLE");
+
+  // Half the cars are reserved already, so a second reservation is served
+  // as a priority call and Beta stays in service
+  test_call("CALL 9 10 RESERVE", "CAR Beta");
+  test_call("CALL 6 7", "CAR Beta");
+
+  // Once the reserved call is done, Alpha is back in service
+  send_message(alpha, "STATUS Opening 2 2");
+  test_recv(alpha, "RECV: FLOOR 3");
+  send_message(alpha, "STATUS Opening 3 3");
+  usleep(DELAY);
+  test_call("CALL 4 1", "CAR Alpha");
+
+  // The call point sends both forms
+  msg("Car Alpha is arriving.");
+  system("./call 3 1 --priority");
+  msg("Car Alpha is arriving.");
+  system("./call 7 6 --reserve");
+
+  close(alpha);
+  close(beta);
+  cleanup(p);
+  printf("\nTests completed.\n");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", NULL);
+  }
+
+  return pid;
+}
@@ -0,0 +1,123 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for controller --reallocate (moving a waiting pickup to a car
+// that can now get there sooner)
+
+#define DELAY 50000 // 50ms
+#define HOLD 2500000 // A little over the 2s a call stays put after it's placed
+
+pid_t controller(const char *);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  // Beta takes a call, then holds its doors open instead of going. Once
+  // the call has waited out its hold, it moves to Alpha.
+  pid_t p = controller("100");
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 10");
+  send_message(beta, "STATUS Closed 4 4");
+  usleep(DELAY);
+
+  test_call("CALL 5 6", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 5");
+  send_message(beta, "STATUS Opening 4 5");
+  usleep(DELAY);
+  send_message(beta, "STATUS Open 4 5");
+  usleep(HOLD);
+  test_recv(alpha, "RECV: FLOOR 5");
+
+  // Anyone else going up from 5 now joins Alpha
+  test_call("CALL 5 7", "CAR Alpha");
+
+  close(alpha);
+  close(beta);
+  cleanup(p);
+
+  // With reallocation off, the call stays with Beta
+  p = controller("0");
+  usleep(DELAY);
+
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 10");
+  send_message(beta, "STATUS Closed 4 4");
+  usleep(DELAY);
+
+  test_call("CALL 5 6", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 5");
+  send_message(beta, "STATUS Opening 4 5");
+  usleep(DELAY);
+  send_message(beta, "STATUS Open 4 5");
+  usleep(HOLD);
+  test_call("CALL 5 7", "CAR Beta");
+
+  close(alpha);
+  close(beta);
+  cleanup(p);
+  printf("\nTests completed.\n");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(const char *reallocate_ms)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--reallocate", reallocate_ms, NULL);
+  }
+
+  return pid;
+}
@@ -0,0 +1,130 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for car --reattach (restart on the shared memory a crashed car left behind)
+
+#define DELAY 50000 // 50ms
+
+void displaycond(car_shared_mem *);
+pid_t car(const char *, const char *, int);
+void map_shm(void);
+void crash(pid_t);
+void cleanup(pid_t);
+
+int shm_fd;
+static car_shared_mem *shm;
+
+int main()
+{
+  shm_unlink("/carTest"); // Remove shm object if it exists
+  pid_t p;
+
+  p = car("1", "8", 0);
+  map_shm();
+  msg("Current state: {1, 1, Closed, 0, 0, 0, 0, 0, 0, 0}");
+  displaycond(shm);
+
+  // A second instance must not take over a car that is still running
+  pid_t second = car("1", "8", 1);
+  int status;
+  waitpid(second, &status, 0);
+  msg("Second car exited with status 1");
+  printf("Second car exited with status %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+  msg("Current state: {1, 1, Closed, 0, 0, 0, 0, 0, 0, 0}");
+  displaycond(shm);
+
+  // The car has made its way to floor 5. Something takes the segment's
+  // mutex, wakes the car, then dies holding the mutex as the car crashes.
+  pid_t holder = fork();
+  if (holder == 0) {
+    pthread_mutex_lock(&shm->mutex);
+    strcpy(shm->current_floor, "5");
+    strcpy(shm->destination_floor, "5");
+    pthread_cond_broadcast(&shm->cond);
+    usleep(DELAY);
+    kill(p, SIGKILL);
+    _exit(0);
+  }
+  waitpid(holder, NULL, 0);
+  waitpid(p, NULL, 0);
+
+  // The restarted car recovers the mutex and carries on from floor 5
+  p = car("1", "8", 1);
+  msg("Current state: {5, 5, Closed, 0, 0, 0, 0, 0, 0, 0}");
+  displaycond(shm);
+
+  // The doors still work
+  pthread_mutex_lock(&shm->mutex);
+  shm->open_button = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_mutex_unlock(&shm->mutex);
+  usleep(30000);
+  msg("Current state: {5, 5, Open, 0, 0, 0, 0, 0, 0, 0}");
+  displaycond(shm);
+  crash(p);
+
+  // A segment left by a car with a different range is discarded
+  munmap(shm, sizeof(car_shared_mem));
+  close(shm_fd);
+  p = car("1", "4", 1);
+  map_shm();
+  msg("Current state: {1, 1, Closed, 0, 0, 0, 0, 0, 0, 0}");
+  displaycond(shm);
+
+  cleanup(p);
+  printf("\nTests completed.\n");
+}
+
+void cleanup(pid_t p)
+{
+  munmap(shm, sizeof(car_shared_mem));
+  close(shm_fd);
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+  shm_unlink("/carTest");
+}
+
+void crash(pid_t p)
+{
+  kill(p, SIGKILL);
+  waitpid(p, NULL, 0);
+}
+
+void displaycond(car_shared_mem *s)
+{
+  pthread_mutex_lock(&s->mutex);
+  printf("Current state: {%s, %s, %s, %d, %d, %d, %d, %d, %d, %d}\n",
+    s->current_floor,
+    s->destination_floor,
+    s->status,
+    s->open_button,
+    s->close_button,
+    s->door_obstruction,
+    s->overload,
+    s->emergency_stop,
+    s->individual_service_mode,
+    s->emergency_mode
+  );
+  pthread_mutex_unlock(&s->mutex);
+}
+
+void map_shm(void)
+{
+  shm_fd = shm_open("/carTest", O_RDWR, 0666);
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+}
+
+pid_t car(const char *lowest_floor, const char *highest_floor, int reattach)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (reattach) {
+      execlp("./car", "./car", "Test", lowest_floor, highest_floor, "20", "--reattach", NULL);
+    } else {
+      execlp("./car", "./car", "Test", lowest_floor, highest_floor, "20", NULL);
+    }
+  }
+  usleep(DELAY);
+  return pid;
+}
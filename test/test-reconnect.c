@@ -0,0 +1,223 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for car reconnects (backoff while the controller is down, resuming
+// a trip after the connection drops) and for the controller keeping a
+// reconnecting car's stops
+
+#define DELAY 50000 // 50ms
+
+pid_t car(const char *, const char *, const char *, const char *);
+pid_t controller(void);
+int connect_to_controller(void);
+void cleanup_car(pid_t);
+void cleanup_controller(pid_t);
+void server_init();
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void recv_until(int, const char *);
+void *simulate_heartbeat(void *);
+
+static car_shared_mem *shm;
+
+int server_fd;
+pthread_t heartbeat_tid;
+int heartbeat_cancel = 0;
+
+int main()
+{
+  shm_unlink("/carTest"); // Remove shm object if it exists
+
+  // The car starts before there is anything to connect to, and keeps
+  // trying until the controller turns up
+  pid_t p = car("Test", "1", "8", "100");
+  usleep(300000);
+  server_init();
+
+  int fd = accept(server_fd, NULL, NULL);
+  test_recv(fd, "RECV: CAR Test 1 8");
+  test_recv(fd, "RECV: STATUS Closed 1 1");
+
+  // Drop the connection partway through a trip
+  send_message(fd, "FLOOR 8");
+  recv_until(fd, "STATUS Between 2 8");
+  close(fd);
+
+  // The car registers again and is still on its way to floor 8
+  fd = accept(server_fd, NULL, NULL);
+  test_recv(fd, "RECV: CAR Test 1 8");
+  {
+    char *m = receive_msg(fd);
+    char *dest = strrchr(m, ' ');
+    msg("Destination after reconnecting: 8");
+    printf("Destination after reconnecting: %s\n", dest ? dest + 1 : m);
+    free(m);
+  }
+  recv_until(fd, "STATUS Opening 8 8");
+
+  close(fd);
+  close(server_fd);
+  cleanup_car(p);
+
+  // A car that reconnects to the controller gets its next stop again
+  p = controller();
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 4");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+  test_call("CALL 2 4", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 2");
+  close(alpha);
+  usleep(DELAY);
+
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 4");
+  test_recv(alpha, "RECV: FLOOR 2");
+  send_message(alpha, "STATUS Between 1 2");
+  send_message(alpha, "STATUS Opening 2 2");
+  test_recv(alpha, "RECV: FLOOR 4");
+  close(alpha);
+  usleep(DELAY);
+
+  // A car that comes back serving different floors starts afresh
+  alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 6");
+  send_message(alpha, "STATUS Closed 5 5");
+  usleep(DELAY);
+  test_call("CALL 6 1", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 6");
+
+  close(alpha);
+  cleanup_controller(p);
+  printf("\nTests completed.\n");
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+// Skip status updates until the expected one arrives
+void recv_until(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  while (strcmp(m, t) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(t);
+  printf("%s\n", m);
+  free(m);
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup_car(pid_t p)
+{
+  heartbeat_cancel = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_join(heartbeat_tid, NULL);
+
+  munmap(shm, sizeof(car_shared_mem));
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+  shm_unlink("/carTest");
+}
+
+void cleanup_controller(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", NULL);
+  }
+
+  return pid;
+}
+
+pid_t car(const char *name, const char *lowest_floor, const char *highest_floor, const char *delay)
+{
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./car", "./car", name, lowest_floor, highest_floor, delay, NULL);
+  }
+  usleep(DELAY);
+  int shm_fd = shm_open("/carTest", O_RDWR, 0666);
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  pthread_create(&heartbeat_tid, NULL, simulate_heartbeat, NULL);
+
+  return pid;
+}
+
+void server_init()
+{
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(3000);
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt_enable = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable));
+  if (bind(server_fd, (const struct sockaddr *)&a, sizeof(a)) == -1) {
+    perror("bind()");
+    exit(1);
+  }
+
+  listen(server_fd, 10);
+}
+
+void *simulate_heartbeat(void *_)
+{
+  pthread_mutex_lock(&shm->mutex);
+  for (;;) {
+
+    if (shm->safety_system != 1) {
+      shm->safety_system = 1;
+      pthread_cond_broadcast(&shm->cond);
+    }
+    pthread_cond_wait(&shm->cond, &shm->mutex);
+    if (heartbeat_cancel) break;
+  }
+  pthread_mutex_unlock(&shm->mutex);
+  return NULL;
+}
@@ -0,0 +1,203 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for retargeting a car while it is between floors
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(void);
+pid_t car(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void recv_until(int, const char *);
+void cleanup(pid_t);
+void server_init();
+void *simulate_heartbeat(void *);
+
+static car_shared_mem *shm;
+
+int server_fd;
+pthread_t heartbeat_tid;
+int heartbeat_cancel = 0;
+
+int main()
+{
+  pid_t p = controller();
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+  test_call("CALL 1 6", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 1");
+  send_message(alpha, "STATUS Opening 1 1");
+  test_recv(alpha, "RECV: FLOOR 6");
+
+  // A stop the car can still make is sent while it's moving
+  send_message(alpha, "STATUS Closed 1 6");
+  send_message(alpha, "STATUS Between 1 6");
+  send_message(alpha, "STATUS Between 2 6");
+  usleep(DELAY);
+  test_call("CALL 4 5", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 4");
+
+  // Heading into 4, floor 3 is behind the car, so that pickup waits
+  send_message(alpha, "STATUS Between 3 4");
+  usleep(DELAY);
+  test_call("CALL 3 7", "CAR Alpha");
+  send_message(alpha, "STATUS Opening 4 4");
+  test_recv(alpha, "RECV: FLOOR 5");
+
+  close(alpha);
+  cleanup(p);
+
+  // The car takes a new target mid-run if it hasn't passed it
+  shm_unlink("/carTest");
+  server_init();
+  p = car();
+  int fd = accept(server_fd, NULL, NULL);
+  test_recv(fd, "RECV: CAR Test 1 8");
+  test_recv(fd, "RECV: STATUS Closed 1 1");
+  send_message(fd, "FLOOR 6");
+  recv_until(fd, "STATUS Between 2 6");
+  send_message(fd, "FLOOR 4");
+  recv_until(fd, "STATUS Opening 4 4");
+  recv_until(fd, "STATUS Closed 4 4");
+
+  // A floor it has already passed is held until it stops, then served
+  send_message(fd, "FLOOR 6");
+  recv_until(fd, "STATUS Between 5 6");
+  send_message(fd, "FLOOR 5");
+  recv_until(fd, "STATUS Opening 6 6");
+  recv_until(fd, "STATUS Opening 5 5");
+
+  heartbeat_cancel = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_join(heartbeat_tid, NULL);
+  munmap(shm, sizeof(car_shared_mem));
+  close(fd);
+  close(server_fd);
+  cleanup(p);
+  shm_unlink("/carTest");
+
+  printf("\nTests completed.\n");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+// Skip status updates until the expected one arrives
+void recv_until(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  while (strcmp(m, t) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(t);
+  printf("%s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow the process to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", NULL);
+  }
+
+  return pid;
+}
+
+pid_t car(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./car", "./car", "Test", "1", "8", "100", NULL);
+  }
+  usleep(DELAY);
+  int shm_fd = shm_open("/carTest", O_RDWR, 0666);
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  pthread_create(&heartbeat_tid, NULL, simulate_heartbeat, NULL);
+
+  return pid;
+}
+
+void server_init()
+{
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(3000);
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt_enable = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable));
+  if (bind(server_fd, (const struct sockaddr *)&a, sizeof(a)) == -1) {
+    perror("bind()");
+    exit(1);
+  }
+
+  listen(server_fd, 10);
+}
+
+void *simulate_heartbeat(void *_)
+{
+  pthread_mutex_lock(&shm->mutex);
+  for (;;) {
+
+    if (shm->safety_system != 1) {
+      shm->safety_system = 1;
+      pthread_cond_broadcast(&shm->cond);
+    }
+    pthread_cond_wait(&shm->cond, &shm->mutex);
+    if (heartbeat_cancel) break;
+  }
+  pthread_mutex_unlock(&shm->mutex);
+  return NULL;
+}
@@ -0,0 +1,216 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for the message tokenizer (malformed frames on both the
+// controller and the car side)
+
+#define DELAY 50000 // 50ms
+
+pid_t controller(void);
+pid_t car(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void test_unknown(const char *);
+void cleanup(pid_t);
+void server_init();
+void *simulate_heartbeat(void *);
+
+static car_shared_mem *shm;
+
+int server_fd;
+pthread_t heartbeat_tid;
+int heartbeat_cancel = 0;
+
+int main()
+{
+  pid_t p = controller();
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha B2 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+
+  // Floors that don't survive the floor codec
+  test_call("CALL 1", "UNAVAILABLE");
+  test_call("CALL 0 2", "UNAVAILABLE");
+  test_call("CALL B0 2", "UNAVAILABLE");
+  test_call("CALL 1 1000", "UNAVAILABLE");
+  test_call("CALL 01 2", "UNAVAILABLE");
+  test_call("CALL 1x 2", "UNAVAILABLE");
+  test_call("CALL 1 2 3", "UNAVAILABLE");
+
+  // Unknown opcodes, including ones that share a prefix with real ones
+  test_unknown("CALLS 1 2");
+  test_unknown("CAL 1 2");
+  test_unknown("");
+
+  // Malformed car messages are ignored; well-formed ones still work
+  send_message(alpha, "STATUS Closed");
+  send_message(alpha, "STATUS Sideways 1 1");
+  send_message(alpha, "STATUS Closed B0 B0");
+  send_message(alpha, "STATUS Closed B2 B2");
+  usleep(DELAY);
+  test_call("CALL B1 5", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR B1");
+
+  // Extra spaces between fields are tolerated
+  send_message(alpha, "STATUS  Opening  B1  B1");
+  test_recv(alpha, "RECV: FLOOR 5");
+
+  close(alpha);
+  cleanup(p);
+
+  // The car drops FLOORs it can't parse or can't reach
+  shm_unlink("/carTest");
+  server_init();
+  p = car();
+  int fd = accept(server_fd, NULL, NULL);
+  test_recv(fd, "RECV: CAR Test 1 4");
+  test_recv(fd, "RECV: STATUS Closed 1 1");
+  send_message(fd, "FLOOR 9");
+  send_message(fd, "FLOOR B1");
+  send_message(fd, "FLOOR x");
+  send_message(fd, "FLOOR");
+  send_message(fd, "FLOOR 3");
+  {
+    msg("RECV: STATUS Closed 1 3 (or Between 1 3)");
+    char *m = receive_msg(fd);
+    printf("RECV: %s\n", m);
+    if (strstr(m, "Closed") != NULL) {
+      test_recv(fd, "RECV: STATUS Between 1 3");
+    }
+    free(m);
+  }
+  test_recv(fd, "RECV: STATUS Between 2 3");
+  test_recv(fd, "RECV: STATUS Opening 3 3");
+
+  heartbeat_cancel = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_join(heartbeat_tid, NULL);
+  munmap(shm, sizeof(car_shared_mem));
+  close(fd);
+  close(server_fd);
+  cleanup(p);
+  shm_unlink("/carTest");
+
+  printf("\nTests completed.\n");
+}
+
+// The controller hangs up on a first message it doesn't understand
+void test_unknown(const char *sendmsg)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char buf[64];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0);
+  msg("Connection closed");
+  printf("%s\n", n == 0 ? "Connection closed" : "read() failed");
+  close(fd);
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow the process to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", NULL);
+  }
+
+  return pid;
+}
+
+pid_t car(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./car", "./car", "Test", "1", "4", "20", NULL);
+  }
+  usleep(DELAY);
+  int shm_fd = shm_open("/carTest", O_RDWR, 0666);
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  pthread_create(&heartbeat_tid, NULL, simulate_heartbeat, NULL);
+
+  return pid;
+}
+
+void server_init()
+{
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(3000);
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt_enable = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable));
+  if (bind(server_fd, (const struct sockaddr *)&a, sizeof(a)) == -1) {
+    perror("bind()");
+    exit(1);
+  }
+
+  listen(server_fd, 10);
+}
+
+void *simulate_heartbeat(void *_)
+{
+  pthread_mutex_lock(&shm->mutex);
+  for (;;) {
+
+    if (shm->safety_system != 1) {
+      shm->safety_system = 1;
+      pthread_cond_broadcast(&shm->cond);
+    }
+    pthread_cond_wait(&shm->cond, &shm->mutex);
+    if (heartbeat_cancel) break;
+  }
+  pthread_mutex_unlock(&shm->mutex);
+  return NULL;
+}
@@ -0,0 +1,235 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for --topology (a building with no 13th floor, a car that skips a
+// floor and one that runs express) on the controller, the car and call
+
+#define DELAY 50000 // 50ms
+#define TOPOLOGY "/tmp/test-topology.txt"
+
+pid_t controller(void);
+pid_t car(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void recv_until(int, const char *);
+void test_departure(int, const char *);
+void cleanup(pid_t);
+void server_init();
+void *simulate_heartbeat(void *);
+
+static car_shared_mem *shm;
+
+int server_fd;
+pthread_t heartbeat_tid;
+int heartbeat_cancel = 0;
+
+int main()
+{
+  FILE *f = fopen(TOPOLOGY, "w");
+  fprintf(f, "# No 13th floor\nfloor 1 4 Lobby\n");
+  for (int i = 2; i <= 15; i++) {
+    if (i != 13) fprintf(f, "floor %d 3\n", i);
+  }
+  fprintf(f, "skip Beta 14\nexpress Gamma Lobby 12\n");
+  fclose(f);
+
+  pid_t p = controller();
+  usleep(DELAY);
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 15");
+  send_message(alpha, "STATUS Closed 1 1");
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 15");
+  send_message(beta, "STATUS Closed 12 12");
+  int gamma = connect_to_controller();
+  send_message(gamma, "CAR Gamma 1 15");
+  send_message(gamma, "STATUS Closed 12 12");
+  usleep(DELAY);
+
+  // There's no 13th floor to call from
+  test_call("CALL 13 1", "UNAVAILABLE");
+
+  // Beta passes 14 without stopping, and Gamma can't stop between the
+  // lobby and 12
+  test_call("CALL 12 14", "CAR Gamma");
+  test_recv(gamma, "RECV: FLOOR 12");
+  test_call("CALL 11 9", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 11");
+
+  // call takes the labels from the file, and knows which floors exist
+  msg("Car Alpha is arriving.");
+  fflush(stdout);
+  system("./call Lobby 2 --topology " TOPOLOGY);
+  msg("Invalid floor(s) specified.");
+  fflush(stdout);
+  system("./call 13 2 --topology " TOPOLOGY);
+
+  close(alpha);
+  close(beta);
+  close(gamma);
+  cleanup(p);
+
+  // Gamma itself ignores floors it runs past, and goes from 12 to 14
+  // without a 13th floor in between
+  shm_unlink("/carGamma");
+  server_init();
+  p = car();
+  int fd = accept(server_fd, NULL, NULL);
+  test_recv(fd, "RECV: CAR Gamma 1 15");
+  test_recv(fd, "RECV: STATUS Closed 1 1");
+  send_message(fd, "FLOOR 5");
+  send_message(fd, "FLOOR 12");
+  test_departure(fd, "1 12");
+  recv_until(fd, "STATUS Closed 12 12");
+  send_message(fd, "FLOOR 13");
+  send_message(fd, "FLOOR 14");
+  test_departure(fd, "12 14");
+  test_recv(fd, "RECV: STATUS Opening 14 14");
+
+  heartbeat_cancel = 1;
+  pthread_cond_broadcast(&shm->cond);
+  pthread_join(heartbeat_tid, NULL);
+  munmap(shm, sizeof(car_shared_mem));
+  close(fd);
+  close(server_fd);
+  cleanup(p);
+  shm_unlink("/carGamma");
+  unlink(TOPOLOGY);
+
+  printf("\nTests completed.\n");
+}
+
+// The car may report where it's going before it sets off
+void test_departure(int fd, const char *floors)
+{
+  char closed[32], between[32], expected[64];
+  snprintf(closed, sizeof(closed), "STATUS Closed %s", floors);
+  snprintf(between, sizeof(between), "STATUS Between %s", floors);
+  snprintf(expected, sizeof(expected), "RECV: %s", between);
+  char *m = receive_msg(fd);
+  if (strcmp(m, closed) == 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(expected);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+// Skip status updates until the expected one arrives
+void recv_until(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  while (strcmp(m, t) != 0) {
+    free(m);
+    m = receive_msg(fd);
+  }
+  msg(t);
+  printf("%s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow the process to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--topology", TOPOLOGY, NULL);
+  }
+
+  return pid;
+}
+
+pid_t car(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./car", "./car", "Gamma", "1", "15", "50", "--topology", TOPOLOGY, NULL);
+  }
+  usleep(DELAY);
+  int shm_fd = shm_open("/carGamma", O_RDWR, 0666);
+  shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  close(shm_fd);
+  pthread_create(&heartbeat_tid, NULL, simulate_heartbeat, NULL);
+
+  return pid;
+}
+
+void server_init()
+{
+  struct sockaddr_in a;
+  memset(&a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_port = htons(3000);
+  a.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt_enable = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable));
+  if (bind(server_fd, (const struct sockaddr *)&a, sizeof(a)) == -1) {
+    perror("bind()");
+    exit(1);
+  }
+
+  listen(server_fd, 10);
+}
+
+void *simulate_heartbeat(void *_)
+{
+  pthread_mutex_lock(&shm->mutex);
+  for (;;) {
+
+    if (shm->safety_system != 1) {
+      shm->safety_system = 1;
+      pthread_cond_broadcast(&shm->cond);
+    }
+    pthread_cond_wait(&shm->cond, &shm->mutex);
+    if (heartbeat_cancel) break;
+  }
+  pthread_mutex_unlock(&shm->mutex);
+  return NULL;
+}
@@ -0,0 +1,108 @@
+#include "shared.h"
+#include <sys/wait.h>
+
+// Tester for controller --workers (bounded call pool and admission control)
+
+#define DELAY 50000 // 50ms
+#define IDLE_CONNECTIONS 65 // One for the only worker, 64 for the accept queue
+
+pid_t controller(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  pid_t p = controller();
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 4");
+  send_message(alpha, "STATUS Closed 1 1");
+  usleep(DELAY);
+
+  // Clients that connect and say nothing tie up the only worker, then
+  // fill the accept queue behind it
+  int idle[IDLE_CONNECTIONS];
+  for (int i = 0; i < IDLE_CONNECTIONS; i++) {
+    idle[i] = connect_to_controller();
+  }
+  usleep(DELAY);
+
+  // Calls are turned away straight away with a retry hint
+  test_call("CALL 1 3", "UNAVAILABLE RETRY 200");
+
+  // Cars still get in, and the car that was already connected still works
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 4");
+  send_message(beta, "STATUS Closed 4 4");
+  send_message(alpha, "STATUS Opening 1 1");
+  usleep(DELAY);
+
+  // Once the idle clients go away calls are served again
+  for (int i = 0; i < IDLE_CONNECTIONS; i++) {
+    close(idle[i]);
+  }
+  usleep(DELAY);
+  test_call("CALL 4 2", "CAR Beta");
+  test_recv(beta, "RECV: FLOOR 4");
+
+  close(alpha);
+  close(beta);
+  cleanup(p);
+  printf("\nTests completed.\n");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  char *m = receive_msg(fd);
+  msg(t);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+  waitpid(p, NULL, 0);
+}
+
+pid_t controller(void)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", "--workers", "1", NULL);
+  }
+
+  return pid;
+}
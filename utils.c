@@ -10,54 +10,47 @@
  * - Not in the safety-critical monitoring loop
  * - Memory is freed immediately after use
  *
- * All I/O operations handle interrupts properly (EINTR/EAGAIN) and retry
- * automatically, so transient failures don't break the system.
+ * All I/O operations retry on interrupts (EINTR), so signals don't break the
+ * system. read_message() gives up on EAGAIN, which a blocking socket only
+ * reports once its SO_RCVTIMEO expires, so a stalled peer can't hold a reader.
  */
 
+// Integer floor codec: "B99".."B1" -> -99..-1, "1".."999" -> 1..999.
+// No leading zeros, signs or spaces. Returns 0 and sets *numeric if valid.
+int decode_floor(const char *floor, size_t len, int *numeric) {
+    int sign = 1;
+    if (len > 0 && floor[0] == 'B') {
+        sign = -1;
+        floor++;
+        len--;
+        if (len > 2) return -1;
+    }
+    if (len == 0 || len > 3 || floor[0] == '0') return -1;
+
+    int value = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (floor[i] < '0' || floor[i] > '9') return -1;
+        value = value * 10 + (floor[i] - '0');
+    }
+    *numeric = sign * value;
+    return 0;
+}
+
 // Parse floor string into numeric representation
 floor_info parse_floor(const char *const floor_str) {
     floor_info info = {0, 0, 0};
 
-    if (!floor_str || strlen(floor_str) == 0 || strlen(floor_str) > 3) {
+    if (!floor_str) {
         return info;
     }
 
-    if (floor_str[0] == 'B') {
-        // Basement floor
-        if (strlen(floor_str) < 2) return info;
-
-        char *endptr;
-        long floor_num = strtol(floor_str + 1, &endptr, 10);
-        if (*endptr != '\0' || floor_num < 1 || floor_num > 99) {
-            return info;
-        }
-
-        // Check for leading zeros (invalid)
-        if (floor_str[1] == '0' && floor_num != 0) {
-            return info;
-        }
-
-        info.ok = 1;
-        info.is_basement = 1;
-        info.numeric = -(int)floor_num; 
-    } else {
-        // Regular floor
-        char *endptr;
-        long floor_num = strtol(floor_str, &endptr, 10);
-        if (*endptr != '\0' || floor_num < 1 || floor_num > 999) {
-            return info;
-        }
-
-        // Check for leading zeros (invalid)
-        if (floor_str[0] == '0' && floor_num != 0) {
-            return info;
-        }
-
-        info.ok = 1;
-        info.is_basement = 0;
-        info.numeric = (int)floor_num;
+    size_t len = strnlen(floor_str, MAX_FLOOR_LEN);
+    if (len >= MAX_FLOOR_LEN || decode_floor(floor_str, len, &info.numeric) != 0) {
+        return info;
     }
 
+    info.ok = 1;
+    info.is_basement = info.numeric < 0;
     return info;
 }
 
@@ -100,9 +93,11 @@ void floor_to_string(int numeric, int is_basement, char *output) {
     }
 }
 
-// Get next floor towards destination
+// Get next floor towards destination. With a topology, floors the building
+// doesn't have are passed over.
 int next_floor_towards(const char *const current, const char *const destination,
-                       const char *const lowest, const char *const highest, char *output, size_t output_size) {
+                       const char *const lowest, const char *const highest,
+                       const building_topology *topology, char *output, size_t output_size) {
     if (!output || output_size < MAX_FLOOR_LEN) {
         return -1;
     }
@@ -115,14 +110,13 @@ int next_floor_towards(const char *const current, const char *const destination,
     }
 
     int direction = (dest.numeric > curr.numeric) ? 1 : -1;
-    int next_numeric = curr.numeric + direction;
+    int next_numeric = topology_move(topology, curr.numeric, direction);
+    if (next_numeric == 0) {
+        return -1;
+    }
 
     // Convert back to string format
-    if (next_numeric < 0) {
-        floor_to_string(next_numeric, 1, output);
-    } else {
-        floor_to_string(next_numeric, 0, output);
-    }
+    floor_to_string(next_numeric, next_numeric < 0, output);
 
     // Validate range
     if (!is_valid_floor_range(output, lowest, highest)) {
@@ -132,8 +126,225 @@ int next_floor_towards(const char *const current, const char *const destination,
     return 0;
 }
 
+// Dense index for a floor: B99..B1 -> 0..98, 1..999 -> 99..1097
+int floor_slot(int numeric) {
+    return numeric < 0 ? numeric + 99 : numeric + 98;
+}
+
+int slot_numeric(int slot) {
+    return slot < 99 ? slot - 99 : slot - 98;
+}
+
+static int topology_loaded(const building_topology *topo) {
+    return topo && topo->floor_count > 0;
+}
+
+static int topology_has(const building_topology *topo, int numeric) {
+    return numeric >= -99 && numeric <= 999 && numeric != 0 && topo->rank[floor_slot(numeric)] >= 0;
+}
+
+// A floor named in a topology file, by number or label. It must have been
+// declared already.
+static int topology_resolve(const building_topology *topo, const char *word, int *numeric) {
+    if (decode_floor(word, strlen(word), numeric) == 0) {
+        return topology_has(topo, *numeric) ? 0 : -1;
+    }
+    return topology_find_label(topo, word, numeric);
+}
+
+// "floor <floor> <storey-height> [<label>]". The storey height is the
+// distance up to the next floor.
+static const char *topology_add_floor(building_topology *topo, char **save) {
+    char *floor = strtok_r(NULL, " \t\r", save);
+    char *height = strtok_r(NULL, " \t\r", save);
+    char *label = strtok_r(NULL, " \t\r", save);
+    int numeric, other;
+    if (!height || strtok_r(NULL, " \t\r", save) || decode_floor(floor, strlen(floor), &numeric) != 0) {
+        return "expected floor <floor> <storey-height> [<label>]";
+    }
+
+    char *end;
+    double metres = strtod(height, &end);
+    if (*end != '\0' || !(metres > 0.0) || metres > 1000.0) return "bad storey height";
+    if (topology_has(topo, numeric)) return "floor listed twice";
+    if (label && (strlen(label) >= TOPOLOGY_LABEL_LEN || decode_floor(label, strlen(label), &other) == 0 ||
+                  topology_find_label(topo, label, &other) == 0)) {
+        return "bad or repeated label";
+    }
+
+    // Ranks and levels are filled in once every floor has been read
+    int slot = floor_slot(numeric);
+    topo->rank[slot] = 0;
+    topo->level[slot] = metres;
+    if (label) strcpy(topo->label[slot], label);
+    topo->floor_count++;
+    return NULL;
+}
+
+// The entry for a car named in the file, added if it is new. While loading,
+// its stops hold the floors it skips.
+static topology_car *topology_add_car(building_topology *topo, const char *name) {
+    if (!name || strlen(name) >= MAX_CAR_NAME_LEN) return NULL;
+    int index = topology_car_index(topo, name);
+    if (index >= 0) return &topo->cars[index];
+    if (topo->car_count >= (int)MAX_CARS) return NULL;
+
+    topology_car *car = &topo->cars[topo->car_count++];
+    strcpy(car->name, name);
+    return car;
+}
+
+// "skip <car> <floor>..." and "express <car> <from> <to>". An express car
+// runs past every floor strictly between from and to.
+static const char *topology_add_skip(building_topology *topo, int express, char **save) {
+    topology_car *car = topology_add_car(topo, strtok_r(NULL, " \t\r", save));
+    if (!car) return "bad car name, or too many cars";
+
+    int floors[2], count = 0;
+    for (char *word; (word = strtok_r(NULL, " \t\r", save)) != NULL; count++) {
+        int numeric;
+        if (topology_resolve(topo, word, &numeric) != 0) return "floor not listed before it is used";
+        if (express) {
+            if (count >= 2) return "expected express <car> <from> <to>";
+            floors[count] = numeric;
+        } else {
+            int slot = floor_slot(numeric);
+            car->stops[slot / 64] |= 1ULL << (slot % 64);
+        }
+    }
+    if (express && count != 2) return "expected express <car> <from> <to>";
+    if (count == 0) return "expected skip <car> <floor>...";
+
+    if (express) {
+        int lo = floor_slot(floors[0] < floors[1] ? floors[0] : floors[1]);
+        int hi = floor_slot(floors[0] < floors[1] ? floors[1] : floors[0]);
+        for (int slot = lo + 1; slot < hi; slot++) car->stops[slot / 64] |= 1ULL << (slot % 64);
+    }
+    return NULL;
+}
+
+// Read a building description. Returns 0, or -1 after saying what is wrong.
+int load_topology(const char *path, building_topology *topo) {
+    memset(topo, 0, sizeof(*topo));
+    for (size_t i = 0; i < MAX_FLOOR_COUNT; i++) topo->rank[i] = -1;
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    char line[512];
+    int line_no = 0;
+    const char *error = NULL;
+    while (!error && fgets(line, sizeof(line), f)) {
+        line_no++;
+        line[strcspn(line, "#\n")] = '\0';
+        char *save;
+        char *word = strtok_r(line, " \t\r", &save);
+        if (!word) continue;
+
+        if (strcmp(word, "floor") == 0) {
+            error = topology_add_floor(topo, &save);
+        } else if (strcmp(word, "skip") == 0) {
+            error = topology_add_skip(topo, 0, &save);
+        } else if (strcmp(word, "express") == 0) {
+            error = topology_add_skip(topo, 1, &save);
+        } else {
+            error = "unknown directive";
+        }
+    }
+    fclose(f);
+    if (!error && topo->floor_count < 2) {
+        error = "a building needs at least two floors";
+        line_no = 0;
+    }
+    if (error) {
+        fprintf(stderr, "%s:%d: %s\n", path, line_no, error);
+        topo->floor_count = 0;
+        return -1;
+    }
+
+    // Number the floors from the bottom and stack the storeys
+    uint64_t exists[TOPOLOGY_WORDS] = {0};
+    int rank = 0;
+    double level = 0.0;
+    for (int slot = 0; slot < (int)MAX_FLOOR_COUNT; slot++) {
+        if (topo->rank[slot] < 0) continue;
+        double storey = topo->level[slot];
+        topo->rank[slot] = (int16_t)rank;
+        topo->slot[rank++] = (int16_t)slot;
+        topo->level[slot] = level;
+        level += storey;
+        exists[slot / 64] |= 1ULL << (slot % 64);
+    }
+    for (int i = 0; i < topo->car_count; i++) {
+        for (size_t w = 0; w < TOPOLOGY_WORDS; w++) topo->cars[i].stops[w] = exists[w] & ~topo->cars[i].stops[w];
+    }
+    return 0;
+}
+
+// A car's entry, or -1 if the file doesn't name it
+int topology_car_index(const building_topology *topo, const char *name) {
+    for (int i = 0; i < topo->car_count; i++) {
+        if (strncmp(topo->cars[i].name, name, MAX_CAR_NAME_LEN) == 0) return i;
+    }
+    return -1;
+}
+
+// The floor with this label. Labels are only looked up when a floor is
+// named, so a scan is fine.
+int topology_find_label(const building_topology *topo, const char *label, int *numeric) {
+    if (label[0] == '\0') return -1;
+    for (int slot = 0; slot < (int)MAX_FLOOR_COUNT; slot++) {
+        if (strncmp(topo->label[slot], label, TOPOLOGY_LABEL_LEN) == 0) {
+            *numeric = slot_numeric(slot);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// 1 if the floor exists and the car (a topology_car_index) may open there.
+// Without a topology every floor does.
+int topology_stops_at(const building_topology *topo, int car, int numeric) {
+    if (!topology_loaded(topo)) return 1;
+    if (!topology_has(topo, numeric)) return 0;
+    int slot = floor_slot(numeric);
+    return car < 0 || ((topo->cars[car].stops[slot / 64] >> (slot % 64)) & 1U);
+}
+
+// The floor that many floors up (or down, if negative), or 0 past the top or
+// bottom of the building
+int topology_move(const building_topology *topo, int numeric, int floors) {
+    if (topology_loaded(topo) && topology_has(topo, numeric)) {
+        int rank = topo->rank[floor_slot(numeric)] + floors;
+        return rank >= 0 && rank < topo->floor_count ? slot_numeric(topo->slot[rank]) : 0;
+    }
+    int slot = floor_slot(numeric) + floors;
+    return slot >= 0 && slot < (int)MAX_FLOOR_COUNT ? slot_numeric(slot) : 0;
+}
+
+// Floors passed going from one floor to another
+int topology_floors(const building_topology *topo, int from, int to) {
+    if (topology_loaded(topo) && topology_has(topo, from) && topology_has(topo, to)) {
+        return abs(topo->rank[floor_slot(to)] - topo->rank[floor_slot(from)]);
+    }
+    return abs(floor_slot(to) - floor_slot(from));
+}
+
+// Metres from one floor to another. Without a topology every storey is
+// floor_height.
+double topology_distance(const building_topology *topo, int from, int to, double floor_height) {
+    if (topology_loaded(topo) && topology_has(topo, from) && topology_has(topo, to)) {
+        return fabs(topo->level[floor_slot(to)] - topo->level[floor_slot(from)]);
+    }
+    return topology_floors(topo, from, to) * floor_height;
+}
+
 // Create and initialize shared memory
-car_shared_mem *create_shared_memory(const char *const car_name, const char *const lowest_floor) {
+car_shared_mem *create_shared_memory(const char *const car_name, const char *const lowest_floor,
+                                     const char *const highest_floor) {
     char shm_name[32];
     snprintf(shm_name, sizeof(shm_name), "/car%s", car_name);
 
@@ -145,7 +356,7 @@ car_shared_mem *create_shared_memory(const char *const car_name, const char *con
     }
 
     // Set size
-    if (ftruncate(fd, sizeof(car_shared_mem)) == -1) {
+    if (ftruncate(fd, sizeof(car_shm_segment)) == -1) {
         perror("ftruncate");
         close(fd);
         shm_unlink(shm_name);
@@ -153,34 +364,43 @@ car_shared_mem *create_shared_memory(const char *const car_name, const char *con
     }
 
     // Map memory
-    car_shared_mem *mem = mmap(NULL, sizeof(car_shared_mem), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    car_shm_segment *seg = mmap(NULL, sizeof(car_shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     close(fd);
 
-    if (mem == MAP_FAILED) {
+    if (seg == MAP_FAILED) {
         perror("mmap");
         shm_unlink(shm_name);
         return NULL;
     }
+    car_shared_mem *mem = &seg->mem;
 
     // Initialise mutex and condition with process-shared attributes
     pthread_mutexattr_t ma;
     if (pthread_mutexattr_init(&ma) != 0) {
         perror("pthread_mutexattr_init");
-        munmap(mem, sizeof(car_shared_mem));
+        munmap(seg, sizeof(car_shm_segment));
         shm_unlink(shm_name);
         return NULL;
     }
     if (pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED) != 0) {
         perror("pthread_mutexattr_setpshared");
         pthread_mutexattr_destroy(&ma);
-        munmap(mem, sizeof(car_shared_mem));
+        munmap(seg, sizeof(car_shm_segment));
+        shm_unlink(shm_name);
+        return NULL;
+    }
+    // Robust so a restarted car can recover the lock if it died holding it
+    if (pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST) != 0) {
+        perror("pthread_mutexattr_setrobust");
+        pthread_mutexattr_destroy(&ma);
+        munmap(seg, sizeof(car_shm_segment));
         shm_unlink(shm_name);
         return NULL;
     }
     if (pthread_mutex_init(&mem->mutex, &ma) != 0) {
         perror("pthread_mutex_init");
         pthread_mutexattr_destroy(&ma);
-        munmap(mem, sizeof(car_shared_mem));
+        munmap(seg, sizeof(car_shm_segment));
         shm_unlink(shm_name);
         return NULL;
     }
@@ -190,7 +410,7 @@ car_shared_mem *create_shared_memory(const char *const car_name, const char *con
     if (pthread_condattr_init(&ca) != 0) {
         perror("pthread_condattr_init");
         pthread_mutex_destroy(&mem->mutex);
-        munmap(mem, sizeof(car_shared_mem));
+        munmap(seg, sizeof(car_shm_segment));
         shm_unlink(shm_name);
         return NULL;
     }
@@ -198,7 +418,7 @@ car_shared_mem *create_shared_memory(const char *const car_name, const char *con
         perror("pthread_condattr_setpshared");
         pthread_condattr_destroy(&ca);
         pthread_mutex_destroy(&mem->mutex);
-        munmap(mem, sizeof(car_shared_mem));
+        munmap(seg, sizeof(car_shm_segment));
         shm_unlink(shm_name);
         return NULL;
     }
@@ -206,7 +426,7 @@ car_shared_mem *create_shared_memory(const char *const car_name, const char *con
         perror("pthread_cond_init");
         pthread_condattr_destroy(&ca);
         pthread_mutex_destroy(&mem->mutex);
-        munmap(mem, sizeof(car_shared_mem));
+        munmap(seg, sizeof(car_shm_segment));
         shm_unlink(shm_name);
         return NULL;
     }
@@ -229,9 +449,135 @@ car_shared_mem *create_shared_memory(const char *const car_name, const char *con
     mem->individual_service_mode = 0;
     mem->emergency_mode = 0;
 
+    strncpy(seg->lowest, lowest_floor, sizeof(seg->lowest) - 1);
+    seg->lowest[sizeof(seg->lowest) - 1] = '\0';
+    strncpy(seg->highest, highest_floor, sizeof(seg->highest) - 1);
+    seg->highest[sizeof(seg->highest) - 1] = '\0';
+    seg->owner = getpid();
+    seg->layout_version = CAR_SHM_LAYOUT_VERSION;
+    seg->magic = CAR_SHM_MAGIC;      // Written last - marks the segment as complete
+
+    return mem;
+}
+
+static int is_terminated(const char *str, size_t max_len) {
+    return memchr(str, '\0', max_len) != NULL;
+}
+
+static int is_known_status(const char *status) {
+    static const char *const statuses[] = {"Opening", "Open", "Closing", "Closed", "Between"};
+    for (size_t i = 0; i < sizeof(statuses) / sizeof(statuses[0]); i++) {
+        if (strncmp(status, statuses[i], MAX_STATUS_LEN) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Lock the segment mutex, taking it over if the previous holder died
+int lock_shared_memory(car_shared_mem *mem) {
+    int rc = pthread_mutex_lock(&mem->mutex);
+    if (rc == EOWNERDEAD) {
+        // Fields may be half-updated; callers validate what they read
+        rc = pthread_mutex_consistent(&mem->mutex);
+    }
+    return rc;
+}
+
+// Wait on the segment condition with the mutex held, until signalled or
+// *deadline passes (NULL waits indefinitely). Recovers the mutex the same way
+// as lock_shared_memory(); nonzero means it is unusable and no longer held.
+int wait_shared_memory(car_shared_mem *mem, const struct timespec *deadline) {
+    int rc = deadline ? pthread_cond_timedwait(&mem->cond, &mem->mutex, deadline)
+                      : pthread_cond_wait(&mem->cond, &mem->mutex);
+    if (rc == EOWNERDEAD) {
+        rc = pthread_mutex_consistent(&mem->mutex);
+    }
+    return rc == ETIMEDOUT ? 0 : rc;
+}
+
+// 1 if the process that last drove a segment is still running. A recycled
+// pid reads as alive too, which only costs a fresh segment.
+static int owner_alive(pid_t owner) {
+    return owner > 0 && (kill(owner, 0) == 0 || errno == EPERM);
+}
+
+// Map the segment left behind by a car that didn't shut down cleanly, so it
+// can carry on from its stored position. Returns NULL if there is no segment
+// or its contents can't be trusted, with errno set to EBUSY if the car that
+// owns it is still running.
+car_shared_mem *reattach_shared_memory(const char *const car_name, const char *const lowest_floor,
+                                       const char *const highest_floor) {
+    char shm_name[32];
+    snprintf(shm_name, sizeof(shm_name), "/car%s", car_name);
+
+    int fd = shm_open(shm_name, O_RDWR, 0666);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(car_shm_segment)) {
+        close(fd);
+        return NULL;
+    }
+
+    car_shm_segment *seg = mmap(NULL, sizeof(car_shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Must be a segment from this layout, for the same floor range
+    if (seg->magic != CAR_SHM_MAGIC || seg->layout_version != CAR_SHM_LAYOUT_VERSION ||
+        !is_terminated(seg->lowest, sizeof(seg->lowest)) ||
+        !is_terminated(seg->highest, sizeof(seg->highest)) ||
+        strcmp(seg->lowest, lowest_floor) != 0 || strcmp(seg->highest, highest_floor) != 0) {
+        munmap(seg, sizeof(car_shm_segment));
+        return NULL;
+    }
+
+    car_shared_mem *mem = &seg->mem;
+    if (lock_shared_memory(mem) != 0) {
+        munmap(seg, sizeof(car_shm_segment));
+        return NULL;
+    }
+
+    // Checked under the lock so two restarts can't both claim the segment
+    if (owner_alive(seg->owner)) {
+        pthread_mutex_unlock(&mem->mutex);
+        munmap(seg, sizeof(car_shm_segment));
+        errno = EBUSY;
+        return NULL;
+    }
+
+    int valid = is_terminated(mem->current_floor, sizeof(mem->current_floor)) &&
+                is_terminated(mem->destination_floor, sizeof(mem->destination_floor)) &&
+                is_terminated(mem->status, sizeof(mem->status)) &&
+                is_valid_floor_range(mem->current_floor, lowest_floor, highest_floor) &&
+                parse_floor(mem->current_floor).ok &&
+                parse_floor(mem->destination_floor).ok &&
+                is_known_status(mem->status);
+
+    if (valid) {
+        // Out-of-range destinations are dropped rather than rejecting the segment
+        if (!is_valid_floor_range(mem->destination_floor, lowest_floor, highest_floor)) {
+            strncpy(mem->destination_floor, mem->current_floor, sizeof(mem->destination_floor) - 1);
+            mem->destination_floor[sizeof(mem->destination_floor) - 1] = '\0';
+        }
+        seg->owner = getpid();
+        pthread_cond_broadcast(&mem->cond);
+    }
+    pthread_mutex_unlock(&mem->mutex);
+
+    if (!valid) {
+        munmap(seg, sizeof(car_shm_segment));
+        return NULL;
+    }
     return mem;
 }
 
+
 // Open existing shared memory
 car_shared_mem *open_shared_memory(const char *const car_name) {
     char shm_name[32];
@@ -259,6 +605,248 @@ void cleanup_shared_memory(const char *const car_name) {
     shm_unlink(shm_name);
 }
 
+// Unlink the segment on shutdown, unless the name already belongs to a newer
+// one - a replacement car may have been started while this one was exiting
+void release_shared_memory(const char *const car_name) {
+    char shm_name[32];
+    snprintf(shm_name, sizeof(shm_name), "/car%s", car_name);
+
+    int fd = shm_open(shm_name, O_RDWR, 0666);
+    if (fd == -1) {
+        return;
+    }
+
+    // Unlink straight after the check to keep the window for a newcomer small
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(car_shm_segment)) {
+        car_shm_segment *seg = mmap(NULL, sizeof(car_shm_segment), PROT_READ, MAP_SHARED, fd, 0);
+        if (seg != MAP_FAILED) {
+            if (seg->owner == getpid()) {
+                shm_unlink(shm_name);
+            }
+            munmap(seg, sizeof(car_shm_segment));
+        }
+    }
+    close(fd);
+}
+
+// Map the space-separated feature tokens of a CAR registration to CAR_FEATURE_* bits.
+// Unknown tokens are ignored so newer cars still work with older controllers.
+unsigned int parse_car_features(const char *tokens) {
+    static const struct {
+        const char *name;
+        unsigned int bit;
+    } features[] = {
+        {"HEARTBEAT", CAR_FEATURE_HEARTBEAT},
+        {"ROUTE", CAR_FEATURE_ROUTE},
+        {"VACANT", CAR_FEATURE_VACANT},
+        {"DWELL", CAR_FEATURE_DWELL},
+    };
+
+    unsigned int result = 0;
+    const char *p = tokens;
+    while (p && *p) {
+        while (*p == ' ') p++;
+        size_t len = strcspn(p, " ");
+        for (size_t i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+            if (len == strlen(features[i].name) && strncmp(p, features[i].name, len) == 0) {
+                result |= features[i].bit;
+            }
+        }
+        p += len;
+    }
+    return result;
+}
+
+// Parse "<speed> <accel> <jerk> <floor-height>", separated by spaces or
+// commas. Returns 0 if all four are there and positive.
+int parse_motion(const char *spec, motion_profile *out) {
+    double values[4];
+    const char *p = spec;
+    for (int i = 0; i < 4; i++) {
+        char *end;
+        values[i] = strtod(p, &end);
+        if (end == p || !(values[i] > 0.0) || values[i] > 1e6) return -1;
+        p = end;
+        if (i < 3) {
+            if (*p != ' ' && *p != ',') return -1;
+            p++;
+        }
+    }
+    if (*p != '\0') return -1;
+
+    out->speed = values[0];
+    out->accel = values[1];
+    out->jerk = values[2];
+    out->floor_height = values[3];
+    return 0;
+}
+
+// Peak speed of a run of this many metres, and the time taken to reach it
+static double motion_peak(const motion_profile *m, double distance, double *ramp) {
+    double a = m->accel, j = m->jerk;
+
+    // Distance to speed up to v and slow down again is v * ramp(v), where the
+    // ramp has full acceleration in it only once v reaches a^2 / j
+    double full = a * a / j;
+    double v = m->speed;
+    if (v * (v >= full ? v / a + a / j : 2.0 * sqrt(v / j)) > distance) {
+        if (distance >= 2.0 * a * a * a / (j * j)) {
+            v = (sqrt(full * full + 4.0 * a * distance) - full) / 2.0;
+        } else {
+            v = cbrt(distance * distance * j / 4.0);
+        }
+    }
+    *ramp = v >= full ? v / a + a / j : 2.0 * sqrt(v / j);
+    return v;
+}
+
+// Seconds for a run of this many metres from rest to rest
+double motion_run_time(const motion_profile *m, double distance) {
+    if (distance <= 0.0) return 0.0;
+    double ramp;
+    double v = motion_peak(m, distance, &ramp);
+    return 2.0 * ramp + (distance - v * ramp) / v;
+}
+
+// Metres covered t seconds after setting off, speeding up towards v and then
+// holding it
+static double motion_ramp_position(const motion_profile *m, double v, double t) {
+    double j = m->jerk;
+    double edge = v >= m->accel * m->accel / j ? m->accel / j : sqrt(v / j);  // Jerk-limited time at each end
+    double peak = j * edge;                                                   // Acceleration reached
+    double hold = (v - peak * edge) / peak;                                   // Time at that acceleration
+
+    double x = 0.0, speed = 0.0;
+    double tau = t < edge ? t : edge;
+    x += j * tau * tau * tau / 6.0;
+    if (t <= edge) return x;
+    speed = j * edge * edge / 2.0;
+
+    tau = t - edge < hold ? t - edge : hold;
+    x += speed * tau + peak * tau * tau / 2.0;
+    if (t <= edge + hold) return x;
+    speed += peak * hold;
+
+    tau = t - edge - hold < edge ? t - edge - hold : edge;
+    x += speed * tau + peak * tau * tau / 2.0 - j * tau * tau * tau / 6.0;
+    if (t <= 2.0 * edge + hold) return x;
+
+    return x + v * (t - 2.0 * edge - hold);
+}
+
+// Seconds into a run of this many metres at which the car has covered
+// position metres. The run is symmetric, so the slowing half mirrors the
+// speeding up.
+double motion_time_at(const motion_profile *m, double distance, double position) {
+    if (position <= 0.0) return 0.0;
+    double total = motion_run_time(m, distance);
+    if (position >= distance) return total;
+
+    double ramp;
+    double v = motion_peak(m, distance, &ramp);
+    double lo = 0.0, hi = total;
+    for (int i = 0; i < 48; i++) {
+        double t = (lo + hi) / 2.0;
+        double x = t <= total / 2.0 ? motion_ramp_position(m, v, t)
+                                    : distance - motion_ramp_position(m, v, total - t);
+        if (x < position) lo = t; else hi = t;
+    }
+    return (lo + hi) / 2.0;
+}
+
+// Work out the opcode from the first word with a switch on its length and
+// first byte, so each frame costs at most one memcmp to classify
+static message_opcode classify_opcode(const char *word, size_t len, const char *rest) {
+    switch (len) {
+    case 3:
+        if (memcmp(word, "CAR", 3) == 0) return MSG_CAR;
+        break;
+    case 4:
+        switch (word[0]) {
+        case 'C': return memcmp(word, "CALL", 4) == 0 ? MSG_CALL : MSG_UNKNOWN;
+        case 'P':
+            if (memcmp(word, "PING", 4) == 0) return MSG_PING;
+            if (memcmp(word, "PONG", 4) == 0) return MSG_PONG;
+            break;
+        }
+        break;
+    case 5:
+        switch (word[0]) {
+        case 'D': return memcmp(word, "DWELL", 5) == 0 ? MSG_DWELL : MSG_UNKNOWN;
+        case 'F': return memcmp(word, "FLOOR", 5) == 0 ? MSG_FLOOR : MSG_UNKNOWN;
+        case 'R': return memcmp(word, "ROUTE", 5) == 0 ? MSG_ROUTE : MSG_UNKNOWN;
+        case 'S': return memcmp(word, "STATS", 5) == 0 ? MSG_STATS : MSG_UNKNOWN;
+        }
+        break;
+    case 6:
+        switch (word[0]) {
+        case 'C': return memcmp(word, "CANCEL", 6) == 0 ? MSG_CANCEL : MSG_UNKNOWN;
+        case 'M': return memcmp(word, "MOTION", 6) == 0 ? MSG_MOTION : MSG_UNKNOWN;
+        case 'S': return memcmp(word, "STATUS", 6) == 0 ? MSG_STATUS : MSG_UNKNOWN;
+        case 'V': return memcmp(word, "VACANT", 6) == 0 ? MSG_VACANT : MSG_UNKNOWN;
+        }
+        break;
+    case 9:
+        if (memcmp(word, "EMERGENCY", 9) == 0) return MSG_EMERGENCY;
+        break;
+    case 10:
+        // The only two-word opcode
+        if (memcmp(word, "INDIVIDUAL", 10) == 0 && strncmp(rest, " SERVICE", 8) == 0 &&
+            (rest[8] == '\0' || rest[8] == ' ')) {
+            return MSG_INDIVIDUAL_SERVICE;
+        }
+        break;
+    case 11:
+        if (memcmp(word, "UNAVAILABLE", 11) == 0) return MSG_UNAVAILABLE;
+        break;
+    }
+    return MSG_UNKNOWN;
+}
+
+// Split a frame into its opcode and fields in a single pass. Fields are
+// slices of message; nothing is copied. Words past MAX_MESSAGE_FIELDS are
+// left unsplit in the last field.
+message_opcode tokenize_message(const char *message, message_tokens *tokens) {
+    const char *p = message;
+    const char *word = p;
+    while (*p && *p != ' ') p++;
+
+    tokens->opcode = classify_opcode(word, (size_t)(p - word), p);
+    tokens->field_count = 0;
+    if (tokens->opcode == MSG_INDIVIDUAL_SERVICE) p += 8;
+
+    while (*p) {
+        while (*p == ' ') p++;
+        if (!*p) break;
+
+        message_slice *field = &tokens->fields[tokens->field_count];
+        field->ptr = p;
+        if (tokens->field_count == MAX_MESSAGE_FIELDS - 1) {
+            field->len = strlen(p);
+            tokens->field_count++;
+            break;
+        }
+        while (*p && *p != ' ') p++;
+        field->len = (size_t)(p - field->ptr);
+        tokens->field_count++;
+    }
+    return tokens->opcode;
+}
+
+// Copy a field into a fixed buffer. Returns -1 (and copies nothing) if it
+// doesn't fit with its terminator.
+int slice_copy(message_slice slice, char *out, size_t out_size) {
+    if (slice.len >= out_size) return -1;
+    memcpy(out, slice.ptr, slice.len);
+    out[slice.len] = '\0';
+    return 0;
+}
+
+int slice_equals(message_slice slice, const char *text) {
+    return strlen(text) == slice.len && memcmp(slice.ptr, text, slice.len) == 0;
+}
+
 // Send length prefixed message with robust error handling
 int write_message(int fd, const char *const message) {
     uint16_t len = htons(strlen(message));
@@ -317,17 +905,14 @@ char *read_message(int fd) {
     ssize_t total = sizeof(len);
     char *ptr = (char *)&len;
 
-    // Read length with EINTR/EAGAIN handling
+    // Read length with EINTR handling
     while (received < total) {
         ssize_t n = read(fd, ptr + received, total - received);
         if (n < 0) {
             if (errno == EINTR) {
                 continue;  // Interrupted, retry
             }
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                continue;  // Would block, retry
-            }
-            return NULL;  // Fatal error
+            return NULL;  // Fatal error or receive timeout
         }
         if (n == 0) {
             return NULL;  // Connection closed
@@ -341,7 +926,7 @@ char *read_message(int fd) {
     char *message = malloc(len + 1);
     if (!message) return NULL;
 
-    // Read message with EINTR/EAGAIN handling
+    // Read message with EINTR handling
     received = 0;
     total = len;
     ptr = message;
@@ -352,11 +937,8 @@ char *read_message(int fd) {
             if (errno == EINTR) {
                 continue;  // Interrupted, retry
             }
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                continue;  // Would block, retry
-            }
             free(message);
-            return NULL;  // Fatal error
+            return NULL;  // Fatal error or receive timeout
         }
         if (n == 0) {
             free(message);